@@ -21,9 +21,42 @@ void client_terminate() {
     server_keep_alive = 0;
 }
 
-int client_websocket_handler() {
-    // TODO implement client_websocket_handler
-    return 0;
+int client_websocket_handler(sock *client, int websocket) {
+    long ret;
+    // data sent by the client right after the request already belongs to the new protocol
+    if (client->buf != NULL && client->buf_off < client->buf_len) {
+        ret = sock_send(&rev_proxy, client->buf + client->buf_off, client->buf_len - client->buf_off, 0);
+        if (ret <= 0) {
+            print(ERR_STR "Unable to send: %s" CLR_STR, sock_strerror(&rev_proxy));
+            return -1;
+        }
+        client->buf_off = client->buf_len;
+    }
+    // as well as data sent by the server right after the response
+    if (rev_proxy.buf != NULL && rev_proxy.buf_off < rev_proxy.buf_len) {
+        char *buf = rev_proxy.buf + rev_proxy.buf_off;
+        unsigned long len = rev_proxy.buf_len - rev_proxy.buf_off;
+        ret = sock_send(client, buf, len, 0);
+        if (ret <= 0) {
+            print(ERR_STR "Unable to send: %s" CLR_STR, sock_strerror(client));
+            return -1;
+        }
+        rev_proxy.buf_off = rev_proxy.buf_len;
+        // pings may only be inserted between frames, which is not known anymore after a partial frame
+        tunnel_ws ws = {.left = 0, .hdr_len = 0};
+        if (websocket && !tunnel_ws_track(&ws, (unsigned char *) buf, len)) websocket = 0;
+    }
+
+    if (tunnel_handoff(client, &rev_proxy, websocket) == 0) {
+        metrics_inc(tunnels_handed_off);
+        print("Tunnel handed off to tunnel-relay");
+        return 0;
+    }
+
+    print("Tunnel established");
+    ret = tunnel_relay(client, &rev_proxy, websocket);
+    print("Tunnel closed");
+    return (int) ret;
 }
 
 int client_request_handler(sock *client, unsigned long client_num, unsigned int req_num) {
@@ -40,10 +73,20 @@ int client_request_handler(sock *client, unsigned long client_num, unsigned int
     FILE *file = NULL;
     msg_buf[0] = 0;
     int accept_if_modified_since = 0;
-    int use_fastcgi = 0;
-    int use_rev_proxy = 0;
-    fastcgi_conn php_fpm = {.socket = 0, .req_id = 0};
+    int use_fastcgi = 0, fastcgi_buffered = 0;
+    int use_rev_proxy = 0, proxy_buffered = 0, proxy_compressed_chunked = 0;
+    unsigned long proxy_compressed_len = 0;
+    int use_cache = 0;
+    unsigned char cache_key[SHA_DIGEST_LENGTH];
+    resp_cache_writer cache_w = {.file = NULL};
+    resp_cache_entry cache_entry;
+    int cache_found = 0, cache_conditional = 0, cache_revalidate = 0, cache_inflight = 0;
+    compress_ctx comp = {.type = COMPRESS_NONE};
+    fastcgi_conn php_fpm = {.socket = 0, .backend = 0, .req_id = 0, .in.buf = NULL, .err_buf = NULL};
     http_status custom_status;
+    spool req_body, resp_body;
+    spool_init(&req_body, request_buffer_size);
+    spool_init(&resp_body, response_buffer_size);
 
     http_res res;
     sprintf(res.version, "1.1");
@@ -59,7 +102,20 @@ int client_request_handler(sock *client, unsigned long client_num, unsigned int
     FD_SET(client->socket, &socket_fds);
     client_timeout.tv_sec = CLIENT_TIMEOUT;
     client_timeout.tv_usec = 0;
-    ret = select(client->socket + 1, &socket_fds, NULL, NULL, &client_timeout);
+    if (fastcgi_pool_idle() > 0 || rev_proxy_pool_idle() > 0) {
+        // do not keep idle PHP-FPM and proxy connections open while the client is idle
+        struct timeval pool_timeout = {.tv_sec = FASTCGI_IDLE_TIMEOUT, .tv_usec = 0};
+        ret = select(client->socket + 1, &socket_fds, NULL, NULL, &pool_timeout);
+        if (ret == 0) {
+            fastcgi_pool_close();
+            rev_proxy_pool_close();
+            FD_SET(client->socket, &socket_fds);
+            client_timeout.tv_sec = CLIENT_TIMEOUT - FASTCGI_IDLE_TIMEOUT;
+            ret = select(client->socket + 1, &socket_fds, NULL, NULL, &client_timeout);
+        }
+    } else {
+        ret = select(client->socket + 1, &socket_fds, NULL, NULL, &client_timeout);
+    }
     if (ret <= 0) {
         if (errno != 0) {
             return 1;
@@ -72,6 +128,9 @@ int client_request_handler(sock *client, unsigned long client_num, unsigned int
 
     http_req req;
     ret = http_receive_request(client, &req);
+    if (client_host_str == NULL && dns_reverse_poll(&client_host_str, 0) == 1 && client_host_str != NULL) {
+        print("Client host name: %s", client_host_str);
+    }
     if (ret != 0) {
         client_keep_alive = 0;
         if (ret < 0) {
@@ -155,7 +214,7 @@ int client_request_handler(sock *client, unsigned long client_num, unsigned int
             }
             goto respond;
         }
-    } else if (!client->enc) {
+    } else if (!client->enc && !PLAIN_HTTP_PROXY) {
         res.status = http_get_status(308);
         sprintf(buf0, "https://%s%s", host, req.uri);
         http_add_header_field(&res.hdr, "Location", buf0);
@@ -178,6 +237,10 @@ int client_request_handler(sock *client, unsigned long client_num, unsigned int
         } else if (strlen(uri.pathinfo) != 0 && conf->local.dir_mode != URI_DIR_MODE_INFO) {
             res.status = http_get_status(404);
             goto respond;
+        } else if (uri_is_internal(&uri, conf->local.internal)) {
+            // only reachable through X-Accel-Redirect or X-Sendfile
+            res.status = http_get_status(404);
+            goto respond;
         }
 
         if (uri.is_static) {
@@ -189,6 +252,7 @@ int client_request_handler(sock *client, unsigned long client_num, unsigned int
                 goto respond;
             }
 
+            static_file:
             ret = uri_cache_init(&uri);
             if (ret != 0) {
                 res.status = http_get_status(500);
@@ -277,40 +341,124 @@ int client_request_handler(sock *client, unsigned long client_num, unsigned int
             content_length = ftell(file);
             fseek(file, 0, SEEK_SET);
         } else {
+            http_body body;
+            ret = http_init_body(&body, &req, max_body_size);
+            if (ret != 0) {
+                client_keep_alive = 0;
+                if (ret == 2) {
+                    res.status = http_get_status(413);
+                } else {
+                    res.status = http_get_status(400);
+                    sprintf(err_msg, "Invalid Content-Length or Transfer-Encoding header field.");
+                }
+                goto respond;
+            }
+
+            use_cache = conf->local.cache_ttl > 0 && body.done &&
+                    (strcmp(req.method, "GET") == 0 || strcmp(req.method, "HEAD") == 0) &&
+                    http_get_header_field(&req.hdr, "Authorization") == NULL;
+            if (use_cache) {
+                resp_cache_key(cache_key, &req, host, conf->local.cache_key);
+                if (resp_cache_lookup(cache_key, &res, &file, &content_length) == 0) {
+                    metrics_inc(fastcgi_cache_hits);
+                    goto respond;
+                }
+                if (strcmp(req.method, "GET") == 0 && resp_cache_inflight_begin(cache_key) != 0) {
+                    // another process is fetching this response already
+                    if (resp_cache_inflight_wait(cache_key, RESP_CACHE_WAIT_TIMEOUT) != 0) {
+                        metrics_inc(cache_collapse_timeouts);
+                    } else if (resp_cache_lookup(cache_key, &res, &file, &content_length) == 0) {
+                        metrics_inc(cache_collapsed);
+                        goto respond;
+                    }
+                } else {
+                    cache_inflight = strcmp(req.method, "GET") == 0;
+                }
+                metrics_inc(fastcgi_cache_misses);
+            }
+
             struct stat statbuf;
             stat(uri.filename, &statbuf);
             char *last_modified = http_format_date(statbuf.st_mtime, buf0, sizeof(buf0));
             http_add_header_field(&res.hdr, "Last-Modified", last_modified);
 
+            if (!body.done && (request_buffering || body.chunked)) {
+                // receive the whole body before occupying a PHP-FPM worker,
+                // chunked bodies are always buffered, because CONTENT_LENGTH has to be known
+                ret = http_buffer_body(client, &body, &req_body);
+                if (ret != 0) {
+                    client_keep_alive = 0;
+                    if (ret == -1) {
+                        print(ERR_STR "Unable to receive: %s" CLR_STR, sock_strerror(client));
+                        goto abort;
+                    } else if (ret == -3) {
+                        res.status = http_get_status(413);
+                    } else if (ret == -4) {
+                        res.status = http_get_status(500);
+                        print(ERR_STR "Unable to buffer request body: %s" CLR_STR, strerror(errno));
+                        sprintf(err_msg, "Unable to buffer request body.");
+                    } else {
+                        res.status = http_get_status(400);
+                        sprintf(err_msg, "Unable to decode chunked request body.");
+                    }
+                    goto respond;
+                }
+                metrics_inc(req_body_buffered);
+                metrics_add(req_body_buffered_bytes, spool_len(&req_body));
+                if (req_body.fd >= 0) {
+                    metrics_inc(req_body_spooled);
+                    metrics_add(req_body_spooled_bytes, req_body.file_len);
+                }
+                http_remove_header_field(&req.hdr, "Transfer-Encoding", HTTP_REMOVE_ALL);
+                http_remove_header_field(&req.hdr, "Content-Length", HTTP_REMOVE_ALL);
+                sprintf(buf1, "%lu", spool_len(&req_body));
+                http_add_header_field(&req.hdr, "Content-Length", buf1);
+            }
+
+            int fastcgi_retry = 0;
+            fastcgi:
             res.status = http_get_status(200);
-            if (fastcgi_init(&php_fpm, client_num, req_num, client, &req, &uri) != 0) {
+            if (fastcgi_init(&php_fpm, conf, client_num, req_num, client, &req, &uri, fastcgi_retry) != 0) {
+                if (php_fpm.reused && !fastcgi_retry++) {
+                    // PHP-FPM may have closed the idle connection in the meantime
+                    fastcgi_release(&php_fpm, 0);
+                    goto fastcgi;
+                }
                 res.status = http_get_status(502);
                 sprintf(err_msg, "Unable to communicate with PHP-FPM.");
                 goto respond;
             }
 
-            if (strcmp(req.method, "POST") == 0 || strcmp(req.method, "PUT") == 0) {
-                char *client_content_length = http_get_header_field(&req.hdr, "Content-Length");
-                unsigned long client_content_len;
-                if (client_content_length == NULL) {
-                    goto fastcgi_end;
+            if (spool_len(&req_body) > 0) {
+                if (fastcgi_receive_spool(&php_fpm, &req_body) != 0) {
+                    res.status = http_get_status(502);
+                    sprintf(err_msg, "Unable to communicate with PHP-FPM.");
+                    goto respond;
                 }
-                client_content_len = strtoul(client_content_length, NULL, 10);
-                ret = fastcgi_receive(&php_fpm, client, client_content_len);
+            } else if (!body.done) {
+                ret = fastcgi_receive(&php_fpm, client, &body);
                 if (ret != 0) {
                     if (ret < 0) {
                         goto abort;
+                    }
+                    client_keep_alive = 0;
+                    if (ret == 3) {
+                        res.status = http_get_status(413);
                     } else {
-                        sprintf(err_msg, "Unable to communicate with PHP-FPM.");
+                        res.status = http_get_status(400);
+                        sprintf(err_msg, "Unable to decode chunked request body.");
                     }
-                    res.status = http_get_status(502);
                     goto respond;
                 }
             }
-            fastcgi_end:
             fastcgi_close_stdin(&php_fpm);
 
             ret = fastcgi_header(&php_fpm, &res, err_msg);
+            if (ret != 0 && php_fpm.reused && !fastcgi_retry++) {
+                fastcgi_release(&php_fpm, 0);
+                err_msg[0] = 0;
+                goto fastcgi;
+            }
             if (ret != 0) {
                 if (ret < 0) {
                     goto abort;
@@ -334,21 +482,297 @@ int client_request_handler(sock *client, unsigned long client_num, unsigned int
                 }
             }
 
+            char *accel_redirect = http_get_header_field(&res.hdr, "X-Accel-Redirect");
+            char *x_sendfile = http_get_header_field(&res.hdr, "X-Sendfile");
+            if (accel_redirect != NULL || x_sendfile != NULL) {
+                // the script only authorized the download, serve the file without passing it through PHP-FPM
+                unsigned long webroot_len = strlen(conf->local.webroot);
+                if (accel_redirect != NULL) {
+                    snprintf(buf1, sizeof(buf1), "%s", accel_redirect);
+                } else if (strncmp(x_sendfile, conf->local.webroot, webroot_len) == 0 && x_sendfile[webroot_len] == '/') {
+                    snprintf(buf1, sizeof(buf1), "%s", x_sendfile + webroot_len);
+                } else {
+                    buf1[0] = 0;
+                }
+                fastcgi_abort(&php_fpm);
+                if (cache_inflight) {
+                    // the file is not stored in the cache
+                    resp_cache_inflight_pass(cache_key);
+                    cache_inflight = 0;
+                }
+                http_remove_header_field(&res.hdr, "X-Accel-Redirect", HTTP_REMOVE_ALL);
+                http_remove_header_field(&res.hdr, "X-Sendfile", HTTP_REMOVE_ALL);
+                http_remove_header_field(&res.hdr, "Content-Type", HTTP_REMOVE_ALL);
+                http_remove_header_field(&res.hdr, "Content-Length", HTTP_REMOVE_ALL);
+                http_remove_header_field(&res.hdr, "Last-Modified", HTTP_REMOVE_ALL);
+                http_remove_header_field(&res.hdr, "ETag", HTTP_REMOVE_ALL);
+                http_remove_header_field(&res.hdr, "Cache-Control", HTTP_REMOVE_ALL);
+                if (buf1[0] == 0) {
+                    res.status = http_get_status(500);
+                    sprintf(err_msg, "The X-Sendfile path is outside of the webroot.");
+                    goto respond;
+                }
+
+                print("Internal redirect to %s", buf1);
+                uri_free(&uri);
+                ret = uri_init(&uri, conf->local.webroot, buf1, URI_DIR_MODE_FORBIDDEN);
+                if (ret == 0 && uri.filename == NULL && uri.is_dir && strlen(uri.pathinfo) == 0) {
+                    res.status = http_get_status(403);
+                    goto respond;
+                } else if (ret != 0 || uri.filename == NULL || !uri.is_static || uri.is_dir) {
+                    res.status = http_get_status(404);
+                    goto respond;
+                } else if (!uri_is_internal(&uri, conf->local.internal)) {
+                    res.status = http_get_status(500);
+                    sprintf(err_msg, "The internal redirect target is outside of the internal location.");
+                    goto respond;
+                }
+                res.status = http_get_status(200);
+                http_add_header_field(&res.hdr, "Accept-Ranges", "bytes");
+                goto static_file;
+            }
+
+            if (use_cache && strcmp(req.method, "GET") == 0) {
+                resp_cache_store_init(&cache_w, cache_key, &res, resp_cache_ttl(&res, conf->local.cache_ttl));
+            }
+            if (cache_inflight && cache_w.file == NULL) {
+                // requests waiting for this response do not have to wait until it has been sent
+                resp_cache_inflight_pass(cache_key);
+                cache_inflight = 0;
+            }
+            http_remove_header_field(&res.hdr, "X-Accel-Expires", HTTP_REMOVE_ALL);
+
             char *accept_encoding = http_get_header_field(&req.hdr, "Accept-Encoding");
-            if (accept_encoding != NULL && strstr(accept_encoding, "deflate") != NULL) {
-                http_add_header_field(&res.hdr, "Content-Encoding", "deflate");
+            char *php_content_length = http_get_header_field(&res.hdr, "Content-Length");
+            int comp_type = compress_choose(accept_encoding, conf->comp.types);
+            if (comp_type != COMPRESS_NONE && res.status->code != 204 && res.status->code != 304 &&
+                http_get_header_field(&res.hdr, "Content-Encoding") == NULL &&
+                (php_content_length == NULL || strtoul(php_content_length, NULL, 10) >= conf->comp.min_size)) {
+                if (compress_init(&comp, comp_type, conf->comp.level) != 0) {
+                    print(ERR_STR "Unable to init %s compression" CLR_STR, compress_encoding(comp_type));
+                } else {
+                    http_add_header_field(&res.hdr, "Content-Encoding", compress_encoding(comp_type));
+                    http_add_header_field(&res.hdr, "Vary", "Accept-Encoding");
+                    http_remove_header_field(&res.hdr, "Content-Length", HTTP_REMOVE_ALL);
+                }
             }
 
             content_length = -1;
             use_fastcgi = 1;
-            if (http_get_header_field(&res.hdr, "Content-Length") == NULL) {
+            if (response_buffering && strcmp(req.method, "HEAD") != 0 &&
+                res.status->code != 204 && res.status->code != 304) {
+                // the whole body is known before the header is sent, so the client gets a Content-Length
+                if (fastcgi_buffer(&php_fpm, &comp, &cache_w, &resp_body) != 0) {
+                    use_fastcgi = 0;
+                    resp_cache_store_abort(&cache_w);
+                    http_free_hdr(&res.hdr);
+                    http_add_header_field(&res.hdr, "Date", http_get_date(buf0, sizeof(buf0)));
+                    http_add_header_field(&res.hdr, "Server", SERVER_STR);
+                    res.status = http_get_status(502);
+                    sprintf(err_msg, "Unable to communicate with PHP-FPM.");
+                    goto respond;
+                }
+                http_remove_header_field(&res.hdr, "Content-Length", HTTP_REMOVE_ALL);
+                http_remove_header_field(&res.hdr, "Transfer-Encoding", HTTP_REMOVE_ALL);
+                sprintf(buf0, "%lu", spool_len(&resp_body));
+                http_add_header_field(&res.hdr, "Content-Length", buf0);
+                fastcgi_buffered = 1;
+            } else if (http_get_header_field(&res.hdr, "Content-Length") == NULL) {
                 http_add_header_field(&res.hdr, "Transfer-Encoding", "chunked");
             }
         }
     } else if (conf->type != CONFIG_TYPE_LOCAL) {
-        print("Reverse proxy for " BLD_STR "%s:%i" CLR_STR, conf->rev_proxy.hostname, conf->rev_proxy.port);
-        ret = rev_proxy_init(&req, &res, conf, client, &custom_status, err_msg);
+        http_body body;
+        ret = http_init_body(&body, &req, max_body_size);
+        if (ret != 0) {
+            client_keep_alive = 0;
+            if (ret == 2) {
+                res.status = http_get_status(413);
+            } else {
+                res.status = http_get_status(400);
+                sprintf(err_msg, "Invalid Content-Length or Transfer-Encoding header field.");
+            }
+            goto respond;
+        }
+
+        char *cache_control = http_get_header_field(&req.hdr, "Cache-Control");
+        use_cache = conf->rev_proxy.cache && body.done &&
+                (strcmp(req.method, "GET") == 0 || strcmp(req.method, "HEAD") == 0) &&
+                http_get_header_field(&req.hdr, "Authorization") == NULL &&
+                http_get_header_field(&req.hdr, "Upgrade") == NULL &&
+                resp_cache_directive(cache_control, "no-store", NULL) == NULL;
+        if (use_cache) {
+            long max_age = -1;
+            char *pragma = http_get_header_field(&req.hdr, "Pragma");
+            int no_cache = resp_cache_directive(cache_control, "no-cache", NULL) != NULL ||
+                    (resp_cache_directive(cache_control, "max-age", &max_age) != NULL && max_age == 0) ||
+                    (cache_control == NULL && pragma != NULL && strstr(pragma, "no-cache") != NULL);
+
+            char *if_none_match = http_get_header_field(&req.hdr, "If-None-Match");
+            snprintf(buf1, sizeof(buf1), "%s", if_none_match != NULL ? if_none_match : "");
+
+            cache_found = rev_proxy_cache_find(cache_key, &req, host, &cache_entry) == 0;
+
+            time_t now = time(NULL);
+            if (cache_found && !no_cache && cache_entry.expires > now) {
+                metrics_inc(proxy_cache_hits);
+                goto proxy_cache_hit;
+            } else if (cache_found && !no_cache && !cache_entry.must_revalidate &&
+                       now < cache_entry.expires + cache_entry.stale_revalidate) {
+                // serve the stale response now and update it after the response has been sent
+                metrics_inc(proxy_cache_stale);
+                cache_revalidate = resp_cache_claim(cache_key) == 0;
+                goto proxy_cache_hit;
+            }
+
+            if (strcmp(req.method, "GET") == 0 && resp_cache_inflight_begin(cache_key) != 0) {
+                // another process is fetching this response already
+                if (resp_cache_inflight_wait(cache_key, RESP_CACHE_WAIT_TIMEOUT) != 0) {
+                    metrics_inc(cache_collapse_timeouts);
+                } else if (rev_proxy_cache_find(cache_key, &req, host, &cache_entry) == 0 &&
+                           cache_entry.expires > time(NULL)) {
+                    cache_found = 1;
+                    metrics_inc(cache_collapsed);
+                    goto proxy_cache_hit;
+                }
+            } else {
+                cache_inflight = strcmp(req.method, "GET") == 0;
+            }
+            metrics_inc(proxy_cache_misses);
+
+            if (cache_found && strcmp(req.method, "GET") == 0 &&
+                (cache_entry.etag[0] != 0 || cache_entry.last_modified >= 0)) {
+                // validators of the client are answered from the cache
+                cache_conditional = 1;
+                http_remove_header_field(&req.hdr, "If-None-Match", HTTP_REMOVE_ALL);
+                http_remove_header_field(&req.hdr, "If-Modified-Since", HTTP_REMOVE_ALL);
+                if (cache_entry.etag[0] != 0) {
+                    http_add_header_field(&req.hdr, "If-None-Match", cache_entry.etag);
+                }
+                if (cache_entry.last_modified >= 0) {
+                    http_add_header_field(&req.hdr, "If-Modified-Since",
+                                          http_format_date(cache_entry.last_modified, buf0, sizeof(buf0)));
+                }
+            }
+        }
+
+        ret = rev_proxy_init(&req, &res, conf, client, &body, &custom_status, err_msg);
         use_rev_proxy = ret == 0;
+        if (!use_rev_proxy) {
+            rev_proxy_release(0);
+        }
+        if (!body.done) {
+            client_keep_alive = 0;
+        }
+
+        if (use_rev_proxy && cache_conditional && res.status->code == 304) {
+            // the stored response is still valid
+            char *connection = http_get_header_field(&res.hdr, "Connection");
+            rev_proxy_release(connection != NULL && strcasecmp(connection, "keep-alive") == 0);
+            use_rev_proxy = 0;
+            if (rev_proxy_cache_refresh(&cache_entry, &res) == 0) {
+                resp_cache_find(cache_key, &cache_entry);
+            }
+            metrics_inc(proxy_cache_revalidated);
+            goto proxy_cache_reset;
+        } else if (cache_found && (!use_rev_proxy || res.status->code >= 500) && !cache_entry.must_revalidate &&
+                   time(NULL) < cache_entry.expires + cache_entry.stale_error) {
+            // stale-if-error
+            if (use_rev_proxy) rev_proxy_release(0);
+            use_rev_proxy = 0;
+            metrics_inc(proxy_cache_stale);
+            goto proxy_cache_reset;
+        } else if (use_rev_proxy && use_cache && strcmp(req.method, "GET") == 0) {
+            // a body that ends with the connection cannot be told apart from a truncated one
+            char *transfer_encoding = http_get_header_field(&res.hdr, "Transfer-Encoding");
+            if ((transfer_encoding != NULL && strcmp(transfer_encoding, "chunked") == 0) ||
+                http_get_header_field(&res.hdr, "Content-Length") != NULL) {
+                rev_proxy_cache_store(&cache_w, &req, &res, host);
+            }
+        }
+        if (cache_inflight && cache_w.file == NULL) {
+            // requests waiting for this response do not have to wait until it has been sent
+            if (use_rev_proxy) {
+                resp_cache_inflight_pass(cache_key);
+            } else {
+                resp_cache_inflight_end(cache_key);
+            }
+            cache_inflight = 0;
+        }
+
+        char *accept_encoding = http_get_header_field(&req.hdr, "Accept-Encoding");
+        char *proxy_content_length = http_get_header_field(&res.hdr, "Content-Length");
+        char *res_cache_control = http_get_header_field(&res.hdr, "Cache-Control");
+        int comp_type = compress_choose(accept_encoding, conf->comp.types);
+        if (use_rev_proxy && conf->rev_proxy.compress && comp_type != COMPRESS_NONE && strcmp(req.method, "HEAD") != 0 &&
+            res.status->code >= 200 && res.status->code != 204 && res.status->code != 206 && res.status->code != 304 &&
+            http_get_header_field(&res.hdr, "Content-Encoding") == NULL &&
+            compress_content_type(http_get_header_field(&res.hdr, "Content-Type")) &&
+            resp_cache_directive(res_cache_control, "no-transform", NULL) == NULL &&
+            (proxy_content_length == NULL || strtoul(proxy_content_length, NULL, 10) >= conf->comp.min_size)) {
+            // the cache (initialized above) stores the uncompressed response
+            if (compress_init(&comp, comp_type, conf->comp.level) != 0) {
+                print(ERR_STR "Unable to init %s compression" CLR_STR, compress_encoding(comp_type));
+            } else {
+                char *etag = http_get_header_field(&res.hdr, "ETag");
+                if (etag != NULL && etag[0] == '"') {
+                    // the compressed representation is not byte-identical anymore
+                    sprintf(buf0, "W/%.*s", (int) sizeof(buf0) - 3, etag);
+                    http_remove_header_field(&res.hdr, "ETag", HTTP_REMOVE_ALL);
+                    http_add_header_field(&res.hdr, "ETag", buf0);
+                }
+                http_add_header_field(&res.hdr, "Content-Encoding", compress_encoding(comp_type));
+                http_add_header_field(&res.hdr, "Vary", "Accept-Encoding");
+                proxy_compressed_chunked = http_get_header_field(&res.hdr, "Transfer-Encoding") != NULL;
+                proxy_compressed_len = proxy_content_length != NULL ? strtoul(proxy_content_length, NULL, 10) : 0;
+                http_remove_header_field(&res.hdr, "Content-Length", HTTP_REMOVE_ALL);
+                http_remove_header_field(&res.hdr, "Transfer-Encoding", HTTP_REMOVE_ALL);
+                http_add_header_field(&res.hdr, "Transfer-Encoding", "chunked");
+            }
+        }
+
+        char *transfer_encoding = http_get_header_field(&res.hdr, "Transfer-Encoding");
+        if (use_rev_proxy && response_buffering && comp.type == COMPRESS_NONE && strcmp(req.method, "HEAD") != 0 &&
+            transfer_encoding != NULL && strcmp(transfer_encoding, "chunked") == 0)
+        {
+            // the whole body is known before it is sent, so the client gets a Content-Length
+            if (rev_proxy_buffer(&resp_body) != 0) {
+                rev_proxy_release(0);
+                use_rev_proxy = 0;
+                resp_cache_store_abort(&cache_w);
+                http_free_hdr(&res.hdr);
+                http_add_header_field(&res.hdr, "Date", http_get_date(buf0, sizeof(buf0)));
+                http_add_header_field(&res.hdr, "Server", SERVER_STR);
+                res.status = http_get_status(502);
+                sprintf(err_msg, "Unable to receive response body from server.");
+                goto respond;
+            }
+            http_remove_header_field(&res.hdr, "Transfer-Encoding", HTTP_REMOVE_ALL);
+            sprintf(buf0, "%lu", spool_len(&resp_body));
+            http_add_header_field(&res.hdr, "Content-Length", buf0);
+            proxy_buffered = 1;
+        }
+        goto respond;
+
+        proxy_cache_reset:
+        http_free_hdr(&res.hdr);
+        http_add_header_field(&res.hdr, "Date", http_get_date(buf0, sizeof(buf0)));
+        http_add_header_field(&res.hdr, "Server", SERVER_STR);
+        proxy_cache_hit:
+        if (resp_cache_open(&cache_entry, &res, &file, &content_length) != 0) {
+            res.status = http_get_status(502);
+            sprintf(err_msg, "Unable to open cached response.");
+            goto respond;
+        }
+        sprintf(buf0, "%li", time(NULL) - cache_entry.date);
+        http_add_header_field(&res.hdr, "Age", buf0);
+        // buf1 contains If-None-Match of the client
+        if (buf1[0] != 0 && cache_entry.etag[0] != 0 && strstr(buf1, cache_entry.etag) != NULL) {
+            res.status = http_get_status(304);
+            fclose(file);
+            file = NULL;
+            content_length = 0;
+        }
     } else {
         print(ERR_STR "Unknown host type: %i" CLR_STR, conf->type);
         res.status = http_get_status(501);
@@ -385,7 +809,13 @@ int client_request_handler(sock *client, unsigned long client_num, unsigned int
     int close_proxy = conn == NULL || (strcmp(conn, "keep-alive") != 0 && strcmp(conn, "Keep-Alive") != 0);
     http_remove_header_field(&res.hdr, "Connection", HTTP_REMOVE_ALL);
     http_remove_header_field(&res.hdr, "Keep-Alive", HTTP_REMOVE_ALL);
-    if (server_keep_alive && client_keep_alive) {
+    if (use_rev_proxy && res.status->code == 101) {
+        // the connection is handed over to the new protocol
+        http_add_header_field(&res.hdr, "Connection", "upgrade");
+        client_keep_alive = 0;
+        close_proxy = 1;
+        metrics_inc(proxy_upgrades);
+    } else if (server_keep_alive && client_keep_alive) {
         http_add_header_field(&res.hdr, "Connection", "keep-alive");
         sprintf(buf0, "timeout=%i, max=%i", CLIENT_TIMEOUT, REQ_PER_CONNECTION);
         http_add_header_field(&res.hdr, "Keep-Alive", buf0);
@@ -412,6 +842,16 @@ int client_request_handler(sock *client, unsigned long client_num, unsigned int
                 print(ERR_STR "Unable to send: %s" CLR_STR, sock_strerror(client));
             }
             snd_len += ret;
+        } else if (file != NULL && !client->enc) {
+            off_t file_off = ftell(file);
+            while (snd_len < content_length) {
+                ret = sendfile(client->socket, fileno(file), &file_off, content_length - snd_len);
+                if (ret <= 0) {
+                    print(ERR_STR "Unable to send: %s" CLR_STR, strerror(errno));
+                    break;
+                }
+                snd_len += ret;
+            }
         } else if (file != NULL) {
             while (snd_len < content_length) {
                 len = fread(buffer, 1, CHUNK_SIZE, file);
@@ -425,13 +865,38 @@ int client_request_handler(sock *client, unsigned long client_num, unsigned int
                 }
                 snd_len += ret;
             }
+        } else if (fastcgi_buffered) {
+            if (fastcgi_send_spool(client, &resp_body) == 0 && resp_cache_store_commit(&cache_w) == 0) {
+                metrics_inc(fastcgi_cache_stores);
+            }
         } else if (use_fastcgi) {
             char *transfer_encoding = http_get_header_field(&res.hdr, "Transfer-Encoding");
             int chunked = transfer_encoding != NULL && strcmp(transfer_encoding, "chunked") == 0;
-            char *content_encoding = http_get_header_field(&res.hdr, "Content-Encoding");
-            int comp = content_encoding != NULL && strcmp(content_encoding, "deflate") == 0;
-            int flags = (chunked ? FASTCGI_CHUNKED : 0) | (comp ? FASTCGI_COMPRESS : 0);
-            fastcgi_send(&php_fpm, client, flags);
+            int flags = (chunked ? FASTCGI_CHUNKED : 0);
+            if (conf->comp.flush == COMPRESS_FLUSH_RECORD) {
+                flags |= FASTCGI_FLUSH_RECORD;
+            } else if (conf->comp.flush == COMPRESS_FLUSH_IDLE) {
+                flags |= FASTCGI_FLUSH_IDLE;
+            }
+            if (fastcgi_send(&php_fpm, client, flags, &comp, &cache_w) == 0 && resp_cache_store_commit(&cache_w) == 0) {
+                metrics_inc(fastcgi_cache_stores);
+            }
+        } else if (use_rev_proxy && res.status->code == 101) {
+            char *upgrade = http_get_header_field(&res.hdr, "Upgrade");
+            client_websocket_handler(client, upgrade != NULL && strcasestr(upgrade, "websocket") != NULL);
+        } else if (use_rev_proxy && comp.type != COMPRESS_NONE) {
+            if (rev_proxy_send_compressed(client, proxy_compressed_chunked, proxy_compressed_len, &comp,
+                                          conf->comp.flush, &cache_w) != 0) {
+                close_proxy = 1;
+            } else if (resp_cache_store_commit(&cache_w) == 0) {
+                metrics_inc(proxy_cache_stores);
+            }
+        } else if (proxy_buffered) {
+            if (rev_proxy_send_spool(client, &resp_body, &cache_w) != 0) {
+                close_proxy = 1;
+            } else if (resp_cache_store_commit(&cache_w) == 0) {
+                metrics_inc(proxy_cache_stores);
+            }
         } else if (use_rev_proxy) {
             char *transfer_encoding = http_get_header_field(&res.hdr, "Transfer-Encoding");
             int chunked = transfer_encoding != NULL && strcmp(transfer_encoding, "chunked") == 0;
@@ -440,26 +905,36 @@ int client_request_handler(sock *client, unsigned long client_num, unsigned int
             if (content_len != NULL) {
                 len_to_send = strtol(content_len, NULL, 10);
             }
-            rev_proxy_send(client, chunked, len_to_send);
+            if (rev_proxy_send(client, chunked, len_to_send, &cache_w) != 0) {
+                close_proxy = 1;
+            } else if (resp_cache_store_commit(&cache_w) == 0) {
+                metrics_inc(proxy_cache_stores);
+            }
         }
     }
 
-    if (close_proxy && rev_proxy.socket != 0) {
-        print(BLUE_STR "Closing proxy connection" CLR_STR);
-        sock_close(&rev_proxy);
+    if (use_rev_proxy) {
+        rev_proxy_release(!close_proxy);
     }
 
     clock_gettime(CLOCK_MONOTONIC, &end);
     micros = (end.tv_nsec - begin.tv_nsec) / 1000 + (end.tv_sec - begin.tv_sec) * 1000000;
     print("Transfer complete: %s", format_duration(micros, buf0));
 
+    if (cache_revalidate) {
+        rev_proxy_revalidate(&req, conf, &cache_entry, host);
+    }
+
     uri_free(&uri);
     abort:
-    if (php_fpm.socket != 0) {
-        shutdown(php_fpm.socket, SHUT_RDWR);
-        close(php_fpm.socket);
-        php_fpm.socket = 0;
+    spool_free(&req_body);
+    spool_free(&resp_body);
+    resp_cache_store_abort(&cache_w);
+    if (cache_inflight) {
+        resp_cache_inflight_end(cache_key);
     }
+    compress_free(&comp);
+    fastcgi_abort(&php_fpm);
     http_free_req(&req);
     http_free_res(&res);
     if (client->buf != NULL) {
@@ -478,79 +953,15 @@ int client_connection_handler(sock *client, unsigned long client_num) {
 
     clock_gettime(CLOCK_MONOTONIC, &begin);
 
+    client_host_str = NULL;
     if (dns_server[0] != 0) {
-        sprintf(buf, "dig @%s +short +time=1 -x %s", dns_server, client_addr_str);
-        FILE *dig = popen(buf, "r");
-        if (dig == NULL) {
-            print(ERR_STR "Unable to start dig: %s" CLR_STR "\n", strerror(errno));
-            goto dig_err;
-        }
-        unsigned long read = fread(buf, 1, sizeof(buf), dig);
-        ret = pclose(dig);
-        if (ret != 0) {
-            print(ERR_STR "Dig terminated with exit code %i" CLR_STR "\n", ret);
-            goto dig_err;
-        }
-        char *ptr = memchr(buf, '\n', read);
-        if (ptr == buf || ptr == NULL) {
-            goto dig_err;
-        }
-        ptr[-1] = 0;
-        client_host_str = malloc(strlen(buf) + 1);
-        strcpy(client_host_str, buf);
-    } else {
-        dig_err:
-        client_host_str = NULL;
-    }
-
-    client_geoip = malloc(GEOIP_MAX_SIZE);
-    long str_off = 0;
-    for (int i = 0; i < MAX_MMDB && mmdbs[i].filename != NULL; i++) {
-        int gai_error, mmdb_res;
-        MMDB_lookup_result_s result = MMDB_lookup_string(&mmdbs[i], client_addr_str, &gai_error, &mmdb_res);
-        if (mmdb_res != MMDB_SUCCESS) {
-            print(ERR_STR "Unable to lookup geoip info: %s" CLR_STR "\n", MMDB_strerror(mmdb_res));
-            continue;
-        } else if (gai_error != 0) {
-            print(ERR_STR "Unable to lookup geoip info" CLR_STR "\n");
-            continue;
-        } else if (!result.found_entry) {
-            continue;
-        }
-
-        MMDB_entry_data_list_s *list;
-        mmdb_res = MMDB_get_entry_data_list(&result.entry, &list);
-        if (mmdb_res != MMDB_SUCCESS) {
-            print(ERR_STR "Unable to lookup geoip info: %s" CLR_STR "\n", MMDB_strerror(mmdb_res));
-            continue;
-        }
-
-        long prev = str_off;
-        if (str_off != 0) {
-            str_off--;
-        }
-        mmdb_json(list, client_geoip, &str_off, GEOIP_MAX_SIZE);
-        if (prev != 0) {
-            client_geoip[prev - 1] = ',';
-        }
-
-        MMDB_free_entry_data_list(list);
+        // the host name is looked up while the connection is set up, requests do not wait for it
+        dns_reverse_start(client_addr_str, &client_host_str);
     }
 
+    // repeat clients from the same network are answered from the shared cache
     char client_cc[3];
-    client_cc[0] = 0;
-    if (str_off == 0) {
-        free(client_geoip);
-        client_geoip = NULL;
-    } else {
-        char *pos = client_geoip;
-        pos = strstr(pos, "\"country\":");
-        if (pos != NULL) {
-            pos = strstr(pos, "\"iso_code\":");
-            pos += 12;
-            strncpy(client_cc, pos, 2);
-        }
-    }
+    geoip_lookup(client_addr_str, &client_geoip, client_cc);
 
     print("Connection accepted from %s %s%s%s[%s]", client_addr_str, client_host_str != NULL ? "(" : "",
           client_host_str != NULL ? client_host_str : "", client_host_str != NULL ? ") " : "",
@@ -590,16 +1001,17 @@ int client_connection_handler(sock *client, unsigned long client_num) {
 
     close:
     sock_close(client);
-
-    if (rev_proxy.socket != 0) {
-        print(BLUE_STR "Closing proxy connection" CLR_STR);
-        sock_close(&rev_proxy);
-    }
+    fastcgi_pool_close();
+    rev_proxy_release(0);
+    rev_proxy_pool_close();
 
     clock_gettime(CLOCK_MONOTONIC, &end);
     unsigned long micros = (end.tv_nsec - begin.tv_nsec) / 1000 + (end.tv_sec - begin.tv_sec) * 1000000;
 
     print("Connection closed (%s)", format_duration(micros, buf));
+
+    // the answer is still stored for later connections, the client does not wait for it anymore
+    dns_reverse_poll(&client_host_str, 1);
     return 0;
 }
 
@@ -13,6 +13,9 @@
 #include "uri.h"
 #include "http.h"
 #include "fastcgi.h"
+#include "tunnel.h"
+
+#include <sys/sendfile.h>
 
 
 int server_keep_alive = 1;
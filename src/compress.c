@@ -0,0 +1,176 @@
+/**
+ * Necronda Web Server
+ * Streaming response compression
+ * src/compress.c
+ * Lorenz Stechauner, 2021-02-21
+ */
+
+#include "compress.h"
+
+
+int compress_parse_type(const char *name) {
+    if (strcmp(name, "deflate") == 0) {
+        return COMPRESS_DEFLATE;
+    } else if (strcmp(name, "gzip") == 0) {
+        return COMPRESS_GZIP;
+    } else if (strcmp(name, "br") == 0 || strcmp(name, "brotli") == 0) {
+        return COMPRESS_BR;
+    } else {
+        return -1;
+    }
+}
+
+int compress_parse_flush(const char *name) {
+    if (strcmp(name, "none") == 0) {
+        return COMPRESS_FLUSH_NONE;
+    } else if (strcmp(name, "record") == 0) {
+        return COMPRESS_FLUSH_RECORD;
+    } else if (strcmp(name, "idle") == 0) {
+        return COMPRESS_FLUSH_IDLE;
+    } else {
+        return -1;
+    }
+}
+
+double compress_accept_q(const char *accept_encoding, const char *name) {
+    double q = -1, q_any = -1;
+    const char *ptr = accept_encoding;
+    while (ptr[0] != 0) {
+        while (ptr[0] == ' ' || ptr[0] == '\t' || ptr[0] == ',') ptr++;
+        if (ptr[0] == 0) break;
+        const char *end = ptr + strcspn(ptr, ",");
+        unsigned long len = strcspn(ptr, " \t;,");
+        double val = 1;
+        const char *param = memchr(ptr, ';', end - ptr);
+        while (param != NULL) {
+            param++;
+            while (param[0] == ' ' || param[0] == '\t') param++;
+            if (strncasecmp(param, "q=", 2) == 0) val = strtod(param + 2, NULL);
+            param = memchr(param, ';', end - param);
+        }
+        if (len == strlen(name) && strncasecmp(ptr, name, len) == 0) {
+            q = val;
+        } else if (len == 1 && ptr[0] == '*') {
+            q_any = val;
+        }
+        ptr = end;
+    }
+    return q >= 0 ? q : q_any;
+}
+
+int compress_choose(const char *accept_encoding, int types) {
+    // server preference order, a higher client q value wins
+    const int order[] = {COMPRESS_BR, COMPRESS_GZIP, COMPRESS_DEFLATE};
+    int type = COMPRESS_NONE;
+    double q_max = 0;
+    if (accept_encoding == NULL) return COMPRESS_NONE;
+    for (int i = 0; i < sizeof(order) / sizeof(order[0]); i++) {
+        if (!(types & order[i])) continue;
+        double q = compress_accept_q(accept_encoding, compress_encoding(order[i]));
+        if (q > q_max) {
+            q_max = q;
+            type = order[i];
+        }
+    }
+    return type;
+}
+
+const char *compress_encoding(int type) {
+    switch (type) {
+        case COMPRESS_DEFLATE: return "deflate";
+        case COMPRESS_GZIP: return "gzip";
+        case COMPRESS_BR: return "br";
+        default: return NULL;
+    }
+}
+
+int compress_content_type(const char *content_type) {
+    // media types that are not compressed already
+    const char *types[] = {"application/json", "application/javascript", "application/xml", "application/xhtml+xml",
+                           "application/rss+xml", "application/atom+xml", "application/wasm", "image/svg+xml"};
+    if (content_type == NULL) return 0;
+    unsigned long len = strcspn(content_type, " \t;");
+    if (strncasecmp(content_type, "text/", 5) == 0) return 1;
+    for (int i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        if (len == strlen(types[i]) && strncasecmp(content_type, types[i], len) == 0) return 1;
+    }
+    // structured syntax suffixes (RFC 6839)
+    return (len > 5 && strncasecmp(content_type + len - 5, "+json", 5) == 0) ||
+           (len > 4 && strncasecmp(content_type + len - 4, "+xml", 4) == 0);
+}
+
+int compress_init(compress_ctx *ctx, int type, int level) {
+    ctx->type = COMPRESS_NONE;
+    ctx->brotli = NULL;
+    if (type == COMPRESS_DEFLATE || type == COMPRESS_GZIP) {
+        if (level < 0) level = COMPRESS_DEFAULT_LEVEL_ZLIB;
+        if (level < 1) level = 1;
+        if (level > 9) level = 9;
+        ctx->zlib.zalloc = Z_NULL;
+        ctx->zlib.zfree = Z_NULL;
+        ctx->zlib.opaque = Z_NULL;
+        int window_bits = type == COMPRESS_GZIP ? MAX_WBITS + 16 : MAX_WBITS;
+        if (deflateInit2(&ctx->zlib, level, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            return -1;
+        }
+    } else if (type == COMPRESS_BR) {
+        if (level < 0) level = COMPRESS_DEFAULT_LEVEL_BR;
+        if (level > BROTLI_MAX_QUALITY) level = BROTLI_MAX_QUALITY;
+        ctx->brotli = BrotliEncoderCreateInstance(NULL, NULL, NULL);
+        if (ctx->brotli == NULL) {
+            return -1;
+        }
+        BrotliEncoderSetParameter(ctx->brotli, BROTLI_PARAM_QUALITY, level);
+    } else {
+        return -1;
+    }
+    ctx->type = type;
+    return 0;
+}
+
+long compress_stream(compress_ctx *ctx, const char **in, unsigned long *in_len, char *out, unsigned long out_size,
+                     int op, int *pending) {
+    // *pending is set if the encoder has more output for this operation, even if all input was consumed
+    if (ctx->type == COMPRESS_BR) {
+        size_t avail_in = *in_len, avail_out = out_size;
+        const uint8_t *next_in = (const uint8_t *) *in;
+        uint8_t *next_out = (uint8_t *) out;
+        BrotliEncoderOperation brotli_op = op == COMPRESS_OP_FINISH ? BROTLI_OPERATION_FINISH :
+                                           op == COMPRESS_OP_FLUSH ? BROTLI_OPERATION_FLUSH :
+                                           BROTLI_OPERATION_PROCESS;
+        if (!BrotliEncoderCompressStream(ctx->brotli, brotli_op, &avail_in, &next_in, &avail_out, &next_out, NULL)) {
+            return -1;
+        }
+        *in = (const char *) next_in;
+        *in_len = avail_in;
+        *pending = BrotliEncoderHasMoreOutput(ctx->brotli) ||
+                   (op == COMPRESS_OP_FINISH && !BrotliEncoderIsFinished(ctx->brotli));
+        return (long) (out_size - avail_out);
+    } else if (ctx->type == COMPRESS_DEFLATE || ctx->type == COMPRESS_GZIP) {
+        ctx->zlib.next_in = (unsigned char *) *in;
+        ctx->zlib.avail_in = *in_len;
+        ctx->zlib.next_out = (unsigned char *) out;
+        ctx->zlib.avail_out = out_size;
+        int flush = op == COMPRESS_OP_FINISH ? Z_FINISH : op == COMPRESS_OP_FLUSH ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+        int ret = deflate(&ctx->zlib, flush);
+        if (ret == Z_STREAM_ERROR) {
+            return -1;
+        }
+        *in = (const char *) ctx->zlib.next_in;
+        *in_len = ctx->zlib.avail_in;
+        // a full output buffer may hide more flushed data, finishing is only done with Z_STREAM_END
+        *pending = op == COMPRESS_OP_FINISH ? ret != Z_STREAM_END : ctx->zlib.avail_out == 0;
+        return (long) (out_size - ctx->zlib.avail_out);
+    }
+    return -1;
+}
+
+void compress_free(compress_ctx *ctx) {
+    if (ctx->type == COMPRESS_BR) {
+        BrotliEncoderDestroyInstance(ctx->brotli);
+        ctx->brotli = NULL;
+    } else if (ctx->type == COMPRESS_DEFLATE || ctx->type == COMPRESS_GZIP) {
+        deflateEnd(&ctx->zlib);
+    }
+    ctx->type = COMPRESS_NONE;
+}
@@ -0,0 +1,56 @@
+/**
+ * Necronda Web Server
+ * Streaming response compression (header file)
+ * src/compress.h
+ * Lorenz Stechauner, 2021-02-21
+ */
+
+#ifndef NECRONDA_SERVER_COMPRESS_H
+#define NECRONDA_SERVER_COMPRESS_H
+
+#define COMPRESS_NONE 0
+#define COMPRESS_DEFLATE 1
+#define COMPRESS_GZIP 2
+#define COMPRESS_BR 4
+#define COMPRESS_ALL (COMPRESS_DEFLATE | COMPRESS_GZIP | COMPRESS_BR)
+
+#define COMPRESS_FLUSH_NONE 0
+#define COMPRESS_FLUSH_RECORD 1
+#define COMPRESS_FLUSH_IDLE 2
+
+#define COMPRESS_OP_PROCESS 0
+#define COMPRESS_OP_FLUSH 1
+#define COMPRESS_OP_FINISH 2
+
+#define COMPRESS_DEFAULT_LEVEL_ZLIB 6
+#define COMPRESS_DEFAULT_LEVEL_BR 5
+#define COMPRESS_DEFAULT_MIN_SIZE 256
+
+#include <zlib.h>
+#include <brotli/encode.h>
+
+
+typedef struct {
+    int type;
+    z_stream zlib;
+    BrotliEncoderState *brotli;
+} compress_ctx;
+
+int compress_parse_type(const char *name);
+
+int compress_parse_flush(const char *name);
+
+int compress_choose(const char *accept_encoding, int types);
+
+const char *compress_encoding(int type);
+
+int compress_content_type(const char *content_type);
+
+int compress_init(compress_ctx *ctx, int type, int level);
+
+long compress_stream(compress_ctx *ctx, const char **in, unsigned long *in_len, char *out, unsigned long out_size,
+                     int op, int *pending);
+
+void compress_free(compress_ctx *ctx);
+
+#endif //NECRONDA_SERVER_COMPRESS_H
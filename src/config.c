@@ -78,6 +78,10 @@ int config_load(const char *filename) {
         if (ptr[0] == '[') {
             if (ptr[len - 1] != ']') goto err;
             strncpy(tmp_config[i].name, ptr + 1, len - 2);
+            tmp_config[i].comp.types = COMPRESS_ALL;
+            tmp_config[i].comp.flush = COMPRESS_FLUSH_IDLE;
+            tmp_config[i].comp.level = -1;
+            tmp_config[i].comp.min_size = COMPRESS_DEFAULT_MIN_SIZE;
             i++;
             continue;
         } else if (i == 0) {
@@ -93,6 +97,36 @@ int config_load(const char *filename) {
             } else if (len > 11 && strncmp(ptr, "dns_server", 10) == 0 && (ptr[10] == ' ' || ptr[10] == '\t')) {
                 source = ptr + 10;
                 target = dns_server;
+            } else if (len > 14 && strncmp(ptr, "max_body_size", 13) == 0 && (ptr[13] == ' ' || ptr[13] == '\t')) {
+                source = ptr + 13;
+                target = NULL;
+                mode = 3;
+            } else if (len > 20 && strncmp(ptr, "request_buffer_size", 19) == 0 && (ptr[19] == ' ' || ptr[19] == '\t')) {
+                source = ptr + 19;
+                target = NULL;
+                mode = 4;
+            } else if (strcmp(ptr, "request_buffering") == 0) {
+                request_buffering = 1;
+                continue;
+            } else if (len > 21 && strncmp(ptr, "response_buffer_size", 20) == 0 && (ptr[20] == ' ' || ptr[20] == '\t')) {
+                source = ptr + 20;
+                target = NULL;
+                mode = 12;
+            } else if (strcmp(ptr, "response_buffering") == 0) {
+                response_buffering = 1;
+                continue;
+            } else if (len > 15 && strncmp(ptr, "tunnel_timeout", 14) == 0 && (ptr[14] == ' ' || ptr[14] == '\t')) {
+                source = ptr + 14;
+                target = NULL;
+                mode = 16;
+            } else if (len > 15 && strncmp(ptr, "websocket_ping", 14) == 0 && (ptr[14] == ' ' || ptr[14] == '\t')) {
+                source = ptr + 14;
+                target = NULL;
+                mode = 17;
+            } else if (len > 22 && strncmp(ptr, "proxy_max_header_size", 21) == 0 && (ptr[21] == ' ' || ptr[21] == '\t')) {
+                source = ptr + 21;
+                target = NULL;
+                mode = 18;
             }
         } else {
             host_config *hc = &tmp_config[i - 1];
@@ -113,6 +147,66 @@ int config_load(const char *filename) {
                 } else {
                     hc->type = CONFIG_TYPE_LOCAL;
                 }
+            } else if (len > 8 && strncmp(ptr, "fastcgi", 7) == 0 && (ptr[7] == ' ' || ptr[7] == '\t')) {
+                source = ptr + 7;
+                target = NULL;
+                mode = 5;
+                if (hc->type != 0 && hc->type != CONFIG_TYPE_LOCAL) {
+                    goto err;
+                } else {
+                    hc->type = CONFIG_TYPE_LOCAL;
+                }
+            } else if (len > 15 && strncmp(ptr, "fastcgi_policy", 14) == 0 && (ptr[14] == ' ' || ptr[14] == '\t')) {
+                source = ptr + 14;
+                target = NULL;
+                mode = 6;
+                if (hc->type != 0 && hc->type != CONFIG_TYPE_LOCAL) {
+                    goto err;
+                } else {
+                    hc->type = CONFIG_TYPE_LOCAL;
+                }
+            } else if (len > 14 && strncmp(ptr, "fastcgi_cache", 13) == 0 && (ptr[13] == ' ' || ptr[13] == '\t')) {
+                source = ptr + 13;
+                target = NULL;
+                mode = 7;
+                if (hc->type != 0 && hc->type != CONFIG_TYPE_LOCAL) {
+                    goto err;
+                } else {
+                    hc->type = CONFIG_TYPE_LOCAL;
+                }
+            } else if (len > 18 && strncmp(ptr, "fastcgi_cache_key", 17) == 0 && (ptr[17] == ' ' || ptr[17] == '\t')) {
+                source = ptr + 17;
+                target = hc->local.cache_key;
+                if (hc->type != 0 && hc->type != CONFIG_TYPE_LOCAL) {
+                    goto err;
+                } else {
+                    hc->type = CONFIG_TYPE_LOCAL;
+                }
+            } else if (len > 9 && strncmp(ptr, "internal", 8) == 0 && (ptr[8] == ' ' || ptr[8] == '\t')) {
+                source = ptr + 8;
+                target = NULL;
+                mode = 19;
+                if (hc->type != 0 && hc->type != CONFIG_TYPE_LOCAL) {
+                    goto err;
+                } else {
+                    hc->type = CONFIG_TYPE_LOCAL;
+                }
+            } else if (len > 9 && strncmp(ptr, "compress", 8) == 0 && (ptr[8] == ' ' || ptr[8] == '\t')) {
+                source = ptr + 8;
+                target = NULL;
+                mode = 8;
+            } else if (len > 15 && strncmp(ptr, "compress_level", 14) == 0 && (ptr[14] == ' ' || ptr[14] == '\t')) {
+                source = ptr + 14;
+                target = NULL;
+                mode = 9;
+            } else if (len > 18 && strncmp(ptr, "compress_min_size", 17) == 0 && (ptr[17] == ' ' || ptr[17] == '\t')) {
+                source = ptr + 17;
+                target = NULL;
+                mode = 10;
+            } else if (len > 15 && strncmp(ptr, "compress_flush", 14) == 0 && (ptr[14] == ' ' || ptr[14] == '\t')) {
+                source = ptr + 14;
+                target = NULL;
+                mode = 11;
             } else if (len > 9 && strncmp(ptr, "hostname", 8) == 0 && (ptr[8] == ' ' || ptr[8] == '\t')) {
                 source = ptr + 8;
                 target = hc->rev_proxy.hostname;
@@ -130,6 +224,49 @@ int config_load(const char *filename) {
                 } else {
                     hc->type = CONFIG_TYPE_REVERSE_PROXY;
                 }
+            } else if (len > 8 && strncmp(ptr, "backend", 7) == 0 && (ptr[7] == ' ' || ptr[7] == '\t')) {
+                source = ptr + 7;
+                target = NULL;
+                mode = 13;
+                if (hc->type != 0 && hc->type != CONFIG_TYPE_REVERSE_PROXY) {
+                    goto err;
+                } else {
+                    hc->type = CONFIG_TYPE_REVERSE_PROXY;
+                }
+            } else if (len > 15 && strncmp(ptr, "backend_policy", 14) == 0 && (ptr[14] == ' ' || ptr[14] == '\t')) {
+                source = ptr + 14;
+                target = NULL;
+                mode = 14;
+                if (hc->type != 0 && hc->type != CONFIG_TYPE_REVERSE_PROXY) {
+                    goto err;
+                } else {
+                    hc->type = CONFIG_TYPE_REVERSE_PROXY;
+                }
+            } else if (len > 13 && strncmp(ptr, "health_check", 12) == 0 && (ptr[12] == ' ' || ptr[12] == '\t')) {
+                source = ptr + 12;
+                target = NULL;
+                mode = 15;
+                if (hc->type != 0 && hc->type != CONFIG_TYPE_REVERSE_PROXY) {
+                    goto err;
+                } else {
+                    hc->type = CONFIG_TYPE_REVERSE_PROXY;
+                }
+            } else if (strcmp(ptr, "proxy_cache") == 0) {
+                if (hc->type != 0 && hc->type != CONFIG_TYPE_REVERSE_PROXY) {
+                    goto err;
+                } else {
+                    hc->type = CONFIG_TYPE_REVERSE_PROXY;
+                    hc->rev_proxy.cache = 1;
+                }
+                continue;
+            } else if (strcmp(ptr, "proxy_compress") == 0) {
+                if (hc->type != 0 && hc->type != CONFIG_TYPE_REVERSE_PROXY) {
+                    goto err;
+                } else {
+                    hc->type = CONFIG_TYPE_REVERSE_PROXY;
+                    hc->rev_proxy.compress = 1;
+                }
+                continue;
             } else if (strcmp(ptr, "http") == 0) {
                 if (hc->type != 0 && hc->type != CONFIG_TYPE_REVERSE_PROXY) {
                     goto err;
@@ -151,7 +288,7 @@ int config_load(const char *filename) {
         char *end_ptr = source + strlen(source) - 1;
         while (source[0] == ' ' || source[0] == '\t') source++;
         while (end_ptr[0] == ' ' || end_ptr[0] == '\t') end_ptr--;
-        if (end_ptr <= source) {
+        if (end_ptr < source) {
             err:
             free(conf);
             free(tmp_config);
@@ -173,11 +310,120 @@ int config_load(const char *filename) {
             }
         } else if (mode == 2) {
             tmp_config[i - 1].rev_proxy.port = (unsigned short) strtoul(source, NULL, 10);
+        } else if (mode == 3) {
+            max_body_size = strtoul(source, NULL, 10);
+        } else if (mode == 4) {
+            request_buffer_size = strtoul(source, NULL, 10);
+        } else if (mode == 12) {
+            response_buffer_size = strtoul(source, NULL, 10);
+        } else if (mode == 16) {
+            tunnel_timeout = strtoul(source, NULL, 10);
+            if (tunnel_timeout == 0) goto err;
+        } else if (mode == 17) {
+            websocket_ping = strtoul(source, NULL, 10);
+        } else if (mode == 18) {
+            proxy_max_header_size = strtoul(source, NULL, 10);
+            if (proxy_max_header_size < 64) goto err;
+        } else if (mode == 5 || mode == 13) {
+            unsigned long weight = 1;
+            char *weight_ptr = strpbrk(source, " \t");
+            if (weight_ptr != NULL) {
+                weight_ptr[0] = 0;
+                weight = strtoul(weight_ptr + 1, NULL, 10);
+                if (weight > 0xFFFF) goto err;
+            }
+            if (mode == 13) {
+                // proxied servers are resolved through the DNS cache on every connect
+                if (strncmp(source, "unix:", 5) == 0) goto err;
+                if (upstream_add_to_group(&tmp_config[i - 1].rev_proxy.backends, upstream_add_server(source, 0),
+                                          (unsigned short) weight) != 0) {
+                    goto err;
+                }
+            } else if (upstream_add_to_group(&tmp_config[i - 1].local.fastcgi, upstream_add_server(source, 1),
+                                             (unsigned short) weight) != 0) {
+                goto err;
+            }
+        } else if (mode == 6 || mode == 14) {
+            int policy = upstream_parse_policy(source);
+            if (policy < 0) goto err;
+            if (mode == 14) {
+                tmp_config[i - 1].rev_proxy.backends.policy = policy;
+            } else {
+                tmp_config[i - 1].local.fastcgi.policy = policy;
+            }
+        } else if (mode == 15) {
+            unsigned long interval = UPSTREAM_CHECK_INTERVAL;
+            char *interval_ptr = strpbrk(source, " \t");
+            if (interval_ptr != NULL) {
+                interval_ptr[0] = 0;
+                interval = strtoul(interval_ptr + 1, NULL, 10);
+                if (interval == 0 || interval > 0xFFFF) goto err;
+            }
+            if (source[0] != '/') goto err;
+            strcpy(tmp_config[i - 1].rev_proxy.health_path, source);
+            tmp_config[i - 1].rev_proxy.health_interval = (unsigned short) interval;
+        } else if (mode == 19) {
+            if (source[0] != '/') goto err;
+            strcpy(tmp_config[i - 1].local.internal, source);
+        } else if (mode == 7) {
+            tmp_config[i - 1].local.cache_ttl = (unsigned int) strtoul(source, NULL, 10);
+        } else if (mode == 8) {
+            tmp_config[i - 1].comp.types = COMPRESS_NONE;
+            if (strcmp(source, "off") != 0) {
+                char *type_ptr = NULL, *save_ptr;
+                while ((type_ptr = strtok_r(type_ptr == NULL ? source : NULL, " \t", &save_ptr)) != NULL) {
+                    int type = compress_parse_type(type_ptr);
+                    if (type < 0) goto err;
+                    tmp_config[i - 1].comp.types |= type;
+                }
+            }
+        } else if (mode == 9) {
+            unsigned long level = strtoul(source, NULL, 10);
+            if (level > 11) goto err;
+            tmp_config[i - 1].comp.level = (signed char) level;
+        } else if (mode == 10) {
+            tmp_config[i - 1].comp.min_size = strtoul(source, NULL, 10);
+        } else if (mode == 11) {
+            int flush = compress_parse_flush(source);
+            if (flush < 0) goto err;
+            tmp_config[i - 1].comp.flush = flush;
         }
     }
 
     free(conf);
 
+    for (int j = 0; j < i; j++) {
+        upstream_group *fastcgi = &tmp_config[j].local.fastcgi;
+        if (tmp_config[j].type == CONFIG_TYPE_LOCAL && fastcgi->num == 0) {
+            upstream_add_to_group(fastcgi, upstream_add_server("unix:" PHP_FPM_SOCKET, 1), 1);
+        }
+        upstream_group *backends = &tmp_config[j].rev_proxy.backends;
+        if (tmp_config[j].type == CONFIG_TYPE_REVERSE_PROXY && backends->num == 0) {
+            // hostname and port form a group with a single server
+            char name[272];
+            const char *hostname = tmp_config[j].rev_proxy.hostname;
+            sprintf(name, strchr(hostname, ':') != NULL ? "[%s]:%i" : "%s:%i", hostname, tmp_config[j].rev_proxy.port);
+            if (upstream_add_to_group(backends, upstream_add_server(name, 0), 1) != 0) {
+                free(tmp_config);
+                fprintf(stderr, ERR_STR "Unable to parse config file" CLR_STR "\n");
+                return -2;
+            }
+        }
+        if (tmp_config[j].type == CONFIG_TYPE_REVERSE_PROXY && tmp_config[j].rev_proxy.health_interval != 0) {
+            // a server used by several hosts is probed with the shortest interval
+            for (int k = 0; k < backends->num; k++) {
+                upstream_server *srv = &upstream_servers[backends->servers[k]];
+                if (srv->check_interval != 0 && srv->check_interval <= tmp_config[j].rev_proxy.health_interval) {
+                    continue;
+                }
+                strcpy(srv->check_path, tmp_config[j].rev_proxy.health_path);
+                strcpy(srv->check_host, tmp_config[j].name);
+                srv->check_interval = tmp_config[j].rev_proxy.health_interval;
+                srv->check_enc = tmp_config[j].rev_proxy.enc;
+            }
+        }
+    }
+
     int shm_id = shmget(SHM_KEY_CONFIG, 0, 0);
     if (shm_id < 0) {
         fprintf(stderr, ERR_STR "Unable to get shared memory id: %s" CLR_STR "\n", strerror(errno));
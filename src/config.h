@@ -14,6 +14,8 @@
 #define CONFIG_TYPE_REVERSE_PROXY 2
 
 #include "uri.h"
+#include "upstream.h"
+#include "compress.h"
 
 #include <stdio.h>
 #include <sys/ipc.h>
@@ -23,15 +25,30 @@
 typedef struct {
     int type;
     char name[256];
+    struct {
+        unsigned char types;
+        unsigned char flush:2;
+        signed char level;
+        unsigned long min_size;
+    } comp;
     union {
         struct {
             char hostname[256];
             unsigned short port;
             unsigned char enc:1;
+            unsigned char cache:1;
+            unsigned char compress:1;
+            upstream_group backends;
+            char health_path[256];
+            unsigned short health_interval;
         } rev_proxy;
         struct {
             char webroot[256];
             unsigned char dir_mode:2;
+            upstream_group fastcgi;
+            unsigned int cache_ttl;
+            char cache_key[256];
+            char internal[256];
         } local;
     };
 } host_config;
@@ -39,6 +56,14 @@ typedef struct {
 
 host_config *config;
 char cert_file[256], key_file[256], geoip_dir[256], dns_server[256];
+unsigned long max_body_size = CLIENT_MAX_BODY_SIZE;
+unsigned char request_buffering = 0;
+unsigned long request_buffer_size = CLIENT_BODY_BUFFER_SIZE;
+unsigned char response_buffering = 0;
+unsigned long response_buffer_size = FASTCGI_RESPONSE_BUFFER_SIZE;
+unsigned long tunnel_timeout = TUNNEL_TIMEOUT;
+unsigned long websocket_ping = TUNNEL_PING_INTERVAL;
+unsigned long proxy_max_header_size = SERVER_MAX_HEADER_SIZE;
 
 
 int config_init();
@@ -0,0 +1,804 @@
+/**
+ * Necronda Web Server
+ * Cached host name resolution
+ * src/dns.c
+ * Lorenz Stechauner, 2021-02-28
+ */
+
+#include "dns.h"
+
+
+void dns_lock() {
+    shm_mutex_lock(&dns_cache->lock);
+}
+
+void dns_unlock() {
+    shm_mutex_unlock(&dns_cache->lock);
+}
+
+int dns_parse_addr(const char *str, struct in6_addr *addr) {
+    struct in_addr addr4;
+    if (inet_pton(AF_INET6, str, addr) == 1) {
+        return 0;
+    } else if (inet_pton(AF_INET, str, &addr4) == 1) {
+        unsigned char mapped[16] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF, 0, 0, 0, 0};
+        memcpy(mapped + 12, &addr4, 4);
+        memcpy(addr, mapped, 16);
+        return 0;
+    }
+    return -1;
+}
+
+int dns_nameserver(struct sockaddr_in6 *addr) {
+    char buf[256];
+    memset(addr, 0, sizeof(*addr));
+    addr->sin6_family = AF_INET6;
+    addr->sin6_port = htons(53);
+    if (dns_server[0] != 0) {
+        return dns_parse_addr(dns_server, &addr->sin6_addr);
+    }
+
+    FILE *file = fopen("/etc/resolv.conf", "r");
+    if (file == NULL) return -1;
+    int ret = -1;
+    while (fgets(buf, sizeof(buf), file) != NULL) {
+        char *save_ptr;
+        char *key = strtok_r(buf, " \t\r\n", &save_ptr);
+        if (key == NULL || strcmp(key, "nameserver") != 0) continue;
+        char *value = strtok_r(NULL, " \t\r\n", &save_ptr);
+        if (value != NULL && dns_parse_addr(value, &addr->sin6_addr) == 0) {
+            ret = 0;
+            break;
+        }
+    }
+    fclose(file);
+    return ret;
+}
+
+int dns_hosts_lookup(const char *name, struct in6_addr *addr, int max) {
+    char buf[1024];
+    int num = 0;
+    FILE *file = fopen("/etc/hosts", "r");
+    if (file == NULL) return 0;
+    while (num < max && fgets(buf, sizeof(buf), file) != NULL) {
+        char *comment = strchr(buf, '#');
+        if (comment != NULL) comment[0] = 0;
+        char *save_ptr, *host_name;
+        char *address = strtok_r(buf, " \t\r\n", &save_ptr);
+        if (address == NULL) continue;
+        while ((host_name = strtok_r(NULL, " \t\r\n", &save_ptr)) != NULL) {
+            if (strcasecmp(host_name, name) == 0) {
+                if (dns_parse_addr(address, &addr[num]) == 0) num++;
+                break;
+            }
+        }
+    }
+    fclose(file);
+    return num;
+}
+
+int dns_build_query(unsigned char *buf, unsigned short id, const char *name, unsigned short type) {
+    unsigned char header[12] = {id >> 8, id & 0xFF, 0x01, 0x00, 0, 1, 0, 0, 0, 0, 0, 0};
+    memcpy(buf, header, sizeof(header));
+    unsigned char *ptr = buf + sizeof(header);
+    const char *label = name;
+    while (label[0] != 0) {
+        unsigned long len = strcspn(label, ".");
+        if (len == 0 || len > 63 || ptr - buf + len + 6 > 255 + sizeof(header)) return -1;
+        ptr[0] = (unsigned char) len;
+        memcpy(ptr + 1, label, len);
+        ptr += len + 1;
+        label += len;
+        if (label[0] == '.') label++;
+    }
+    ptr[0] = 0;
+    ptr[1] = type >> 8;
+    ptr[2] = type & 0xFF;
+    ptr[3] = 0;
+    ptr[4] = 1;
+    return (int) (ptr + 5 - buf);
+}
+
+long dns_skip_name(const unsigned char *buf, long len, long off) {
+    while (off < len) {
+        unsigned char ch = buf[off];
+        if (ch == 0) {
+            return off + 1;
+        } else if ((ch & 0xC0) == 0xC0) {
+            return off + 2;
+        }
+        off += ch + 1;
+    }
+    return -1;
+}
+
+long dns_read_name(const unsigned char *buf, long len, long off, char *name, unsigned long size);
+
+unsigned short dns_random_id() {
+    // unpredictable, so answers cannot be spoofed by guessing the id
+    unsigned short id;
+    if (getrandom(&id, sizeof(id), 0) != sizeof(id)) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        id = (unsigned short) ((getpid() << 4) ^ ts.tv_nsec);
+    }
+    return id;
+}
+
+int dns_check_question(const unsigned char *buf, long len, const char *name, unsigned short type) {
+    // the answer has to belong to the question that was asked
+    char qname[256];
+    unsigned long name_len = strlen(name);
+    if (name_len > 0 && name[name_len - 1] == '.') name_len--;
+    if (len < 12 || ((buf[4] << 8) | buf[5]) != 1) return -1;
+    long off = dns_read_name(buf, len, 12, qname, sizeof(qname));
+    if (off < 0 || off + 4 > len) return -1;
+    if (strlen(qname) != name_len || strncasecmp(qname, name, name_len) != 0) return -1;
+    if (((buf[off] << 8) | buf[off + 1]) != type || ((buf[off + 2] << 8) | buf[off + 3]) != 1) return -1;
+    return 0;
+}
+
+int dns_parse_response(const unsigned char *buf, long len, struct in6_addr *addr, int max, unsigned long *ttl) {
+    if (len < 12 || !(buf[2] & 0x80)) return -1;
+    if ((buf[3] & 0x0F) != 0) return 0;
+    int qd_count = (buf[4] << 8) | buf[5];
+    int an_count = (buf[6] << 8) | buf[7];
+    long off = 12;
+    for (int i = 0; i < qd_count && off >= 0; i++) {
+        off = dns_skip_name(buf, len, off);
+        if (off >= 0) off += 4;
+    }
+
+    int num = 0;
+    for (int i = 0; i < an_count && off >= 0 && off < len; i++) {
+        off = dns_skip_name(buf, len, off);
+        if (off < 0 || off + 10 > len) break;
+        unsigned short type = (buf[off] << 8) | buf[off + 1];
+        unsigned short class = (buf[off + 2] << 8) | buf[off + 3];
+        unsigned long rr_ttl = ((unsigned long) buf[off + 4] << 24) | (buf[off + 5] << 16) | (buf[off + 6] << 8) | buf[off + 7];
+        unsigned short rd_len = (buf[off + 8] << 8) | buf[off + 9];
+        off += 10;
+        if (off + rd_len > len) break;
+        if (class == 1 && num < max && ((type == DNS_TYPE_A && rd_len == 4) || (type == DNS_TYPE_AAAA && rd_len == 16))) {
+            if (type == DNS_TYPE_A) {
+                unsigned char mapped[16] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF, 0, 0, 0, 0};
+                memcpy(mapped + 12, buf + off, 4);
+                memcpy(&addr[num], mapped, 16);
+            } else {
+                memcpy(&addr[num], buf + off, 16);
+            }
+            num++;
+            if (rr_ttl < *ttl) *ttl = rr_ttl;
+        }
+        off += rd_len;
+    }
+    return num;
+}
+
+int dns_udp_query(const struct sockaddr_in6 *ns, const char *name, struct in6_addr *addr, int max, unsigned long *ttl) {
+    unsigned char buf[512];
+    const unsigned short types[2] = {DNS_TYPE_A, DNS_TYPE_AAAA};
+    unsigned short ids[2];
+    int answered[2] = {0, 0};
+    int num = 0, pending = 0;
+    unsigned long min_ttl = DNS_MAX_TTL;
+    struct timespec now, deadline;
+
+    int fd = socket(AF_INET6, SOCK_DGRAM, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr *) ns, sizeof(*ns)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += DNS_TIMEOUT / 1000;
+    for (int i = 0; i < 2; i++) {
+        ids[i] = dns_random_id();
+        int len = dns_build_query(buf, ids[i], name, types[i]);
+        if (len < 0 || send(fd, buf, len, 0) != len) {
+            answered[i] = 1;
+            continue;
+        }
+        pending++;
+    }
+
+    // A and AAAA queries are in flight at the same time, wait for both answers
+    while (pending > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long remaining = (deadline.tv_sec - now.tv_sec) * 1000 + (deadline.tv_nsec - now.tv_nsec) / 1000000;
+        struct pollfd fds = {.fd = fd, .events = POLLIN};
+        if (remaining <= 0 || poll(&fds, 1, (int) remaining) <= 0) break;
+        long len = recv(fd, buf, sizeof(buf), 0);
+        if (len < 12) continue;
+        unsigned short res_id = (buf[0] << 8) | buf[1];
+        int i = res_id == ids[0] ? 0 : res_id == ids[1] ? 1 : -1;
+        if (i < 0 || answered[i] || dns_check_question(buf, len, name, types[i]) != 0) continue;
+        answered[i] = 1;
+        pending--;
+        int ret = dns_parse_response(buf, len, addr + num, max - num, &min_ttl);
+        if (ret > 0) num += ret;
+    }
+    close(fd);
+
+    if (num > 0) {
+        if (min_ttl < DNS_MIN_TTL) min_ttl = DNS_MIN_TTL;
+        *ttl = min_ttl;
+    }
+    return num;
+}
+
+int dns_getaddrinfo(const char *name, struct in6_addr *addr, int max) {
+    struct addrinfo hints, *result, *ptr;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(name, NULL, &hints, &result) != 0) return -1;
+    int num = 0;
+    for (ptr = result; ptr != NULL && num < max; ptr = ptr->ai_next) {
+        if (ptr->ai_family == AF_INET6) {
+            memcpy(&addr[num++], &((struct sockaddr_in6 *) ptr->ai_addr)->sin6_addr, 16);
+        } else if (ptr->ai_family == AF_INET) {
+            unsigned char mapped[16] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF, 0, 0, 0, 0};
+            memcpy(mapped + 12, &((struct sockaddr_in *) ptr->ai_addr)->sin_addr, 4);
+            memcpy(&addr[num++], mapped, 16);
+        }
+    }
+    freeaddrinfo(result);
+    return num;
+}
+
+int dns_query(const char *name, struct in6_addr *addr, int max, unsigned long *ttl) {
+    struct sockaddr_in6 ns;
+    int num;
+    *ttl = DNS_DEFAULT_TTL;
+    if (dns_parse_addr(name, &addr[0]) == 0) {
+        *ttl = DNS_MAX_TTL;
+        return 1;
+    } else if ((num = dns_hosts_lookup(name, addr, max)) > 0) {
+        return num;
+    } else if (dns_nameserver(&ns) == 0 && (num = dns_udp_query(&ns, name, addr, max, ttl)) > 0) {
+        return num;
+    }
+    // search domains and other name services are left to the system resolver
+    *ttl = DNS_DEFAULT_TTL;
+    return dns_getaddrinfo(name, addr, max);
+}
+
+void dns_store(const char *name, const struct in6_addr *addr, int num, unsigned long ttl) {
+    time_t now = time(NULL);
+    dns_entry *slot = NULL;
+    dns_lock();
+    for (int i = 0; i < DNS_CACHE_SIZE; i++) {
+        dns_entry *e = &dns_cache->entries[i];
+        if (strcmp(e->name, name) == 0) {
+            slot = e;
+            break;
+        } else if (slot == NULL || (slot->name[0] != 0 && (e->name[0] == 0 || e->last_used < slot->last_used))) {
+            slot = e;
+        }
+    }
+    strcpy(slot->name, name);
+    memcpy(slot->addr, addr, num * sizeof(struct in6_addr));
+    slot->num = num;
+    slot->ttl = ttl;
+    slot->expires = now + (time_t) ttl;
+    slot->last_used = now;
+    slot->refreshing = 0;
+    slot->pending = 0;
+    dns_unlock();
+}
+
+void dns_request(const char *name, time_t now) {
+    // called with the lock held, the name is resolved by the dns-refresher
+    dns_entry *slot = NULL;
+    for (int i = 0; i < DNS_CACHE_SIZE; i++) {
+        dns_entry *e = &dns_cache->entries[i];
+        if (strcmp(e->name, name) == 0) {
+            slot = e;
+            break;
+        } else if (slot == NULL || (slot->name[0] != 0 && (e->name[0] == 0 || e->last_used < slot->last_used))) {
+            slot = e;
+        }
+    }
+    if (strcmp(slot->name, name) != 0) {
+        strcpy(slot->name, name);
+        slot->num = 0;
+        slot->ttl = 0;
+        slot->refreshing = 0;
+    }
+    slot->expires = 0;
+    slot->last_used = now;
+    slot->pending = 1;
+    if (dns_notify[1] >= 0) write(dns_notify[1], "", 1);
+}
+
+int dns_resolve(const char *name, struct in6_addr *addr, int max) {
+    struct in6_addr buf[DNS_MAX_ADDR];
+    unsigned long ttl;
+    int num = -1;
+
+    if (dns_parse_addr(name, &buf[0]) == 0) {
+        num = 1;
+    } else if (dns_cache == NULL || strlen(name) >= sizeof(dns_cache->entries[0].name)) {
+        num = dns_query(name, buf, DNS_MAX_ADDR, &ttl);
+        if (num <= 0) return -1;
+    } else {
+        // a miss is resolved once by the dns-refresher for all processes, they wait for its answer
+        struct timespec begin, now;
+        long delay = 1000;
+        int requested = 0, gone;
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        while (1) {
+            time_t t = time(NULL);
+            dns_entry *found = NULL;
+            dns_lock();
+            gone = t - dns_cache->alive > DNS_WAIT_TIMEOUT / 1000;
+            for (int i = 0; i < DNS_CACHE_SIZE; i++) {
+                dns_entry *e = &dns_cache->entries[i];
+                if (strcmp(e->name, name) == 0) {
+                    found = e;
+                    break;
+                }
+            }
+            if (found != NULL && !found->pending && found->expires > t) {
+                found->last_used = t;
+                num = found->num;
+                memcpy(buf, found->addr, num * sizeof(struct in6_addr));
+            } else if (!requested || found == NULL) {
+                dns_request(name, t);
+                requested = 1;
+            }
+            dns_unlock();
+
+            // num == 0: the name could not be resolved a short time ago
+            if (num == 0) return -1;
+            if (num > 0) break;
+
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long waited = (now.tv_sec - begin.tv_sec) * 1000 + (now.tv_nsec - begin.tv_nsec) / 1000000;
+            if (gone || waited >= DNS_WAIT_TIMEOUT) {
+                // the dns-refresher is stuck or not running anymore, resolve the name in this process
+                num = dns_query(name, buf, DNS_MAX_ADDR, &ttl);
+                if (num <= 0) return -1;
+                dns_store(name, buf, num, ttl);
+                break;
+            }
+            usleep(delay);
+            if (delay < 20000) delay *= 2;
+        }
+    }
+
+    if (num > max) num = max;
+    memcpy(addr, buf, num * sizeof(struct in6_addr));
+    return num;
+}
+
+int dns_ptr_name(const struct in6_addr *addr, char *name) {
+    const unsigned char *a = addr->s6_addr;
+    const unsigned char mapped[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF};
+    if (memcmp(a, mapped, sizeof(mapped)) == 0) {
+        return sprintf(name, "%i.%i.%i.%i.in-addr.arpa", a[15], a[14], a[13], a[12]);
+    }
+    int off = 0;
+    for (int i = 15; i >= 0; i--) {
+        off += sprintf(name + off, "%x.%x.", a[i] & 0xF, a[i] >> 4);
+    }
+    return off + sprintf(name + off, "ip6.arpa");
+}
+
+long dns_read_name(const unsigned char *buf, long len, long off, char *name, unsigned long size) {
+    // returns the offset after the name in the record, compression pointers are followed
+    long end = -1;
+    unsigned long name_len = 0;
+    for (int jumps = 0; off < len && jumps < 16;) {
+        unsigned char ch = buf[off];
+        if (ch == 0) {
+            if (name_len > 0) name_len--;
+            name[name_len] = 0;
+            return end >= 0 ? end : off + 1;
+        } else if ((ch & 0xC0) == 0xC0) {
+            if (off + 1 >= len) return -1;
+            if (end < 0) end = off + 2;
+            off = ((ch & 0x3F) << 8) | buf[off + 1];
+            jumps++;
+            continue;
+        } else if (off + 1 + ch > len || name_len + ch + 2 > size) {
+            return -1;
+        }
+        for (int i = 0; i < ch; i++) {
+            unsigned char c = buf[off + 1 + i];
+            // host names only, anything else would end up in logs and REMOTE_HOST
+            if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '_'))
+                return -1;
+            name[name_len++] = (char) c;
+        }
+        name[name_len++] = '.';
+        off += ch + 1;
+    }
+    return -1;
+}
+
+int dns_parse_ptr_response(const unsigned char *buf, long len, char *name, unsigned long *ttl) {
+    // returns 1 if a host name was found, 0 if there is none and -1 if the response is unusable
+    char tmp[256];
+    if (len < 12 || !(buf[2] & 0x80)) return -1;
+    int rcode = buf[3] & 0x0F;
+    if (rcode == 3) return 0;
+    if (rcode != 0) return -1;
+    int qd_count = (buf[4] << 8) | buf[5];
+    int an_count = (buf[6] << 8) | buf[7];
+    long off = 12;
+    for (int i = 0; i < qd_count && off >= 0; i++) {
+        off = dns_skip_name(buf, len, off);
+        if (off >= 0) off += 4;
+    }
+    for (int i = 0; i < an_count && off >= 0 && off < len; i++) {
+        off = dns_skip_name(buf, len, off);
+        if (off < 0 || off + 10 > len) break;
+        unsigned short type = (buf[off] << 8) | buf[off + 1];
+        unsigned short class = (buf[off + 2] << 8) | buf[off + 3];
+        unsigned long rr_ttl = ((unsigned long) buf[off + 4] << 24) | (buf[off + 5] << 16) | (buf[off + 6] << 8) | buf[off + 7];
+        unsigned short rd_len = (buf[off + 8] << 8) | buf[off + 9];
+        off += 10;
+        if (off + rd_len > len) break;
+        if (class == 1 && type == DNS_TYPE_PTR && dns_read_name(buf, len, off, tmp, sizeof(tmp)) > 0 && tmp[0] != 0) {
+            strcpy(name, tmp);
+            *ttl = rr_ttl;
+            return 1;
+        }
+        off += rd_len;
+    }
+    return 0;
+}
+
+void dns_ptr_store(const struct in6_addr *addr, const char *name, unsigned long ttl) {
+    time_t now = time(NULL);
+    dns_ptr_entry *slot = NULL;
+    if (dns_cache == NULL) return;
+    dns_lock();
+    // the least recently used entry is replaced
+    for (int i = 0; i < DNS_PTR_CACHE_SIZE; i++) {
+        dns_ptr_entry *e = &dns_cache->ptr_entries[i];
+        if (e->expires != 0 && memcmp(&e->addr, addr, sizeof(*addr)) == 0) {
+            slot = e;
+            break;
+        } else if (slot == NULL || (slot->expires != 0 && (e->expires == 0 || e->last_used < slot->last_used))) {
+            slot = e;
+        }
+    }
+    slot->addr = *addr;
+    snprintf(slot->name, sizeof(slot->name), "%s", name);
+    slot->expires = now + (time_t) ttl;
+    slot->last_used = now;
+    dns_unlock();
+}
+
+int dns_reverse_start(const char *addr_str, char **host) {
+    unsigned char buf[512];
+    char name[80];
+    struct sockaddr_in6 ns;
+    struct in6_addr addr;
+    time_t now = time(NULL);
+    int found = 0;
+    *host = NULL;
+
+    dns_reverse_abort();
+    if (dns_parse_addr(addr_str, &addr) != 0) return -1;
+
+    if (dns_cache != NULL) {
+        dns_lock();
+        for (int i = 0; i < DNS_PTR_CACHE_SIZE; i++) {
+            dns_ptr_entry *e = &dns_cache->ptr_entries[i];
+            if (e->expires > now && memcmp(&e->addr, &addr, sizeof(addr)) == 0) {
+                e->last_used = now;
+                if (e->name[0] != 0) {
+                    *host = malloc(strlen(e->name) + 1);
+                    if (*host != NULL) strcpy(*host, e->name);
+                }
+                found = 1;
+                break;
+            }
+        }
+        dns_unlock();
+        if (found) return 1;
+    }
+
+    if (dns_nameserver(&ns) != 0) return -1;
+    dns_ptr_name(&addr, name);
+    dns_ptr.fd = socket(AF_INET6, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (dns_ptr.fd < 0) {
+        dns_ptr.fd = -1;
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &dns_ptr.deadline);
+    dns_ptr.id = dns_random_id();
+    dns_ptr.deadline.tv_sec += DNS_TIMEOUT / 1000;
+    dns_ptr.addr = addr;
+    int len = dns_build_query(buf, dns_ptr.id, name, DNS_TYPE_PTR);
+    if (len < 0 || connect(dns_ptr.fd, (struct sockaddr *) &ns, sizeof(ns)) != 0 || send(dns_ptr.fd, buf, len, 0) != len) {
+        dns_reverse_abort();
+        return -1;
+    }
+    return 0;
+}
+
+int dns_reverse_poll(char **host, int wait) {
+    // returns 1 once the lookup is finished, only blocks if asked to wait for the answer
+    unsigned char buf[512];
+    char name[256], question[80];
+    unsigned long ttl;
+    struct timespec now;
+    long len;
+    if (dns_ptr.fd < 0) return 1;
+
+    dns_ptr_name(&dns_ptr.addr, question);
+    while (1) {
+        len = recv(dns_ptr.fd, buf, sizeof(buf), 0);
+        if (len >= 12 && ((buf[0] << 8) | buf[1]) == dns_ptr.id &&
+            dns_check_question(buf, len, question, DNS_TYPE_PTR) == 0) {
+            int ret = dns_parse_ptr_response(buf, len, name, &ttl);
+            if (ret == 0) {
+                dns_ptr_store(&dns_ptr.addr, "", DNS_NEGATIVE_TTL);
+            } else if (ret > 0) {
+                if (ttl < DNS_MIN_TTL) ttl = DNS_MIN_TTL;
+                if (ttl > DNS_MAX_TTL) ttl = DNS_MAX_TTL;
+                dns_ptr_store(&dns_ptr.addr, name, ttl);
+                *host = malloc(strlen(name) + 1);
+                if (*host != NULL) strcpy(*host, name);
+            }
+            break;
+        } else if (len >= 0) {
+            continue;
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            break;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long remaining = (dns_ptr.deadline.tv_sec - now.tv_sec) * 1000 +
+                         (dns_ptr.deadline.tv_nsec - now.tv_nsec) / 1000000;
+        // without an answer the address is looked up again on the next connection
+        if (remaining <= 0) break;
+        if (!wait) return 0;
+        struct pollfd fds = {.fd = dns_ptr.fd, .events = POLLIN};
+        poll(&fds, 1, (int) remaining);
+    }
+
+    dns_reverse_abort();
+    return 1;
+}
+
+void dns_reverse_abort() {
+    if (dns_ptr.fd >= 0) {
+        close(dns_ptr.fd);
+        dns_ptr.fd = -1;
+    }
+}
+
+void dns_process_term() {
+    dns_continue = 0;
+}
+
+void dns_refresh_done(dns_refresh_query *q) {
+    if (q->num > 0) {
+        if (q->ttl < DNS_MIN_TTL) q->ttl = DNS_MIN_TTL;
+    } else if (q->answered[0] && q->answered[1]) {
+        // search domains and other name services are left to the system resolver,
+        // a name server that did not answer in time would only stall the other names there
+        q->ttl = DNS_DEFAULT_TTL;
+        q->num = dns_getaddrinfo(q->name, q->addr, DNS_MAX_ADDR);
+    }
+
+    dns_entry *e = q->entry;
+    dns_lock();
+    if (strcmp(e->name, q->name) == 0) {
+        if (q->num > 0) {
+            memcpy(e->addr, q->addr, q->num * sizeof(struct in6_addr));
+            e->num = q->num;
+            e->ttl = q->ttl;
+            e->expires = time(NULL) + (time_t) q->ttl;
+        } else {
+            // keep serving the last known addresses while the name server is unavailable,
+            // a name without any is cached as failed
+            e->expires = time(NULL) + DNS_FAILURE_TTL;
+        }
+        e->refreshing = 0;
+        e->pending = 0;
+    }
+    dns_unlock();
+    q->entry = NULL;
+}
+
+void dns_refresh_start(dns_refresh_query *q, int fd) {
+    unsigned char buf[512];
+    const unsigned short types[2] = {DNS_TYPE_A, DNS_TYPE_AAAA};
+    q->ttl = DNS_MAX_TTL;
+    if (dns_parse_addr(q->name, &q->addr[0]) == 0) {
+        q->num = 1;
+        dns_refresh_done(q);
+        return;
+    } else if ((q->num = dns_hosts_lookup(q->name, q->addr, DNS_MAX_ADDR)) > 0) {
+        q->ttl = DNS_DEFAULT_TTL;
+        dns_refresh_done(q);
+        return;
+    }
+
+    int sent = 0;
+    for (int i = 0; i < 2; i++) {
+        q->ids[i] = dns_random_id();
+        int len = dns_build_query(buf, q->ids[i], q->name, types[i]);
+        q->answered[i] = fd < 0 || len < 0 || send(fd, buf, len, 0) != len;
+        if (!q->answered[i]) sent++;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &q->deadline);
+    q->deadline.tv_sec += DNS_TIMEOUT / 1000;
+    if (sent == 0) dns_refresh_done(q);
+}
+
+void dns_refresh_answer(dns_refresh_query *queries, const unsigned char *buf, long len) {
+    const unsigned short types[2] = {DNS_TYPE_A, DNS_TYPE_AAAA};
+    if (len < 12) return;
+    unsigned short res_id = (buf[0] << 8) | buf[1];
+    for (int i = 0; i < DNS_MAX_QUERIES; i++) {
+        dns_refresh_query *q = &queries[i];
+        if (q->entry == NULL) continue;
+        int t = res_id == q->ids[0] ? 0 : res_id == q->ids[1] ? 1 : -1;
+        if (t < 0 || q->answered[t] || dns_check_question(buf, len, q->name, types[t]) != 0) continue;
+        q->answered[t] = 1;
+        int ret = dns_parse_response(buf, len, q->addr + q->num, DNS_MAX_ADDR - q->num, &q->ttl);
+        if (ret > 0) q->num += ret;
+        if (q->answered[0] && q->answered[1]) dns_refresh_done(q);
+        return;
+    }
+}
+
+int dns_process() {
+    dns_refresh_query queries[DNS_MAX_QUERIES];
+    struct sockaddr_in6 ns;
+    unsigned char buf[512];
+    struct timespec ts;
+    int fd = -1;
+
+    signal(SIGINT, dns_process_term);
+    signal(SIGTERM, dns_process_term);
+    memset(queries, 0, sizeof(queries));
+
+    while (dns_continue) {
+        time_t now = time(NULL);
+        dns_cache->alive = now;
+
+        // one socket for all queries, so a slow name does not hold up the others
+        if (fd < 0 && dns_nameserver(&ns) == 0) {
+            fd = socket(AF_INET6, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (fd >= 0 && connect(fd, (struct sockaddr *) &ns, sizeof(ns)) != 0) {
+                close(fd);
+                fd = -1;
+            }
+        }
+
+        for (int i = 0, j = 0; i < DNS_CACHE_SIZE && dns_continue; i++) {
+            while (j < DNS_MAX_QUERIES && queries[j].entry != NULL) j++;
+            if (j == DNS_MAX_QUERIES) break;
+            dns_entry *e = &dns_cache->entries[i];
+            dns_lock();
+            // refresh shortly before the entry expires
+            time_t ahead = e->ttl / 4 < DNS_REFRESH_AHEAD ? (time_t) (e->ttl / 4) : DNS_REFRESH_AHEAD;
+            if (e->name[0] == 0 || e->refreshing || e->expires - now > ahead) {
+                dns_unlock();
+                continue;
+            } else if (now - e->last_used > DNS_IDLE_TIME) {
+                // unused names are not kept up to date
+                if (e->expires <= now) e->name[0] = 0;
+                dns_unlock();
+                continue;
+            }
+            e->refreshing = 1;
+            strcpy(queries[j].name, e->name);
+            queries[j].entry = e;
+            queries[j].num = 0;
+            dns_unlock();
+
+            dns_refresh_start(&queries[j], fd);
+        }
+
+        // woken up early by answers and by processes waiting for a name
+        long timeout = 1000;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        for (int i = 0; i < DNS_MAX_QUERIES; i++) {
+            if (queries[i].entry == NULL) continue;
+            long remaining = (queries[i].deadline.tv_sec - ts.tv_sec) * 1000 +
+                             (queries[i].deadline.tv_nsec - ts.tv_nsec) / 1000000;
+            if (remaining < timeout) timeout = remaining > 0 ? remaining : 0;
+        }
+        struct pollfd fds[2] = {{.fd = dns_notify[0], .events = POLLIN}, {.fd = fd, .events = POLLIN}};
+        if (poll(fds, fd >= 0 ? 2 : 1, (int) timeout) > 0) {
+            if (fds[0].revents & POLLIN) {
+                while (read(dns_notify[0], buf, sizeof(buf)) > 0);
+            }
+            if (fd >= 0 && fds[1].revents) {
+                long len;
+                while ((len = recv(fd, buf, sizeof(buf), 0)) >= 0) {
+                    dns_refresh_answer(queries, buf, len);
+                }
+            }
+        }
+
+        // without an answer in time, the name is left to the system resolver
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        for (int i = 0; i < DNS_MAX_QUERIES; i++) {
+            dns_refresh_query *q = &queries[i];
+            if (q->entry != NULL && (ts.tv_sec > q->deadline.tv_sec ||
+                                     (ts.tv_sec == q->deadline.tv_sec && ts.tv_nsec >= q->deadline.tv_nsec))) {
+                dns_refresh_done(q);
+            }
+        }
+    }
+
+    if (fd >= 0) close(fd);
+    return 0;
+}
+
+int dns_init() {
+    int shm_id = shmget(SHM_KEY_DNS, sizeof(dns_table), IPC_CREAT | IPC_EXCL | 0600);
+    if (shm_id < 0) {
+        fprintf(stderr, ERR_STR "Unable to create shared memory: %s" CLR_STR "\n", strerror(errno));
+        return -1;
+    }
+
+    void *shm_rw = shmat(shm_id, NULL, 0);
+    if (shm_rw == (void *) -1) {
+        fprintf(stderr, ERR_STR "Unable to attach shared memory (rw): %s" CLR_STR "\n", strerror(errno));
+        return -2;
+    }
+    dns_cache = shm_rw;
+    memset(dns_cache, 0, sizeof(dns_table));
+    dns_cache->alive = time(NULL);
+    if ((errno = shm_mutex_init(&dns_cache->lock)) != 0) {
+        fprintf(stderr, ERR_STR "Unable to initialize lock: %s" CLR_STR "\n", strerror(errno));
+        return -2;
+    }
+    if (pipe2(dns_notify, O_NONBLOCK | O_CLOEXEC) != 0) {
+        fprintf(stderr, ERR_STR "Unable to create pipe: %s" CLR_STR "\n", strerror(errno));
+        return -2;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // child
+        if (dns_process() == 0) {
+            return 1;
+        } else {
+            return -4;
+        }
+    } else if (pid > 0) {
+        // parent
+        fprintf(stderr, "Started child process with PID %i as dns-refresher\n", pid);
+        for (int i = 0; i < MAX_CHILDREN; i++) {
+            if (children[i] == 0) {
+                children[i] = pid;
+                break;
+            }
+        }
+    } else {
+        fprintf(stderr, ERR_STR "Unable to create child process: %s" CLR_STR "\n", strerror(errno));
+        return -3;
+    }
+
+    return 0;
+}
+
+int dns_unload() {
+    int shm_id = shmget(SHM_KEY_DNS, 0, 0);
+    if (shm_id < 0) {
+        fprintf(stderr, ERR_STR "Unable to get shared memory id: %s" CLR_STR "\n", strerror(errno));
+        shmdt(dns_cache);
+        return -1;
+    } else if (shmctl(shm_id, IPC_RMID, NULL) < 0) {
+        fprintf(stderr, ERR_STR "Unable to configure shared memory: %s" CLR_STR "\n", strerror(errno));
+        shmdt(dns_cache);
+        return -1;
+    }
+    shmdt(dns_cache);
+    dns_cache = NULL;
+    return 0;
+}
@@ -0,0 +1,115 @@
+/**
+ * Necronda Web Server
+ * Cached host name resolution (header file)
+ * src/dns.h
+ * Lorenz Stechauner, 2021-02-28
+ */
+
+#ifndef NECRONDA_SERVER_DNS_H
+#define NECRONDA_SERVER_DNS_H
+
+#define DNS_CACHE_SIZE 64
+#define DNS_MAX_ADDR 8
+#define DNS_MIN_TTL 5
+#define DNS_MAX_TTL 3600
+#define DNS_DEFAULT_TTL 60
+#define DNS_REFRESH_AHEAD 10
+#define DNS_IDLE_TIME 600
+#define DNS_TIMEOUT 1000
+#define DNS_WAIT_TIMEOUT 3000
+#define DNS_FAILURE_TTL 5
+#define DNS_PTR_CACHE_SIZE 256
+#define DNS_NEGATIVE_TTL 300
+#define DNS_MAX_QUERIES 16
+
+#define DNS_TYPE_A 1
+#define DNS_TYPE_AAAA 28
+#define DNS_TYPE_PTR 12
+
+#include "necronda-server.h"
+#include "utils.h"
+
+#include <netdb.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/random.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+
+typedef struct {
+    char name[256];
+    unsigned char num;
+    struct in6_addr addr[DNS_MAX_ADDR];
+    unsigned long ttl;
+    time_t expires;
+    time_t last_used;
+    unsigned char refreshing:1;
+    unsigned char pending:1;    // requested by a process, not resolved yet (num == 0 without it: name failed)
+} dns_entry;
+
+typedef struct {
+    struct in6_addr addr;
+    char name[256];     // empty if the address has no host name
+    time_t expires;
+    time_t last_used;
+} dns_ptr_entry;
+
+typedef struct {
+    pthread_mutex_t lock;
+    time_t alive;       // last sign of life of the dns-refresher
+    dns_entry entries[DNS_CACHE_SIZE];
+    dns_ptr_entry ptr_entries[DNS_PTR_CACHE_SIZE];
+} dns_table;
+
+typedef struct {
+    // reverse lookup of the client address, in flight while the connection is handled
+    int fd;
+    unsigned short id;
+    struct in6_addr addr;
+    struct timespec deadline;
+} dns_ptr_query;
+
+typedef struct {
+    // A and AAAA query of the dns-refresher, answered on its shared socket
+    dns_entry *entry;
+    char name[256];
+    unsigned short ids[2];
+    unsigned char answered[2];
+    int num;
+    struct in6_addr addr[DNS_MAX_ADDR];
+    unsigned long ttl;
+    struct timespec deadline;
+} dns_refresh_query;
+
+dns_table *dns_cache;
+int dns_continue = 1;
+int dns_notify[2] = {-1, -1};
+dns_ptr_query dns_ptr = {.fd = -1};
+
+
+int dns_init();
+
+int dns_unload();
+
+int dns_nameserver(struct sockaddr_in6 *addr);
+
+int dns_hosts_lookup(const char *name, struct in6_addr *addr, int max);
+
+unsigned short dns_random_id();
+
+int dns_check_question(const unsigned char *buf, long len, const char *name, unsigned short type);
+
+int dns_query(const char *name, struct in6_addr *addr, int max, unsigned long *ttl);
+
+int dns_resolve(const char *name, struct in6_addr *addr, int max);
+
+int dns_reverse_start(const char *addr_str, char **host);
+
+int dns_reverse_poll(char **host, int wait);
+
+void dns_reverse_abort();
+
+#endif //NECRONDA_SERVER_DNS_H
@@ -8,6 +8,253 @@
 #include "fastcgi.h"
 
 
+int fastcgi_state_init() {
+    int shm_id = shmget(SHM_KEY_FASTCGI, UPSTREAM_MAX_SERVERS * sizeof(fastcgi_backend_state),
+                        IPC_CREAT | IPC_EXCL | 0600);
+    if (shm_id < 0) {
+        fprintf(stderr, ERR_STR "Unable to create shared memory: %s" CLR_STR "\n", strerror(errno));
+        return -1;
+    }
+
+    void *shm_rw = shmat(shm_id, NULL, 0);
+    if (shm_rw == (void *) -1) {
+        fprintf(stderr, ERR_STR "Unable to attach shared memory (rw): %s" CLR_STR "\n", strerror(errno));
+        return -2;
+    }
+    fastcgi_backends = shm_rw;
+    memset(fastcgi_backends, 0, UPSTREAM_MAX_SERVERS * sizeof(fastcgi_backend_state));
+    return 0;
+}
+
+int fastcgi_state_unload() {
+    int shm_id = shmget(SHM_KEY_FASTCGI, 0, 0);
+    if (shm_id < 0) {
+        fprintf(stderr, ERR_STR "Unable to get shared memory id: %s" CLR_STR "\n", strerror(errno));
+        shmdt(fastcgi_backends);
+        return -1;
+    } else if (shmctl(shm_id, IPC_RMID, NULL) < 0) {
+        fprintf(stderr, ERR_STR "Unable to configure shared memory: %s" CLR_STR "\n", strerror(errno));
+        shmdt(fastcgi_backends);
+        return -1;
+    }
+    shmdt(fastcgi_backends);
+    fastcgi_backends = NULL;
+    return 0;
+}
+
+int fastcgi_connect(int backend) {
+    const int YES = 1;
+    upstream_server *srv = &upstream_servers[backend];
+    int fd = socket(srv->addr.ss_family, SOCK_STREAM, 0);
+    if (fd < 0) {
+        print(ERR_STR "Unable to create socket: %s" CLR_STR, strerror(errno));
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *) &srv->addr, srv->addr_len) < 0) {
+        print(ERR_STR "Unable to connect to FastCGI server %s: %s" CLR_STR, srv->name, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if (srv->addr.ss_family != AF_UNIX) {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &YES, sizeof(YES));
+    }
+    return fd;
+}
+
+int fastcgi_probe(int backend) {
+    char buf[256];
+    FCGI_Header header = {
+            .version = FCGI_VERSION_1,
+            .type = FCGI_GET_VALUES,
+            .requestIdB1 = 0,
+            .requestIdB0 = FCGI_NULL_REQUEST_ID,
+            .paddingLength = 0,
+            .reserved = 0
+    };
+    fastcgi_backend_state *state = &fastcgi_backends[backend];
+
+    // FCGI_GET_VALUES is sent on a separate connection, because some applications (e.g. PHP-FPM)
+    // close the connection after answering management records
+    int fd = fastcgi_connect(backend);
+    if (fd < 0) return -1;
+    struct timeval timeout = {.tv_sec = 1, .tv_usec = 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    char *ptr = buf + sizeof(header);
+    ptr = fastcgi_add_param(ptr, FCGI_MAX_CONNS, "");
+    ptr = fastcgi_add_param(ptr, FCGI_MAX_REQS, "");
+    ptr = fastcgi_add_param(ptr, FCGI_MPXS_CONNS, "");
+    unsigned short len = ptr - buf - sizeof(header);
+    header.contentLengthB1 = len >> 8;
+    header.contentLengthB0 = len & 0xFF;
+    memcpy(buf, &header, sizeof(header));
+
+    if (send(fd, buf, len + sizeof(header), 0) != len + sizeof(header) ||
+        recv(fd, &header, sizeof(header), MSG_WAITALL) != sizeof(header) ||
+        header.version != FCGI_VERSION_1 || header.type != FCGI_GET_VALUES_RESULT) {
+        close(fd);
+        goto retry;
+    }
+    len = (header.contentLengthB1 << 8) | header.contentLengthB0;
+    if (len + header.paddingLength > sizeof(buf) ||
+        recv(fd, buf, len + header.paddingLength, MSG_WAITALL) != len + header.paddingLength) {
+        close(fd);
+        goto retry;
+    }
+    close(fd);
+
+    int mpxs_conns = 0;
+    unsigned long max_conns = 0, max_reqs = 0;
+    ptr = buf;
+    while (ptr < buf + len) {
+        unsigned long key_len, val_len;
+        ptr = fastcgi_get_param_len(ptr, &key_len);
+        ptr = fastcgi_get_param_len(ptr, &val_len);
+        if (ptr + key_len + val_len > buf + len) goto retry;
+        unsigned long val = strtoul(ptr + key_len, NULL, 10);
+        if (key_len == strlen(FCGI_MPXS_CONNS) && strncmp(ptr, FCGI_MPXS_CONNS, key_len) == 0) {
+            mpxs_conns = val != 0;
+        } else if (key_len == strlen(FCGI_MAX_CONNS) && strncmp(ptr, FCGI_MAX_CONNS, key_len) == 0) {
+            max_conns = val;
+        } else if (key_len == strlen(FCGI_MAX_REQS) && strncmp(ptr, FCGI_MAX_REQS, key_len) == 0) {
+            max_reqs = val;
+        }
+        ptr += key_len + val_len;
+    }
+    state->mpxs_conns = mpxs_conns;
+    state->max_conns = max_conns;
+    state->max_reqs = max_reqs;
+    state->probed = 1;
+    return 0;
+
+    retry:
+    // no (valid) answer, the server is used without multiplexing and asked again later
+    if (state->probe_fails < 16) state->probe_fails++;
+    unsigned long delay = (unsigned long) FASTCGI_PROBE_RETRY << (state->probe_fails - 1);
+    state->probe_next = fastcgi_pool_time() + (delay < FASTCGI_PROBE_RETRY_MAX ? delay : FASTCGI_PROBE_RETRY_MAX);
+    return 1;
+}
+
+time_t fastcgi_pool_time() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+int fastcgi_pool_get(int backend) {
+    time_t now = fastcgi_pool_time();
+    char buf;
+    for (int i = 0; i < FASTCGI_MAX_IDLE; i++) {
+        fastcgi_pool_conn *pc = &fastcgi_pool[i];
+        if (pc->socket == 0 || pc->backend != backend) continue;
+        int fd = pc->socket;
+        pc->socket = 0;
+        // an idle connection must neither be closed nor have pending data,
+        // except for records of aborted requests on multiplexed connections
+        long ret = recv(fd, &buf, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (now - pc->idle_since < FASTCGI_IDLE_TIMEOUT &&
+            ((ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) || (ret > 0 && pc->aborted))) {
+            return fd;
+        }
+        close(fd);
+    }
+    return -1;
+}
+
+void fastcgi_pool_put(int backend, int socket, int aborted) {
+    int max_idle = FASTCGI_MAX_IDLE;
+    if (fastcgi_backends != NULL && fastcgi_backends[backend].mpxs_conns) {
+        // one connection is enough for a backend that multiplexes requests
+        max_idle = 1;
+    }
+    int num = 0;
+    for (int i = 0; i < FASTCGI_MAX_IDLE; i++) {
+        if (fastcgi_pool[i].socket != 0 && fastcgi_pool[i].backend == backend) num++;
+    }
+    for (int i = 0; i < FASTCGI_MAX_IDLE && num < max_idle; i++) {
+        fastcgi_pool_conn *pc = &fastcgi_pool[i];
+        if (pc->socket == 0) {
+            pc->socket = socket;
+            pc->backend = backend;
+            pc->aborted = aborted;
+            pc->idle_since = fastcgi_pool_time();
+            return;
+        }
+    }
+    close(socket);
+}
+
+int fastcgi_pool_idle() {
+    int num = 0;
+    for (int i = 0; i < FASTCGI_MAX_IDLE; i++) {
+        if (fastcgi_pool[i].socket != 0) num++;
+    }
+    return num;
+}
+
+void fastcgi_pool_close() {
+    for (int i = 0; i < FASTCGI_MAX_IDLE; i++) {
+        if (fastcgi_pool[i].socket != 0) {
+            close(fastcgi_pool[i].socket);
+            fastcgi_pool[i].socket = 0;
+        }
+    }
+}
+
+int fastcgi_at_boundary(const fastcgi_conn *conn) {
+    return conn->in.len == 0 && conn->rec_len == 0 && conn->rec_skip == 0;
+}
+
+void fastcgi_release(fastcgi_conn *conn, int reuse) {
+    if (conn->socket == 0) return;
+    upstream_finish(conn->backend);
+    if (reuse && fastcgi_at_boundary(conn)) {
+        fastcgi_pool_put(conn->backend, conn->socket, 0);
+    } else {
+        shutdown(conn->socket, SHUT_RDWR);
+        close(conn->socket);
+    }
+    conn->socket = 0;
+}
+
+void fastcgi_abort(fastcgi_conn *conn) {
+    int at_boundary = fastcgi_at_boundary(conn);
+    conn->out_len = 0;
+    ringbuf_free(&conn->in);
+    if (conn->err_buf != NULL) {
+        free(conn->err_buf);
+        conn->err_buf = NULL;
+    }
+    if (conn->socket == 0) return;
+    // a partially received record cannot be skipped by the next request
+    if (fastcgi_backends == NULL || !fastcgi_backends[conn->backend].mpxs_conns || !at_boundary) {
+        fastcgi_release(conn, 0);
+        return;
+    }
+    upstream_finish(conn->backend);
+
+    // remaining records of this request will be discarded by the next request on this connection
+    FCGI_Header header = {
+            .version = FCGI_VERSION_1,
+            .type = FCGI_ABORT_REQUEST,
+            .requestIdB1 = conn->req_id >> 8,
+            .requestIdB0 = conn->req_id & 0xFF,
+            .contentLengthB1 = 0,
+            .contentLengthB0 = 0,
+            .paddingLength = 0,
+            .reserved = 0
+    };
+    if (send(conn->socket, &header, sizeof(header), 0) != sizeof(header)) {
+        shutdown(conn->socket, SHUT_RDWR);
+        close(conn->socket);
+        conn->socket = 0;
+        return;
+    }
+    fastcgi_pool_put(conn->backend, conn->socket, 1);
+    conn->socket = 0;
+}
+
 char *fastcgi_add_param(char *buf, const char *key, const char *value) {
     char *ptr = buf;
     unsigned long key_len = strlen(key);
@@ -43,8 +290,52 @@ char *fastcgi_add_param(char *buf, const char *key, const char *value) {
     return ptr;
 }
 
-int fastcgi_init(fastcgi_conn *conn, unsigned int client_num, unsigned int req_num, const sock *client,
-                 const http_req *req, const http_uri *uri) {
+int fastcgi_param(fastcgi_params *params, const char *key, const char *value) {
+    unsigned long needed = strlen(key) + strlen(value) + 8;
+    if (params->len + needed > params->size) {
+        unsigned long size = params->size == 0 ? 4096 : params->size * 2;
+        while (size < params->len + needed) size *= 2;
+        char *buf = realloc(params->buf, size);
+        if (buf == NULL) return -1;
+        params->buf = buf;
+        params->size = size;
+    }
+    params->len = fastcgi_add_param(params->buf + params->len, key, value) - params->buf;
+    return 0;
+}
+
+int fastcgi_writev(int fd, struct iovec *iov, int iov_num) {
+    while (iov_num > 0) {
+        long ret = writev(fd, iov, iov_num > IOV_MAX ? IOV_MAX : iov_num);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (iov_num > 0 && ret >= iov->iov_len) {
+            ret -= (long) iov->iov_len;
+            iov++;
+            iov_num--;
+        }
+        if (iov_num > 0) {
+            iov->iov_base = (char *) iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+    return 0;
+}
+
+char *fastcgi_get_param_len(const char *buf, unsigned long *len) {
+    const unsigned char *ptr = (const unsigned char *) buf;
+    if (ptr[0] & 0x80) {
+        *len = ((unsigned long) (ptr[0] & 0x7F) << 24) | (ptr[1] << 16) | (ptr[2] << 8) | ptr[3];
+        return (char *) ptr + 4;
+    }
+    *len = ptr[0];
+    return (char *) ptr + 1;
+}
+
+int fastcgi_init(fastcgi_conn *conn, const host_config *conf, unsigned int client_num, unsigned int req_num,
+                 const sock *client, const http_req *req, const http_uri *uri, int fresh) {
     unsigned short req_id = (client_num & 0xFFF) << 4;
     if (client_num == 0) {
         req_id |= (req_num + 1) & 0xF;
@@ -52,54 +343,64 @@ int fastcgi_init(fastcgi_conn *conn, unsigned int client_num, unsigned int req_n
         req_id |= req_num & 0xF;
     }
     conn->req_id = req_id;
-    conn->out_buf = NULL;
-    conn->out_off = 0;
-
-    int php_fpm = socket(AF_UNIX, SOCK_STREAM, 0);
-    if (php_fpm < 0) {
-        print(ERR_STR "Unable to create unix socket: %s" CLR_STR, strerror(errno));
+    conn->rec_len = 0;
+    conn->rec_skip = 0;
+    conn->err_len = 0;
+    conn->out_len = 0;
+    if (conn->in.buf == NULL && ringbuf_init(&conn->in, FASTCGI_RING_SIZE) != 0) {
+        print(ERR_STR "Unable to allocate FastCGI buffer: %s" CLR_STR, strerror(errno));
         return -1;
     }
-    conn->socket = php_fpm;
+    conn->in.start = 0;
+    conn->in.len = 0;
+    conn->reused = 0;
+
+    int php_fpm = -1;
+    unsigned long tried = 0;
+    for (int i = 0; i < conf->local.fastcgi.num && php_fpm < 0; i++) {
+        int backend = upstream_select(&conf->local.fastcgi, (int) (conf - config), tried,
+                                     upstream_hash_key(&conf->local.fastcgi, req->uri, client_addr_str));
+        if (backend < 0) break;
+        tried |= 1UL << backend;
+        conn->backend = backend;
 
-    struct sockaddr_un php_fpm_addr = {AF_UNIX, PHP_FPM_SOCKET};
-    if (connect(conn->socket, (struct sockaddr *) &php_fpm_addr, sizeof(php_fpm_addr)) < 0) {
-        print(ERR_STR "Unable to connect to unix socket of PHP-FPM: %s" CLR_STR, strerror(errno));
+        if (!fresh) php_fpm = fastcgi_pool_get(backend);
+        if (php_fpm >= 0) {
+            metrics_inc(fastcgi_reuses);
+            conn->reused = 1;
+            break;
+        }
+        if (fastcgi_backends != NULL && !fastcgi_backends[backend].probed &&
+            fastcgi_pool_time() >= fastcgi_backends[backend].probe_next && fastcgi_probe(backend) == -1) {
+            upstream_fail(backend);
+            continue;
+        }
+        php_fpm = fastcgi_connect(backend);
+        if (php_fpm < 0) {
+            upstream_fail(backend);
+            continue;
+        }
+        metrics_inc(fastcgi_connects);
+    }
+    if (php_fpm < 0) {
         return -1;
     }
+    conn->socket = php_fpm;
+    conn->start = upstream_time_us();
+    upstream_start(conn->backend);
 
-    FCGI_Header header = {
-            .version = FCGI_VERSION_1,
-            .requestIdB1 = req_id >> 8,
-            .requestIdB0 = req_id & 0xFF,
-            .paddingLength = 0,
-            .reserved = 0
-    };
-
-    header.type = FCGI_BEGIN_REQUEST;
-    header.contentLengthB1 = 0;
-    header.contentLengthB0 = sizeof(FCGI_BeginRequestBody);
-    FCGI_BeginRequestRecord begin = {
-            header,
-            {.roleB1 = (FCGI_RESPONDER >> 8) & 0xFF, .roleB0 = FCGI_RESPONDER & 0xFF, .flags = 0}
-    };
-    if (send(conn->socket, &begin, sizeof(begin), 0) != sizeof(begin)) {
-        print(ERR_STR "Unable to send to PHP-FPM: %s" CLR_STR, strerror(errno));
-        return -2;
-    }
+    fastcgi_params params = {.buf = NULL, .len = 0, .size = 0};
+    char buf0[CLIENT_MAX_HEADER_SIZE];
+    int ret = 0;
 
-    char param_buf[4096];
-    char buf0[256];
-    char *param_ptr = param_buf + sizeof(header);
-
-    param_ptr = fastcgi_add_param(param_ptr, "REDIRECT_STATUS", "CGI");
-    param_ptr = fastcgi_add_param(param_ptr, "DOCUMENT_ROOT", uri->webroot);
-    param_ptr = fastcgi_add_param(param_ptr, "GATEWAY_INTERFACE", "CGI/1.1");
-    param_ptr = fastcgi_add_param(param_ptr, "SERVER_SOFTWARE", SERVER_STR);
-    param_ptr = fastcgi_add_param(param_ptr, "SERVER_PROTOCOL", "HTTP/1.1");
-    param_ptr = fastcgi_add_param(param_ptr, "SERVER_NAME", http_get_header_field(&req->hdr, "Host"));
+    ret |= fastcgi_param(&params, "REDIRECT_STATUS", "CGI");
+    ret |= fastcgi_param(&params, "DOCUMENT_ROOT", uri->webroot);
+    ret |= fastcgi_param(&params, "GATEWAY_INTERFACE", "CGI/1.1");
+    ret |= fastcgi_param(&params, "SERVER_SOFTWARE", SERVER_STR);
+    ret |= fastcgi_param(&params, "SERVER_PROTOCOL", "HTTP/1.1");
+    ret |= fastcgi_param(&params, "SERVER_NAME", http_get_header_field(&req->hdr, "Host"));
     if (client->enc) {
-        param_ptr = fastcgi_add_param(param_ptr, "HTTPS", "on");
+        ret |= fastcgi_param(&params, "HTTPS", "on");
     }
 
     struct sockaddr_storage addr_storage;
@@ -108,46 +409,47 @@ int fastcgi_init(fastcgi_conn *conn, unsigned int client_num, unsigned int req_n
     getsockname(client->socket, (struct sockaddr *) &addr_storage, &len);
     addr = (struct sockaddr_in6 *) &addr_storage;
     sprintf(buf0, "%i", addr->sin6_port);
-    param_ptr = fastcgi_add_param(param_ptr, "SERVER_PORT", buf0);
+    ret |= fastcgi_param(&params, "SERVER_PORT", buf0);
 
     len = sizeof(addr_storage);
     getpeername(client->socket, (struct sockaddr *) &addr_storage, &len);
     addr = (struct sockaddr_in6 *) &addr_storage;
     sprintf(buf0, "%i", addr->sin6_port);
-    param_ptr = fastcgi_add_param(param_ptr, "REMOTE_PORT", buf0);
-    param_ptr = fastcgi_add_param(param_ptr, "REMOTE_ADDR", client_addr_str);
-    param_ptr = fastcgi_add_param(param_ptr, "REMOTE_HOST", client_host_str != NULL ? client_host_str : client_addr_str);
-    //param_ptr = fastcgi_add_param(param_ptr, "REMOTE_IDENT", "");
-    //param_ptr = fastcgi_add_param(param_ptr, "REMOTE_USER", "");
-
-    param_ptr = fastcgi_add_param(param_ptr, "REQUEST_METHOD", req->method);
-    param_ptr = fastcgi_add_param(param_ptr, "REQUEST_URI", req->uri);
-    param_ptr = fastcgi_add_param(param_ptr, "SCRIPT_NAME", uri->filename + strlen(uri->webroot));
-    param_ptr = fastcgi_add_param(param_ptr, "SCRIPT_FILENAME", uri->filename);
-    //param_ptr = fastcgi_add_param(param_ptr, "PATH_TRANSLATED", uri->filename);
-
-    param_ptr = fastcgi_add_param(param_ptr, "QUERY_STRING", uri->query != NULL ? uri->query : "");
+    ret |= fastcgi_param(&params, "REMOTE_PORT", buf0);
+    ret |= fastcgi_param(&params, "REMOTE_ADDR", client_addr_str);
+    ret |= fastcgi_param(&params, "REMOTE_HOST", client_host_str != NULL ? client_host_str : client_addr_str);
+    //ret |= fastcgi_param(&params, "REMOTE_IDENT", "");
+    //ret |= fastcgi_param(&params, "REMOTE_USER", "");
+
+    ret |= fastcgi_param(&params, "REQUEST_METHOD", req->method);
+    ret |= fastcgi_param(&params, "REQUEST_URI", req->uri);
+    ret |= fastcgi_param(&params, "SCRIPT_NAME", uri->filename + strlen(uri->webroot));
+    ret |= fastcgi_param(&params, "SCRIPT_FILENAME", uri->filename);
+    //ret |= fastcgi_param(&params, "PATH_TRANSLATED", uri->filename);
+
+    ret |= fastcgi_param(&params, "QUERY_STRING", uri->query != NULL ? uri->query : "");
     if (uri->pathinfo != NULL && strlen(uri->pathinfo) > 0) {
-        sprintf(buf0, "/%s", uri->pathinfo);
+        snprintf(buf0, sizeof(buf0), "/%s", uri->pathinfo);
     } else {
-        sprintf(buf0, "");
+        buf0[0] = 0;
     }
-    param_ptr = fastcgi_add_param(param_ptr, "PATH_INFO", buf0);
+    ret |= fastcgi_param(&params, "PATH_INFO", buf0);
 
-    //param_ptr = fastcgi_add_param(param_ptr, "AUTH_TYPE", "");
+    //ret |= fastcgi_param(&params, "AUTH_TYPE", "");
     char *content_length = http_get_header_field(&req->hdr, "Content-Length");
-    param_ptr = fastcgi_add_param(param_ptr, "CONTENT_LENGTH", content_length != NULL ? content_length : "");
+    ret |= fastcgi_param(&params, "CONTENT_LENGTH", content_length != NULL ? content_length : "");
     char *content_type = http_get_header_field(&req->hdr, "Content-Type");
-    param_ptr = fastcgi_add_param(param_ptr, "CONTENT_TYPE", content_type != NULL ? content_type : "");
+    ret |= fastcgi_param(&params, "CONTENT_TYPE", content_type != NULL ? content_type : "");
     if (client_geoip != NULL) {
-        param_ptr = fastcgi_add_param(param_ptr, "REMOTE_INFO", client_geoip);
+        ret |= fastcgi_param(&params, "REMOTE_INFO", client_geoip);
     }
 
     for (int i = 0; i < req->hdr.field_num; i++) {
+        const char *name = req->hdr.fields[i][0];
         char *ptr = buf0;
         ptr += sprintf(ptr, "HTTP_");
-        for (int j = 0; j < strlen(req->hdr.fields[i][0]); j++, ptr++) {
-            char ch = req->hdr.fields[i][0][j];
+        for (int j = 0; name[j] != 0 && ptr - buf0 < sizeof(buf0) - 1; j++, ptr++) {
+            char ch = name[j];
             if ((ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9')) {
                 ch = ch;
             } else if (ch >= 'a' && ch <= 'z') {
@@ -156,26 +458,83 @@ int fastcgi_init(fastcgi_conn *conn, unsigned int client_num, unsigned int req_n
                 ch = '_';
             }
             ptr[0] = ch;
-            ptr[1] = 0;
         }
-        param_ptr = fastcgi_add_param(param_ptr, buf0, req->hdr.fields[i][1]);
+        ptr[0] = 0;
+        ret |= fastcgi_param(&params, buf0, req->hdr.fields[i][1]);
     }
 
-    unsigned short param_len = param_ptr - param_buf - sizeof(header);
-    header.type = FCGI_PARAMS;
-    header.contentLengthB1 = param_len >> 8;
-    header.contentLengthB0 = param_len & 0xFF;
-    memcpy(param_buf, &header, sizeof(header));
-    if (send(conn->socket, param_buf, param_len + sizeof(header), 0) != param_len + sizeof(header)) {
-        print(ERR_STR "Unable to send to PHP-FPM: %s" CLR_STR, strerror(errno));
+    if (ret != 0) {
+        print(ERR_STR "Unable to encode FastCGI params: %s" CLR_STR, strerror(errno));
+        free(params.buf);
         return -2;
     }
 
-    header.type = FCGI_PARAMS;
-    header.contentLengthB1 = 0;
-    header.contentLengthB0 = 0;
-    if (send(conn->socket, &header, sizeof(header), 0) != sizeof(header)) {
+    // BEGIN_REQUEST, PARAMS records (at most 65535 bytes each), empty PARAMS and, for requests
+    // without body, empty STDIN are sent with a single writev()
+    int has_body = http_get_header_field(&req->hdr, "Transfer-Encoding") != NULL ||
+                   (content_length != NULL && strtoul(content_length, NULL, 10) > 0);
+    int num_records = (int) ((params.len + 0xFFFE) / 0xFFFF);
+    int iov_num = 0;
+    struct iovec *iov = malloc((num_records * 2 + 3) * sizeof(struct iovec));
+    FCGI_Header *headers = malloc((num_records + 2) * sizeof(FCGI_Header));
+    if (iov == NULL || headers == NULL) {
+        print(ERR_STR "Unable to encode FastCGI params: %s" CLR_STR, strerror(errno));
+        free(params.buf);
+        free(iov);
+        free(headers);
+        return -2;
+    }
+
+    FCGI_BeginRequestRecord begin = {
+            {
+                    .version = FCGI_VERSION_1,
+                    .type = FCGI_BEGIN_REQUEST,
+                    .requestIdB1 = req_id >> 8,
+                    .requestIdB0 = req_id & 0xFF,
+                    .contentLengthB1 = 0,
+                    .contentLengthB0 = sizeof(FCGI_BeginRequestBody),
+                    .paddingLength = 0,
+                    .reserved = 0
+            },
+            {.roleB1 = (FCGI_RESPONDER >> 8) & 0xFF, .roleB0 = FCGI_RESPONDER & 0xFF, .flags = FCGI_KEEP_CONN}
+    };
+    iov[iov_num].iov_base = &begin;
+    iov[iov_num++].iov_len = sizeof(begin);
+
+    for (int i = 0; i < num_records + 2; i++) {
+        unsigned long off = (unsigned long) i * 0xFFFF;
+        unsigned long rec_len = 0;
+        if (i < num_records) {
+            rec_len = params.len - off < 0xFFFF ? params.len - off : 0xFFFF;
+        } else if (i == num_records + 1 && has_body) {
+            break;
+        }
+        FCGI_Header *header = &headers[i];
+        header->version = FCGI_VERSION_1;
+        header->type = i <= num_records ? FCGI_PARAMS : FCGI_STDIN;
+        header->requestIdB1 = req_id >> 8;
+        header->requestIdB0 = req_id & 0xFF;
+        header->contentLengthB1 = rec_len >> 8;
+        header->contentLengthB0 = rec_len & 0xFF;
+        header->paddingLength = 0;
+        header->reserved = 0;
+        iov[iov_num].iov_base = header;
+        iov[iov_num++].iov_len = sizeof(FCGI_Header);
+        if (rec_len > 0) {
+            iov[iov_num].iov_base = params.buf + off;
+            iov[iov_num++].iov_len = rec_len;
+        }
+    }
+    conn->stdin_closed = !has_body;
+
+    ret = fastcgi_writev(conn->socket, iov, iov_num);
+    free(params.buf);
+    free(iov);
+    free(headers);
+    if (ret != 0) {
         print(ERR_STR "Unable to send to PHP-FPM: %s" CLR_STR, strerror(errno));
+        // PHP-FPM may have closed the idle connection in the meantime
+        if (!conn->reused) upstream_fail(conn->backend);
         return -2;
     }
 
@@ -183,6 +542,7 @@ int fastcgi_init(fastcgi_conn *conn, unsigned int client_num, unsigned int req_n
 }
 
 int fastcgi_close_stdin(fastcgi_conn *conn) {
+    if (conn->stdin_closed) return 0;
     FCGI_Header header = {
             .version = FCGI_VERSION_1,
             .type = FCGI_STDIN,
@@ -196,8 +556,10 @@ int fastcgi_close_stdin(fastcgi_conn *conn) {
 
     if (send(conn->socket, &header, sizeof(header), 0) != sizeof(header)) {
         print(ERR_STR "Unable to send to PHP-FPM: %s" CLR_STR, strerror(errno));
+        if (!conn->reused) upstream_fail(conn->backend);
         return -2;
     }
+    conn->stdin_closed = 1;
 
     return 0;
 }
@@ -206,6 +568,7 @@ int fastcgi_php_error(const char *msg, int msg_len, char *err_msg) {
     char *msg_str = malloc(msg_len + 1);
     char *ptr0 = msg_str;
     strncpy(msg_str, msg, msg_len);
+    msg_str[msg_len] = 0;
     char *ptr1 = NULL;
     int len;
     int err = 0;
@@ -268,88 +631,172 @@ int fastcgi_php_error(const char *msg, int msg_len, char *err_msg) {
     return err;
 }
 
-int fastcgi_header(fastcgi_conn *conn, http_res *res, char *err_msg) {
+int fastcgi_fill(fastcgi_conn *conn) {
+    long ret = ringbuf_recv(&conn->in, conn->socket, 0);
+    if (ret < 0) {
+        print(ERR_STR "Unable to receive from PHP-FPM: %s" CLR_STR, strerror(errno));
+        if (!conn->reused) upstream_fail(conn->backend);
+        return -1;
+    } else if (ret == 0) {
+        print(ERR_STR "Unable to receive from PHP-FPM: Connection closed" CLR_STR);
+        if (!conn->reused) upstream_fail(conn->backend);
+        return -1;
+    }
+    return 0;
+}
+
+long fastcgi_read(fastcgi_conn *conn, unsigned char *type, char **ptr) {
     FCGI_Header header;
-    char *content;
-    unsigned short content_len, req_id;
-    int ret;
-    int err = 0;
+    unsigned short req_id;
+    unsigned long len;
 
-    while (1) {
-        ret = recv(conn->socket, &header, sizeof(header), 0);
-        if (ret < 0) {
-            res->status = http_get_status(502);
-            sprintf(err_msg, "Unable to communicate with PHP-FPM.");
-            print(ERR_STR "Unable to receive from PHP-FPM: %s" CLR_STR, strerror(errno));
-            return 1;
-        } else if (ret != sizeof(header)) {
-            res->status = http_get_status(502);
-            sprintf(err_msg, "Unable to communicate with PHP-FPM.");
-            print(ERR_STR "Unable to receive from PHP-FPM" CLR_STR);
-            return 1;
+    while (conn->rec_len == 0) {
+        while (conn->rec_skip > 0) {
+            if (conn->in.len == 0 && fastcgi_fill(conn) != 0) return -1;
+            len = conn->rec_skip < conn->in.len ? conn->rec_skip : conn->in.len;
+            ringbuf_consume(&conn->in, len);
+            conn->rec_skip -= len;
         }
-        req_id = (header.requestIdB1 << 8) | header.requestIdB0;
-        content_len = (header.contentLengthB1 << 8) | header.contentLengthB0;
-        content = malloc(content_len + header.paddingLength);
-        ret = recv(conn->socket, content, content_len + header.paddingLength, 0);
-        if (ret < 0) {
-            res->status = http_get_status(502);
-            sprintf(err_msg, "Unable to communicate with PHP-FPM.");
-            print(ERR_STR "Unable to receive from PHP-FPM: %s" CLR_STR, strerror(errno));
-            free(content);
-            return 1;
-        } else if (ret != (content_len + header.paddingLength)) {
-            res->status = http_get_status(502);
-            sprintf(err_msg, "Unable to communicate with PHP-FPM.");
-            print(ERR_STR "Unable to receive from PHP-FPM" CLR_STR);
-            free(content);
-            return 1;
+
+        while (conn->in.len < sizeof(header)) {
+            if (fastcgi_fill(conn) != 0) return -1;
         }
+        ringbuf_copy(&conn->in, &header, sizeof(header));
+        ringbuf_consume(&conn->in, sizeof(header));
+        req_id = (header.requestIdB1 << 8) | header.requestIdB0;
+        conn->rec_type = header.type;
+        conn->rec_len = (header.contentLengthB1 << 8) | header.contentLengthB0;
+        conn->rec_skip = header.paddingLength;
 
         if (req_id != conn->req_id) {
+            // record of an aborted request on a multiplexed connection
+            conn->rec_skip += conn->rec_len;
+            conn->rec_len = 0;
             continue;
         }
+        conn->reused = 0;
 
-        if (header.type == FCGI_END_REQUEST) {
-            FCGI_EndRequestBody *body = (FCGI_EndRequestBody *) content;
-            int app_status = (body->appStatusB3 << 24) | (body->appStatusB2 << 16) | (body->appStatusB1 << 8) |
-                             body->appStatusB0;
-            if (body->protocolStatus != FCGI_REQUEST_COMPLETE) {
-                print(ERR_STR "FastCGI protocol error: %i" CLR_STR, body->protocolStatus);
-            }
-            if (app_status != 0) {
-                print(ERR_STR "Script terminated with exit code %i" CLR_STR, app_status);
+        *type = conn->rec_type;
+        if (conn->rec_type == FCGI_END_REQUEST) {
+            // small enough to be copied, so it is never returned in two parts
+            while (conn->in.len < conn->rec_len) {
+                if (fastcgi_fill(conn) != 0) return -1;
             }
-            close(conn->socket);
-            conn->socket = 0;
-            free(content);
+            len = conn->rec_len < sizeof(conn->rec_buf) ? conn->rec_len : sizeof(conn->rec_buf);
+            ringbuf_copy(&conn->in, conn->rec_buf, len);
+            ringbuf_consume(&conn->in, len);
+            conn->rec_skip += conn->rec_len - len;
+            conn->rec_len = 0;
+            *ptr = conn->rec_buf;
+            return (long) len;
+        } else if (conn->rec_len == 0) {
+            *ptr = NULL;
+            return 0;
+        }
+    }
+
+    if (conn->in.len == 0 && fastcgi_fill(conn) != 0) return -1;
+    len = ringbuf_data(&conn->in, ptr);
+    if (len > conn->rec_len) len = conn->rec_len;
+    ringbuf_consume(&conn->in, len);
+    conn->rec_len -= len;
+    *type = conn->rec_type;
+    return (long) len;
+}
+
+int fastcgi_end_request(fastcgi_conn *conn) {
+    FCGI_EndRequestBody *body = (FCGI_EndRequestBody *) conn->rec_buf;
+    int app_status = (body->appStatusB3 << 24) | (body->appStatusB2 << 16) | (body->appStatusB1 << 8) |
+                     body->appStatusB0;
+    if (body->protocolStatus != FCGI_REQUEST_COMPLETE) {
+        print(ERR_STR "FastCGI protocol error: %i" CLR_STR, body->protocolStatus);
+    }
+    if (app_status != 0) {
+        print(ERR_STR "Script terminated with exit code %i" CLR_STR, app_status);
+    }
+    if (body->protocolStatus == FCGI_CANT_MPX_CONN && fastcgi_backends != NULL) {
+        fastcgi_backends[conn->backend].mpxs_conns = 0;
+    }
+    if (body->protocolStatus == FCGI_REQUEST_COMPLETE) {
+        upstream_success(conn->backend);
+    }
+    fastcgi_release(conn, body->protocolStatus == FCGI_REQUEST_COMPLETE);
+    return body->protocolStatus == FCGI_REQUEST_COMPLETE ? 0 : 1;
+}
+
+int fastcgi_stderr(fastcgi_conn *conn, const char *content, long content_len, char *err_msg) {
+    if (conn->err_len == 0 && conn->rec_len == 0) {
+        return fastcgi_php_error(content, (int) content_len, err_msg);
+    }
+
+    // messages are only parsed once the whole record has been received
+    if (conn->err_buf == NULL) {
+        conn->err_buf = malloc(0x10000);
+        if (conn->err_buf == NULL) return 0;
+    }
+    memcpy(conn->err_buf + conn->err_len, content, content_len);
+    conn->err_len += content_len;
+    if (conn->rec_len > 0) return 0;
+
+    int ret = fastcgi_php_error(conn->err_buf, (int) conn->err_len, err_msg);
+    conn->err_len = 0;
+    return ret;
+}
+
+int fastcgi_header(fastcgi_conn *conn, http_res *res, char *err_msg) {
+    char buf[CLIENT_MAX_HEADER_SIZE];
+    unsigned long buf_len = 0;
+    char *content, *end = NULL;
+    unsigned char type;
+    long content_len;
+    int ret;
+    int err = 0;
+
+    while (end == NULL) {
+        content_len = fastcgi_read(conn, &type, &content);
+        if (content_len < 0) {
+            res->status = http_get_status(502);
+            sprintf(err_msg, "Unable to communicate with PHP-FPM.");
             return 1;
-        } else if (header.type == FCGI_STDERR) {
-            err = err || fastcgi_php_error(content, content_len, err_msg);
-        } else if (header.type == FCGI_STDOUT) {
-            break;
-        } else {
-            print(ERR_STR "Unknown FastCGI type: %i" CLR_STR, header.type);
         }
 
-        free(content);
+        if (type == FCGI_END_REQUEST) {
+            fastcgi_end_request(conn);
+            return 1;
+        } else if (type == FCGI_STDERR) {
+            err = fastcgi_stderr(conn, content, content_len, err_msg) || err;
+        } else if (type == FCGI_STDOUT) {
+            // the header may be split over several records
+            unsigned long prev_len = buf_len;
+            unsigned long len = content_len;
+            if (len > sizeof(buf) - 1 - buf_len) len = sizeof(buf) - 1 - buf_len;
+            memcpy(buf + buf_len, content, len);
+            buf_len += len;
+            end = memmem(buf + (prev_len > 3 ? prev_len - 3 : 0), buf_len - (prev_len > 3 ? prev_len - 3 : 0),
+                         "\r\n\r\n", 4);
+            if (end != NULL) {
+                // the rest of this slice is the beginning of the body
+                unsigned long header_len = end - buf + 4;
+                conn->out_ptr = content + (header_len - prev_len);
+                conn->out_len = content_len - (header_len - prev_len);
+                buf_len = header_len;
+            } else if (buf_len == sizeof(buf) - 1) {
+                res->status = http_get_status(502);
+                print(ERR_STR "Unable to parse header: End of header not found" CLR_STR);
+                return 1;
+            }
+        } else {
+            print(ERR_STR "Unknown FastCGI type: %i" CLR_STR, type);
+        }
     }
+    upstream_latency(conn->backend, upstream_time_us() - conn->start);
     if (err) {
         res->status = http_get_status(500);
         return 2;
     }
 
-    conn->out_buf = content;
-    conn->out_len = content_len;
-    conn->out_off = (unsigned short) (strstr(content, "\r\n\r\n") - content + 4);
-
-    char *buf = content;
-    unsigned short header_len = conn->out_off;
-    if (header_len <= 0) {
-        print(ERR_STR "Unable to parse header: End of header not found" CLR_STR);
-        return 1;
-    }
-
+    buf[buf_len] = 0;
+    unsigned long header_len = buf_len;
     for (int i = 0; i < header_len; i++) {
         if ((buf[i] >= 0x00 && buf[i] <= 0x1F && buf[i] != '\r' && buf[i] != '\n') || buf[i] == 0x7F) {
             print(ERR_STR "Unable to parse header: Header contains illegal characters" CLR_STR);
@@ -376,79 +823,184 @@ int fastcgi_header(fastcgi_conn *conn, http_res *res, char *err_msg) {
     return 0;
 }
 
-int fastcgi_send(fastcgi_conn *conn, sock *client, int flags) {
-    FCGI_Header header;
-    int ret;
+int fastcgi_idle(fastcgi_conn *conn) {
+    if (conn->in.len > 0) return 0;
+    struct pollfd fds = {.fd = conn->socket, .events = POLLIN};
+    return poll(&fds, 1, 0) == 0;
+}
+
+int fastcgi_send_chunk(sock *client, int flags, char *buf, unsigned long len) {
+    // buf has FASTCGI_OUT_HEADROOM bytes in front and 2 bytes behind reserved for the chunk framing
+    if (len == 0) return 0;
+    if (flags & FASTCGI_CHUNKED) {
+        char chunk_header[FASTCGI_OUT_HEADROOM];
+        int header_len = sprintf(chunk_header, "%lX\r\n", len);
+        buf -= header_len;
+        memcpy(buf, chunk_header, header_len);
+        memcpy(buf + header_len + len, "\r\n", 2);
+        len += header_len + 2;
+    }
+    if (sock_send(client, buf, len, 0) != len) {
+        print(ERR_STR "Unable to send: %s" CLR_STR, sock_strerror(client));
+        return -1;
+    }
+    return 0;
+}
+
+int fastcgi_send_data(sock *client, int flags, compress_ctx *comp, const char *ptr, unsigned long len, int op,
+                      char *out) {
+    char *data = out + FASTCGI_OUT_HEADROOM;
+    long ret;
+    int pending;
+    if (comp->type == COMPRESS_NONE) {
+        if (!(flags & FASTCGI_CHUNKED)) {
+            if (len > 0 && sock_send(client, (void *) ptr, len, 0) != len) {
+                print(ERR_STR "Unable to send: %s" CLR_STR, sock_strerror(client));
+                return -1;
+            }
+            return 0;
+        }
+        while (len > 0) {
+            unsigned long n = len < FASTCGI_OUT_SIZE ? len : FASTCGI_OUT_SIZE;
+            memcpy(data, ptr, n);
+            if (fastcgi_send_chunk(client, flags, data, n) != 0) return -1;
+            ptr += n;
+            len -= n;
+        }
+        return 0;
+    }
+
+    do {
+        ret = compress_stream(comp, &ptr, &len, data, FASTCGI_OUT_SIZE, op, &pending);
+        if (ret < 0) {
+            print(ERR_STR "Unable to compress response (%s)" CLR_STR, compress_encoding(comp->type));
+            return -1;
+        }
+        if (fastcgi_send_chunk(client, flags, data, ret) != 0) return -1;
+    } while (len > 0 || pending);
+    return 0;
+}
+
+int fastcgi_buffer_data(spool *s, compress_ctx *comp, const char *ptr, unsigned long len, int op) {
+    char buf[FASTCGI_OUT_SIZE];
+    long ret;
+    int pending;
+    if (comp->type == COMPRESS_NONE) {
+        if (len > 0 && spool_write(s, ptr, len) < 0) goto err;
+        return 0;
+    }
+
+    do {
+        ret = compress_stream(comp, &ptr, &len, buf, sizeof(buf), op, &pending);
+        if (ret < 0) {
+            print(ERR_STR "Unable to compress response (%s)" CLR_STR, compress_encoding(comp->type));
+            return -1;
+        }
+        if (ret > 0 && spool_write(s, buf, ret) < 0) {
+            err:
+            print(ERR_STR "Unable to buffer response body: %s" CLR_STR, strerror(errno));
+            return -1;
+        }
+    } while (len > 0 || pending);
+    return 0;
+}
+
+int fastcgi_buffer(fastcgi_conn *conn, compress_ctx *comp, resp_cache_writer *cache, spool *s) {
     char buf0[256];
-    int len;
-    char *content, *ptr;
-    unsigned short req_id, content_len;
-    char comp_out[4096];
-    int finish_comp = 0;
-
-    z_stream strm;
-    if (flags & FASTCGI_COMPRESS) {
-        int level = NECRONDA_ZLIB_LEVEL;
-        strm.zalloc = Z_NULL;
-        strm.zfree = Z_NULL;
-        strm.opaque = Z_NULL;
-        if (deflateInit(&strm, level) != Z_OK) {
-            print(ERR_STR "Unable to init deflate: %s" CLR_STR, strerror(errno));
-            flags &= !FASTCGI_COMPRESS;
-        }
-    }
-
-    if (conn->out_buf != NULL && conn->out_len > conn->out_off) {
-        content = conn->out_buf;
-        ptr = content + conn->out_off;
-        content_len = conn->out_len - conn->out_off;
+    char *ptr;
+    unsigned char type;
+    long content_len;
+
+    // the whole (compressed) response is read from PHP-FPM before the header is sent, so that slow clients
+    // do not keep the PHP-FPM worker busy and get a Content-Length
+    if (conn->out_len > 0) {
+        ptr = conn->out_ptr;
+        content_len = (long) conn->out_len;
+        conn->out_len = 0;
         goto out;
     }
 
     while (1) {
-        ret = recv(conn->socket, &header, sizeof(header), 0);
-        if (ret < 0) {
-            print(ERR_STR "Unable to receive from PHP-FPM: %s" CLR_STR, strerror(errno));
-            return -1;
-        } else if (ret != sizeof(header)) {
-            print(ERR_STR "Unable to receive from PHP-FPM" CLR_STR);
+        content_len = fastcgi_read(conn, &type, &ptr);
+        if (content_len < 0) {
             return -1;
         }
-        req_id = (header.requestIdB1 << 8) | header.requestIdB0;
-        content_len = (header.contentLengthB1 << 8) | header.contentLengthB0;
-        content = malloc(content_len + header.paddingLength);
-        ptr = content;
-        ret = recv(conn->socket, content, content_len + header.paddingLength, 0);
+
+        if (type == FCGI_END_REQUEST) {
+            if (fastcgi_end_request(conn) != 0) {
+                resp_cache_store_abort(cache);
+            }
+            if (comp->type != COMPRESS_NONE && fastcgi_buffer_data(s, comp, NULL, 0, COMPRESS_OP_FINISH) != 0) {
+                return -1;
+            }
+            metrics_inc(resp_body_buffered);
+            metrics_add(resp_body_buffered_bytes, spool_len(s));
+            if (s->file_len > 0) {
+                metrics_inc(resp_body_spooled);
+                metrics_add(resp_body_spooled_bytes, s->file_len);
+            }
+            return 0;
+        } else if (type == FCGI_STDERR) {
+            fastcgi_stderr(conn, ptr, content_len, buf0);
+        } else if (type == FCGI_STDOUT) {
+            out:
+            if (cache != NULL && content_len > 0) {
+                resp_cache_store_write(cache, ptr, content_len);
+            }
+            if (fastcgi_buffer_data(s, comp, ptr, content_len, COMPRESS_OP_PROCESS) != 0) {
+                return -1;
+            }
+        } else {
+            print(ERR_STR "Unknown FastCGI type: %i" CLR_STR, type);
+        }
+    }
+}
+
+int fastcgi_send_spool(sock *client, spool *s) {
+    char buf[FASTCGI_OUT_SIZE];
+    long ret;
+    while ((ret = spool_read(s, buf, sizeof(buf))) != 0) {
         if (ret < 0) {
-            print(ERR_STR "Unable to receive from PHP-FPM: %s" CLR_STR, strerror(errno));
-            free(content);
+            print(ERR_STR "Unable to read buffered response body: %s" CLR_STR, strerror(errno));
             return -1;
-        } else if (ret != (content_len + header.paddingLength)) {
-            print(ERR_STR "Unable to receive from PHP-FPM" CLR_STR);
-            free(content);
+        }
+        if (sock_send(client, buf, ret, 0) != ret) {
+            print(ERR_STR "Unable to send: %s" CLR_STR, sock_strerror(client));
             return -1;
         }
+    }
+    return 0;
+}
 
-        if (header.type == FCGI_END_REQUEST) {
-            FCGI_EndRequestBody *body = (FCGI_EndRequestBody *) content;
-            int app_status = (body->appStatusB3 << 24) | (body->appStatusB2 << 16) | (body->appStatusB1 << 8) |
-                             body->appStatusB0;
-            if (body->protocolStatus != FCGI_REQUEST_COMPLETE) {
-                print(ERR_STR "FastCGI protocol error: %i" CLR_STR, body->protocolStatus);
-            }
-            if (app_status != 0) {
-                print(ERR_STR "Script terminated with exit code %i" CLR_STR, app_status);
+int fastcgi_send(fastcgi_conn *conn, sock *client, int flags, compress_ctx *comp, resp_cache_writer *cache) {
+    char buf0[256];
+    char *ptr;
+    unsigned char type;
+    long content_len;
+    char out[FASTCGI_OUT_HEADROOM + FASTCGI_OUT_SIZE + 2];
+
+    if (conn->out_len > 0) {
+        ptr = conn->out_ptr;
+        content_len = (long) conn->out_len;
+        conn->out_len = 0;
+        goto out;
+    }
+
+    while (1) {
+        content_len = fastcgi_read(conn, &type, &ptr);
+        if (content_len < 0) {
+            return -1;
+        }
+
+        if (type == FCGI_END_REQUEST) {
+            if (fastcgi_end_request(conn) != 0) {
+                resp_cache_store_abort(cache);
             }
-            close(conn->socket);
-            conn->socket = 0;
-            free(content);
-
-            if (flags & FASTCGI_COMPRESS) {
-                finish_comp = 1;
-                content_len = 0;
-                goto out;
-                finish:
-                deflateEnd(&strm);
+
+            if (comp->type != COMPRESS_NONE) {
+                if (fastcgi_send_data(client, flags, comp, NULL, 0, COMPRESS_OP_FINISH, out) != 0) {
+                    return -1;
+                }
             }
 
             if (flags & FASTCGI_CHUNKED) {
@@ -456,42 +1008,29 @@ int fastcgi_send(fastcgi_conn *conn, sock *client, int flags) {
             }
 
             return 0;
-        } else if (header.type == FCGI_STDERR) {
-            fastcgi_php_error(content, content_len, buf0);
-        } else if (header.type == FCGI_STDOUT) {
+        } else if (type == FCGI_STDERR) {
+            fastcgi_stderr(conn, ptr, content_len, buf0);
+        } else if (type == FCGI_STDOUT) {
             out:
-            if (flags & FASTCGI_COMPRESS) {
-                strm.avail_in = content_len;
-                strm.next_in = (unsigned char *) ptr;
+            if (cache != NULL && content_len > 0) {
+                resp_cache_store_write(cache, ptr, content_len);
+            }
+            int op = COMPRESS_OP_PROCESS;
+            if ((flags & FASTCGI_FLUSH_RECORD) || ((flags & FASTCGI_FLUSH_IDLE) && fastcgi_idle(conn))) {
+                // do not hold back compressed output while waiting for the backend
+                op = COMPRESS_OP_FLUSH;
+            }
+            if (fastcgi_send_data(client, flags, comp, ptr, content_len, op, out) != 0) {
+                return -1;
             }
-            do {
-                int buf_len = content_len;
-                if (flags & FASTCGI_COMPRESS) {
-                    strm.avail_out = sizeof(comp_out);
-                    strm.next_out = (unsigned char *) comp_out;
-                    deflate(&strm, finish_comp ? Z_FINISH : Z_NO_FLUSH);
-                    strm.avail_in = 0;
-                    ptr = comp_out;
-                    buf_len = (int) (sizeof(comp_out) - strm.avail_out);
-                }
-                if (buf_len != 0) {
-                    len = sprintf(buf0, "%X\r\n", buf_len);
-                    if (flags & FASTCGI_CHUNKED) sock_send(client, buf0, len, 0);
-                    sock_send(client, ptr, buf_len, 0);
-                    if (flags & FASTCGI_CHUNKED) sock_send(client, "\r\n", 2, 0);
-                }
-            } while ((flags & FASTCGI_COMPRESS) && strm.avail_out == 0);
-            if (finish_comp) goto finish;
         } else {
-            print(ERR_STR "Unknown FastCGI type: %i" CLR_STR, header.type);
+            print(ERR_STR "Unknown FastCGI type: %i" CLR_STR, type);
         }
-        free(content);
     }
 }
 
-int fastcgi_receive(fastcgi_conn *conn, sock *client, unsigned long len) {
-    unsigned long rcv_len = 0;
-    char *buf[16384];
+int fastcgi_receive(fastcgi_conn *conn, sock *client, http_body *body) {
+    char buf[16384];
     long ret;
     FCGI_Header header = {
             .version = FCGI_VERSION_1,
@@ -504,27 +1043,60 @@ int fastcgi_receive(fastcgi_conn *conn, sock *client, unsigned long len) {
             .reserved = 0
     };
 
-    if (client->buf != NULL && client->buf_len - client->buf_off > 0) {
-        ret = (int) (client->buf_len - client->buf_off);
-        memcpy(buf, client->buf + client->buf_off, ret);
-        goto send;
-    }
-
-    while (rcv_len < len) {
-        ret = sock_recv(client, buf, sizeof(buf), 0);
-        if (ret <= 0) {
+    while ((ret = http_read_body(client, body, buf, sizeof(buf))) != 0) {
+        if (ret == -1) {
             print(ERR_STR "Unable to receive: %s" CLR_STR, sock_strerror(client));
             return -1;
+        } else if (ret == -2) {
+            print(ERR_STR "Unable to decode chunked request body" CLR_STR);
+            return 2;
+        } else if (ret == -3) {
+            print(ERR_STR "Request body exceeds maximum size of %li bytes" CLR_STR, body->max);
+            return 3;
         }
 
-        send:
-        rcv_len += ret;
         header.contentLengthB1 = (ret >> 8) & 0xFF;
         header.contentLengthB0 = ret & 0xFF;
+        conn->reused = 0;
         if (send(conn->socket, &header, sizeof(header), 0) != sizeof(header)) goto err;
         if (send(conn->socket, buf, ret, 0) != ret) {
             err:
             print(ERR_STR "Unable to send to PHP-FPM: %s" CLR_STR, strerror(errno));
+            upstream_fail(conn->backend);
+            return -2;
+        }
+    }
+    return 0;
+}
+
+int fastcgi_receive_spool(fastcgi_conn *conn, spool *s) {
+    char buf[16384];
+    long ret;
+    FCGI_Header header = {
+            .version = FCGI_VERSION_1,
+            .type = FCGI_STDIN,
+            .requestIdB1 = conn->req_id >> 8,
+            .requestIdB0 = conn->req_id & 0xFF,
+            .contentLengthB1 = 0,
+            .contentLengthB0 = 0,
+            .paddingLength = 0,
+            .reserved = 0
+    };
+
+    while ((ret = spool_read(s, buf, sizeof(buf))) != 0) {
+        if (ret < 0) {
+            print(ERR_STR "Unable to read buffered request body: %s" CLR_STR, strerror(errno));
+            return -2;
+        }
+
+        header.contentLengthB1 = (ret >> 8) & 0xFF;
+        header.contentLengthB0 = ret & 0xFF;
+        conn->reused = 0;
+        if (send(conn->socket, &header, sizeof(header), MSG_MORE) != sizeof(header)) goto err;
+        if (send(conn->socket, buf, ret, 0) != ret) {
+            err:
+            print(ERR_STR "Unable to send to PHP-FPM: %s" CLR_STR, strerror(errno));
+            upstream_fail(conn->backend);
             return -2;
         }
     }
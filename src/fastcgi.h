@@ -9,39 +9,139 @@
 #define NECRONDA_SERVER_FASTCGI_H
 
 #define FASTCGI_CHUNKED 1
-#define FASTCGI_COMPRESS 2
+#define FASTCGI_FLUSH_RECORD 2
+#define FASTCGI_FLUSH_IDLE 4
+
+#define FASTCGI_MAX_IDLE 4
+#define FASTCGI_IDLE_TIMEOUT 4
+#define FASTCGI_PROBE_RETRY 10
+#define FASTCGI_PROBE_RETRY_MAX 600
+#define FASTCGI_RING_SIZE 65536
+#define FASTCGI_OUT_SIZE 16384
+#define FASTCGI_OUT_HEADROOM 8
 
 #include "necronda-server.h"
 #include "http.h"
+#include "resp_cache.h"
+#include "ringbuf.h"
+#include "compress.h"
+#include "spool.h"
 #include "uri.h"
 #include "client.h"
 
 #include <sys/un.h>
-#include <zlib.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <poll.h>
 
 
 typedef struct {
     int socket;
+    int backend;
+    unsigned long start;
     unsigned short req_id;
-    char *out_buf;
-    unsigned short out_len;
-    unsigned short out_off;
+    ringbuf in;
+    unsigned char rec_type;
+    unsigned long rec_len;      // content bytes left in the current record
+    unsigned long rec_skip;     // padding or foreign record bytes to discard
+    char rec_buf[8];
+    char *err_buf;
+    unsigned long err_len;
+    char *out_ptr;
+    unsigned long out_len;
+    unsigned char stdin_closed:1;
+    unsigned char reused:1;     // pooled connection, nothing of this request received or sent as stdin yet
 } fastcgi_conn;
 
+typedef struct {
+    char *buf;
+    unsigned long len;
+    unsigned long size;
+} fastcgi_params;
+
+typedef struct {
+    int socket;
+    int backend;
+    unsigned char aborted:1;
+    time_t idle_since;
+} fastcgi_pool_conn;
+
+typedef struct {
+    unsigned char probed:1;
+    unsigned char mpxs_conns:1;
+    unsigned char probe_fails;
+    time_t probe_next;
+    unsigned int max_conns;
+    unsigned int max_reqs;
+} fastcgi_backend_state;
+
+fastcgi_pool_conn fastcgi_pool[FASTCGI_MAX_IDLE];
+fastcgi_backend_state *fastcgi_backends;
+
+int fastcgi_state_init();
+
+int fastcgi_state_unload();
+
+int fastcgi_connect(int backend);
+
+int fastcgi_probe(int backend);
+
+time_t fastcgi_pool_time();
+
+int fastcgi_pool_get(int backend);
+
+void fastcgi_pool_put(int backend, int socket, int aborted);
+
+int fastcgi_pool_idle();
+
+void fastcgi_pool_close();
+
+void fastcgi_release(fastcgi_conn *conn, int reuse);
+
+void fastcgi_abort(fastcgi_conn *conn);
+
 char *fastcgi_add_param(char *buf, const char *key, const char *value);
 
-int fastcgi_init(fastcgi_conn *conn, unsigned int client_num, unsigned int req_num, const sock *client,
-                 const http_req *req, const http_uri *uri);
+int fastcgi_param(fastcgi_params *params, const char *key, const char *value);
+
+int fastcgi_writev(int fd, struct iovec *iov, int iov_num);
+
+char *fastcgi_get_param_len(const char *buf, unsigned long *len);
+
+int fastcgi_init(fastcgi_conn *conn, const host_config *conf, unsigned int client_num, unsigned int req_num,
+                 const sock *client, const http_req *req, const http_uri *uri, int fresh);
 
 int fastcgi_close_stdin(fastcgi_conn *conn);
 
 int fastcgi_php_error(const char *msg, int msg_len, char *err_msg);
 
+long fastcgi_read(fastcgi_conn *conn, unsigned char *type, char **ptr);
+
+int fastcgi_end_request(fastcgi_conn *conn);
+
+int fastcgi_stderr(fastcgi_conn *conn, const char *content, long content_len, char *err_msg);
+
 int fastcgi_header(fastcgi_conn *conn, http_res *res, char *err_msg);
 
-int fastcgi_send(fastcgi_conn *conn, sock *client, int flags);
+int fastcgi_idle(fastcgi_conn *conn);
+
+int fastcgi_send_chunk(sock *client, int flags, char *buf, unsigned long len);
+
+int fastcgi_send_data(sock *client, int flags, compress_ctx *comp, const char *ptr, unsigned long len, int op,
+                      char *out);
+
+int fastcgi_buffer_data(spool *s, compress_ctx *comp, const char *ptr, unsigned long len, int op);
+
+int fastcgi_buffer(fastcgi_conn *conn, compress_ctx *comp, resp_cache_writer *cache, spool *s);
+
+int fastcgi_send_spool(sock *client, spool *s);
+
+int fastcgi_send(fastcgi_conn *conn, sock *client, int flags, compress_ctx *comp, resp_cache_writer *cache);
+
+int fastcgi_receive(fastcgi_conn *conn, sock *client, http_body *body);
 
-int fastcgi_receive(fastcgi_conn *conn, sock *client, unsigned long len);
+int fastcgi_receive_spool(fastcgi_conn *conn, spool *s);
 
 
 /*
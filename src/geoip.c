@@ -0,0 +1,208 @@
+/**
+ * Necronda Web Server
+ * Cached GeoIP lookups
+ * src/geoip.c
+ * Lorenz Stechauner, 2021-03-21
+ */
+
+#include "geoip.h"
+
+
+void geoip_lock() {
+    shm_mutex_lock(&geoip_cache->lock);
+}
+
+void geoip_unlock() {
+    shm_mutex_unlock(&geoip_cache->lock);
+}
+
+void geoip_mask(struct in6_addr *addr, unsigned char prefix) {
+    for (int i = 0; i < 16; i++) {
+        if (prefix >= 8) {
+            prefix -= 8;
+        } else {
+            addr->s6_addr[i] &= (unsigned char) (0xFF00 >> prefix);
+            prefix = 0;
+        }
+    }
+}
+
+int geoip_match(const struct in6_addr *addr, const geoip_entry *e) {
+    struct in6_addr masked = *addr;
+    geoip_mask(&masked, e->prefix);
+    return memcmp(&masked, &e->network, sizeof(masked)) == 0;
+}
+
+void geoip_store(const struct in6_addr *addr, unsigned char prefix, const char *json, unsigned long json_len,
+                 const char *cc) {
+    geoip_entry *slot = NULL;
+    if (geoip_cache == NULL || json_len >= GEOIP_CACHE_JSON_SIZE) return;
+    struct in6_addr network = *addr;
+    geoip_mask(&network, prefix);
+    geoip_lock();
+    // the least recently used entry is replaced
+    for (int i = 0; i < GEOIP_CACHE_SIZE; i++) {
+        geoip_entry *e = &geoip_cache->entries[i];
+        if (e->last_used != 0 && e->prefix == prefix && memcmp(&e->network, &network, sizeof(network)) == 0) {
+            slot = e;
+            break;
+        } else if (slot == NULL || (slot->last_used != 0 && (e->last_used == 0 || e->last_used < slot->last_used))) {
+            slot = e;
+        }
+    }
+    slot->network = network;
+    slot->prefix = prefix;
+    strcpy(slot->cc, cc);
+    slot->json_len = (unsigned short) json_len;
+    memcpy(slot->json, json, json_len);
+    slot->json[json_len] = 0;
+    slot->last_used = time(NULL);
+    geoip_unlock();
+}
+
+int geoip_cache_lookup(const struct in6_addr *addr, char **json, char *cc) {
+    int found = 0;
+    if (geoip_cache == NULL) return 0;
+    geoip_lock();
+    for (int i = 0; i < GEOIP_CACHE_SIZE; i++) {
+        geoip_entry *e = &geoip_cache->entries[i];
+        if (e->last_used == 0 || !geoip_match(addr, e)) continue;
+        e->last_used = time(NULL);
+        strcpy(cc, e->cc);
+        if (e->json_len != 0) {
+            *json = malloc(e->json_len + 1);
+            if (*json != NULL) memcpy(*json, e->json, e->json_len + 1);
+        }
+        found = 1;
+        break;
+    }
+    geoip_unlock();
+    return found;
+}
+
+int geoip_lookup(const char *addr_str, char **json, char *cc) {
+    struct in6_addr addr;
+    *json = NULL;
+    cc[0] = 0;
+    if (mmdbs[0].filename == NULL) return 0;
+
+    // IPv4 addresses are kept as ::ffff:a.b.c.d, so the prefix is counted in IPv6 bits
+    int ipv4 = strchr(addr_str, ':') == NULL;
+    if (dns_parse_addr(addr_str, &addr) != 0) return -1;
+    if (geoip_cache_lookup(&addr, json, cc)) {
+        metrics_inc(geoip_cache_hits);
+        return 0;
+    }
+    metrics_inc(geoip_cache_misses);
+
+    char *str = malloc(GEOIP_MAX_SIZE);
+    if (str == NULL) return -1;
+    long str_off = 0;
+    // the answer only holds for the most specific network any of the databases returned
+    int prefix = -1, cacheable = 1;
+    for (int i = 0; i < MAX_MMDB && mmdbs[i].filename != NULL; i++) {
+        int gai_error, mmdb_res;
+        MMDB_lookup_result_s result = MMDB_lookup_string(&mmdbs[i], addr_str, &gai_error, &mmdb_res);
+        if (mmdb_res != MMDB_SUCCESS) {
+            print(ERR_STR "Unable to lookup geoip info: %s" CLR_STR "\n", MMDB_strerror(mmdb_res));
+            cacheable = 0;
+            continue;
+        } else if (gai_error != 0) {
+            print(ERR_STR "Unable to lookup geoip info" CLR_STR "\n");
+            cacheable = 0;
+            continue;
+        }
+
+        int netmask = result.netmask;
+        if (ipv4) {
+            // IPv6 databases report the netmask of IPv4 addresses relative to ::/96
+            netmask = 96 + (netmask > 32 ? netmask - 96 : netmask);
+        }
+        if (netmask > prefix) prefix = netmask;
+        if (!result.found_entry) {
+            continue;
+        }
+
+        MMDB_entry_data_list_s *list;
+        mmdb_res = MMDB_get_entry_data_list(&result.entry, &list);
+        if (mmdb_res != MMDB_SUCCESS) {
+            print(ERR_STR "Unable to lookup geoip info: %s" CLR_STR "\n", MMDB_strerror(mmdb_res));
+            cacheable = 0;
+            continue;
+        }
+
+        long prev = str_off;
+        if (str_off != 0) {
+            str_off--;
+        }
+        mmdb_json(list, str, &str_off, GEOIP_MAX_SIZE);
+        if (prev != 0) {
+            str[prev - 1] = ',';
+        }
+
+        MMDB_free_entry_data_list(list);
+    }
+
+    if (str_off != 0) {
+        char *pos = strstr(str, "\"country\":");
+        if (pos != NULL) pos = strstr(pos, "\"iso_code\":");
+        if (pos != NULL) {
+            pos += 12;
+            strncpy(cc, pos, 2);
+            cc[2] = 0;
+        }
+    }
+
+    if (cacheable && prefix >= 0) {
+        geoip_store(&addr, (unsigned char) (prefix > 128 ? 128 : prefix), str, str_off, cc);
+    }
+
+    if (str_off == 0) {
+        free(str);
+    } else {
+        *json = str;
+    }
+    return 0;
+}
+
+int geoip_init() {
+    if (mmdbs[0].filename == NULL) return 0;
+
+    int shm_id = shmget(SHM_KEY_GEOIP, sizeof(geoip_table), IPC_CREAT | IPC_EXCL | 0600);
+    if (shm_id < 0) {
+        fprintf(stderr, ERR_STR "Unable to create shared memory: %s" CLR_STR "\n", strerror(errno));
+        return -1;
+    }
+
+    void *shm_rw = shmat(shm_id, NULL, 0);
+    if (shm_rw == (void *) -1) {
+        fprintf(stderr, ERR_STR "Unable to attach shared memory (rw): %s" CLR_STR "\n", strerror(errno));
+        shmctl(shm_id, IPC_RMID, NULL);
+        return -2;
+    }
+    geoip_cache = shm_rw;
+    memset(geoip_cache, 0, sizeof(geoip_table));
+    if ((errno = shm_mutex_init(&geoip_cache->lock)) != 0) {
+        fprintf(stderr, ERR_STR "Unable to initialize lock: %s" CLR_STR "\n", strerror(errno));
+        geoip_unload();
+        return -3;
+    }
+    return 0;
+}
+
+int geoip_unload() {
+    if (geoip_cache == NULL) return 0;
+    int shm_id = shmget(SHM_KEY_GEOIP, 0, 0);
+    if (shm_id < 0) {
+        fprintf(stderr, ERR_STR "Unable to get shared memory id: %s" CLR_STR "\n", strerror(errno));
+        shmdt(geoip_cache);
+        return -1;
+    } else if (shmctl(shm_id, IPC_RMID, NULL) < 0) {
+        fprintf(stderr, ERR_STR "Unable to configure shared memory: %s" CLR_STR "\n", strerror(errno));
+        shmdt(geoip_cache);
+        return -1;
+    }
+    shmdt(geoip_cache);
+    geoip_cache = NULL;
+    return 0;
+}
@@ -0,0 +1,49 @@
+/**
+ * Necronda Web Server
+ * Cached GeoIP lookups (header file)
+ * src/geoip.h
+ * Lorenz Stechauner, 2021-03-21
+ */
+
+#ifndef NECRONDA_SERVER_GEOIP_H
+#define NECRONDA_SERVER_GEOIP_H
+
+#define GEOIP_CACHE_SIZE 512
+#define GEOIP_CACHE_JSON_SIZE 4096
+
+#include "necronda-server.h"
+#include "utils.h"
+#include "metrics.h"
+#include "dns.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+
+typedef struct {
+    // all addresses in network/prefix share the same answer of every database
+    struct in6_addr network;
+    unsigned char prefix;
+    char cc[3];
+    unsigned short json_len;    // 0 if there is no geoip info for the network
+    char json[GEOIP_CACHE_JSON_SIZE];
+    time_t last_used;
+} geoip_entry;
+
+typedef struct {
+    pthread_mutex_t lock;
+    geoip_entry entries[GEOIP_CACHE_SIZE];
+} geoip_table;
+
+geoip_table *geoip_cache = NULL;
+
+
+int geoip_init();
+
+int geoip_unload();
+
+int geoip_lookup(const char *addr_str, char **json, char *cc);
+
+#endif //NECRONDA_SERVER_GEOIP_H
@@ -0,0 +1,142 @@
+/**
+ * Necronda Web Server
+ * Active health checks of proxied servers
+ * src/health.c
+ * Lorenz Stechauner, 2021-03-07
+ */
+
+#include "health.h"
+
+
+int health_probe(int server) {
+    upstream_server *srv = &upstream_servers[server];
+    struct timeval timeout = {.tv_sec = UPSTREAM_CHECK_TIMEOUT, .tv_usec = 0};
+    struct in6_addr addrs[DNS_MAX_ADDR];
+    char buf[1024];
+    sock s = {.enc = 0, .socket = 0, .ctx = rev_proxy.ctx, .ssl = NULL};
+    int ok = 0;
+    long ret, len = 0;
+
+    int addr_num = dns_resolve(srv->host, addrs, DNS_MAX_ADDR);
+    struct sockaddr_in6 address = {.sin6_family = AF_INET6, .sin6_port = htons(srv->port)};
+    for (int i = 0; i < addr_num && s.socket == 0; i++) {
+        address.sin6_addr = addrs[i];
+        s.socket = socket(AF_INET6, SOCK_STREAM, 0);
+        if (s.socket < 0) {
+            s.socket = 0;
+            return 0;
+        }
+        // connect() is bounded by the send timeout
+        if (setsockopt(s.socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0 ||
+            setsockopt(s.socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0 ||
+            connect(s.socket, (struct sockaddr *) &address, sizeof(address)) != 0) {
+            close(s.socket);
+            s.socket = 0;
+        }
+    }
+    if (s.socket == 0) return 0;
+
+    if (srv->check_enc) {
+        s.ssl = SSL_new(s.ctx);
+        SSL_set_fd(s.ssl, s.socket);
+        SSL_set_connect_state(s.ssl);
+        upstream_tls_prepare(server, s.ssl);
+        s.enc = 1;
+        if (SSL_do_handshake(s.ssl) <= 0) goto end;
+    }
+
+    len = snprintf(buf, sizeof(buf), "GET %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: " SERVER_STR " (health check)\r\n"
+                                     "Connection: close\r\n\r\n", srv->check_path, srv->check_host);
+    if (len >= sizeof(buf) || sock_send(&s, buf, len, 0) != len) goto end;
+
+    // only the status line is of interest
+    len = 0;
+    while (len < 12) {
+        ret = sock_recv(&s, buf + len, sizeof(buf) - 1 - len, 0);
+        if (ret <= 0) goto end;
+        len += ret;
+    }
+    if (strncmp(buf, "HTTP/1.", 7) == 0 && buf[8] == ' ') {
+        int status = (int) strtol(buf + 9, NULL, 10);
+        ok = status >= 200 && status < 400;
+    }
+
+    end:
+    sock_close(&s);
+    return ok;
+}
+
+void health_process_term() {
+    health_continue = 0;
+}
+
+int health_process() {
+    time_t next[UPSTREAM_MAX_SERVERS];
+    unsigned char rise[UPSTREAM_MAX_SERVERS], fall[UPSTREAM_MAX_SERVERS];
+    memset(next, 0, sizeof(next));
+    memset(rise, 0, sizeof(rise));
+    memset(fall, 0, sizeof(fall));
+
+    signal(SIGINT, health_process_term);
+    signal(SIGTERM, health_process_term);
+
+    while (health_continue) {
+        for (int i = 0; i < upstream_server_num && health_continue; i++) {
+            upstream_server *srv = &upstream_servers[i];
+            upstream_state *state = &upstreams->servers[i];
+            if (srv->check_interval == 0 || next[i] > upstream_time()) continue;
+            next[i] = upstream_time() + srv->check_interval;
+
+            if (health_probe(i)) {
+                fall[i] = 0;
+                if (state->down && ++rise[i] >= UPSTREAM_CHECK_RISE) {
+                    // the server starts over with a closed circuit
+                    state->fails = 0;
+                    state->circuit = UPSTREAM_CIRCUIT_CLOSED;
+                    state->down = 0;
+                    fprintf(stderr, "Upstream server %s is up\n", srv->name);
+                }
+            } else {
+                rise[i] = 0;
+                if (!state->down && ++fall[i] >= UPSTREAM_CHECK_FALL) {
+                    state->down = 1;
+                    fprintf(stderr, ERR_STR "Upstream server %s is down" CLR_STR "\n", srv->name);
+                }
+            }
+        }
+        sleep(1);
+    }
+    return 0;
+}
+
+int health_init() {
+    int checks = 0;
+    for (int i = 0; i < upstream_server_num; i++) {
+        if (upstream_servers[i].check_interval != 0) checks++;
+    }
+    if (checks == 0) return 0;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // child
+        if (health_process() == 0) {
+            return 1;
+        } else {
+            return -4;
+        }
+    } else if (pid > 0) {
+        // parent
+        fprintf(stderr, "Started child process with PID %i as health-checker\n", pid);
+        for (int i = 0; i < MAX_CHILDREN; i++) {
+            if (children[i] == 0) {
+                children[i] = pid;
+                break;
+            }
+        }
+    } else {
+        fprintf(stderr, ERR_STR "Unable to create child process: %s" CLR_STR "\n", strerror(errno));
+        return -3;
+    }
+
+    return 0;
+}
@@ -0,0 +1,26 @@
+/**
+ * Necronda Web Server
+ * Active health checks of proxied servers (header file)
+ * src/health.h
+ * Lorenz Stechauner, 2021-03-07
+ */
+
+#ifndef NECRONDA_SERVER_HEALTH_H
+#define NECRONDA_SERVER_HEALTH_H
+
+#include "necronda-server.h"
+#include "upstream.h"
+#include "dns.h"
+#include "sock.h"
+
+#include <time.h>
+
+
+int health_continue = 1;
+
+
+int health_init();
+
+int health_probe(int server);
+
+#endif //NECRONDA_SERVER_HEALTH_H
@@ -43,6 +43,10 @@ void http_free_res(http_res *res) {
 int http_parse_header_field(http_hdr *hdr, const char *buf, const char *end_ptr) {
     char *pos1 = memchr(buf, ':', end_ptr - buf);
     char *pos2;
+    if (hdr->field_num >= HTTP_MAX_HEADER_FIELDS - HTTP_RESERVED_HEADER_FIELDS) {
+        print(ERR_STR "Unable to parse header: Too many header fields" CLR_STR);
+        return 3;
+    }
     if (pos1 == NULL) {
         print(ERR_STR "Unable to parse header" CLR_STR);
         return 3;
@@ -70,93 +74,109 @@ int http_parse_header_field(http_hdr *hdr, const char *buf, const char *end_ptr)
     return 0;
 }
 
+long http_receive_header(sock *s, char *buf, unsigned long size) {
+    // every received byte is only looked at once, bytes after the header are kept in s->buf
+    unsigned long len = 0, off = 0, header_len;
+    long ret;
+    char *end;
+
+    while (1) {
+        if (len == size) return -2;
+        ret = sock_recv(s, buf + len, size - len, 0);
+        if (ret <= 0) return -1;
+        len += ret;
+        // the end of the header may be split between two reads
+        end = memmem(buf + off, len - off, "\r\n\r\n", 4);
+        if (end != NULL) break;
+        off = len > 3 ? len - 3 : 0;
+    }
+
+    header_len = end - buf + 4;
+    for (int i = 0; i < header_len; i++) {
+        if ((buf[i] >= 0x00 && buf[i] <= 0x1F && buf[i] != '\r' && buf[i] != '\n') || buf[i] == 0x7F) {
+            return -3;
+        }
+    }
+
+    if (len > header_len) {
+        s->buf = malloc(len - header_len);
+        if (s->buf == NULL) return -1;
+        memcpy(s->buf, buf + header_len, len - header_len);
+        s->buf_len = len - header_len;
+        s->buf_off = 0;
+    }
+    return (long) header_len;
+}
+
 int http_receive_request(sock *client, http_req *req) {
-    long rcv_len, len;
+    long header_len, len;
     char *ptr, *pos0, *pos1, *pos2;
     char buf[CLIENT_MAX_HEADER_SIZE];
-    memset(buf, 0, sizeof(buf));
     memset(req->method, 0, sizeof(req->method));
     memset(req->version, 0, sizeof(req->version));
     req->uri = NULL;
     req->hdr.field_num = 0;
 
-    while (1) {
-        rcv_len  = sock_recv(client, buf, CLIENT_MAX_HEADER_SIZE, 0);
-        if (rcv_len <= 0) {
-            print("Unable to receive: %s", sock_strerror(client));
-            return -1;
-        }
+    header_len = http_receive_header(client, buf, sizeof(buf));
+    if (header_len == -1) {
+        print("Unable to receive: %s", sock_strerror(client));
+        return -1;
+    } else if (header_len == -2) {
+        print(ERR_STR "Unable to parse header: End of header not found" CLR_STR);
+        return 5;
+    } else if (header_len == -3) {
+        print(ERR_STR "Unable to parse header: Header contains illegal characters" CLR_STR);
+        return 4;
+    }
 
-        unsigned long header_len = strstr(buf, "\r\n\r\n") - buf + 4;
-        if (header_len <= 0) {
-            print(ERR_STR "Unable to parse header: End of header not found" CLR_STR);
-            return 5;
+    ptr = buf;
+    while (header_len > (ptr - buf + 2)) {
+        pos0 = memmem(ptr, header_len - (ptr - buf), "\r\n", 2);
+        if (pos0 == NULL) {
+            print(ERR_STR "Unable to parse header: Invalid header format" CLR_STR);
+            return 1;
         }
 
-        for (int i = 0; i < header_len; i++) {
-            if ((buf[i] >= 0x00 && buf[i] <= 0x1F && buf[i] != '\r' && buf[i] != '\n') || buf[i] == 0x7F) {
-                print(ERR_STR "Unable to parse header: Header contains illegal characters" CLR_STR);
-                return 4;
-            }
-        }
+        if (req->version[0] == 0) {
+            pos1 = memchr(ptr, ' ', pos0 - ptr);
+            if (pos1 == NULL) goto err_hdr_fmt;
+            pos1++;
 
-        ptr = buf;
-        while (header_len > (ptr - buf + 2)) {
-            pos0 = strstr(ptr, "\r\n");
-            if (pos0 == NULL) {
-                print(ERR_STR "Unable to parse header: Invalid header format" CLR_STR);
-                return 1;
+            if (pos1 - ptr - 1 >= sizeof(req->method)) {
+                print(ERR_STR "Unable to parse header: Method name too long" CLR_STR);
+                return 2;
             }
 
-            if (req->version[0] == 0) {
-                pos1 = memchr(ptr, ' ', rcv_len - (ptr - buf)) + 1;
-                if (pos1 == NULL) goto err_hdr_fmt;
-
-                if (pos1 - ptr - 1 >= sizeof(req->method)) {
-                    print(ERR_STR "Unable to parse header: Method name too long" CLR_STR);
+            for (int i = 0; i < (pos1 - ptr - 1); i++) {
+                if (ptr[i] < 'A' || ptr[i] > 'Z') {
+                    print(ERR_STR "Unable to parse header: Invalid method" CLR_STR);
                     return 2;
                 }
+            }
+            strncpy(req->method, ptr, pos1 - ptr - 1);
 
-                for (int i = 0; i < (pos1 - ptr - 1); i++) {
-                    if (ptr[i] < 'A' || ptr[i] > 'Z') {
-                        print(ERR_STR "Unable to parse header: Invalid method" CLR_STR);
-                        return 2;
-                    }
-                }
-                strncpy(req->method, ptr, pos1 - ptr - 1);
-
-                pos2 = memchr(pos1, ' ', rcv_len - (pos1 - buf)) + 1;
-                if (pos2 == NULL) {
-                    err_hdr_fmt:
-                    print(ERR_STR "Unable to parse header: Invalid header format" CLR_STR);
-                    return 1;
-                }
-
-                if (memcmp(pos2, "HTTP/", 5) != 0 || memcmp(pos2 + 8, "\r\n", 2) != 0) {
-                    print(ERR_STR "Unable to parse header: Invalid version" CLR_STR);
-                    return 3;
-                }
+            pos2 = memchr(pos1, ' ', pos0 - pos1);
+            if (pos2 == NULL) {
+                err_hdr_fmt:
+                print(ERR_STR "Unable to parse header: Invalid header format" CLR_STR);
+                return 1;
+            }
+            pos2++;
 
-                len = pos2 - pos1 - 1;
-                req->uri = malloc(len + 1);
-                sprintf(req->uri, "%.*s", (int) len, pos1);
-                sprintf(req->version, "%.3s", pos2 + 5);
-            } else {
-                int ret = http_parse_header_field(&req->hdr, ptr, pos0);
-                if (ret != 0) return ret;
+            if (pos0 - pos2 != 8 || memcmp(pos2, "HTTP/", 5) != 0) {
+                print(ERR_STR "Unable to parse header: Invalid version" CLR_STR);
+                return 3;
             }
-            ptr = pos0 + 2;
-        }
-        if (pos0[2] == '\r' && pos0[3] == '\n') {
-            break;
-        }
-    }
 
-    client->buf_len = rcv_len - (pos0 - buf + 4);
-    if (client->buf_len > 0) {
-        client->buf = malloc(client->buf_len);
-        client->buf_off = 0;
-        memcpy(client->buf, pos0 + 4, client->buf_len);
+            len = pos2 - pos1 - 1;
+            req->uri = malloc(len + 1);
+            sprintf(req->uri, "%.*s", (int) len, pos1);
+            sprintf(req->version, "%.3s", pos2 + 5);
+        } else {
+            int ret = http_parse_header_field(&req->hdr, ptr, pos0);
+            if (ret != 0) return ret;
+        }
+        ptr = pos0 + 2;
     }
 
     return 0;
@@ -177,6 +197,10 @@ char *http_get_header_field(const http_hdr *hdr, const char *field_name) {
 }
 
 void http_add_header_field(http_hdr *hdr, const char *field_name, const char *field_value) {
+    if (hdr->field_num >= HTTP_MAX_HEADER_FIELDS) {
+        print(ERR_STR "Unable to add header field: Too many header fields" CLR_STR);
+        return;
+    }
     size_t len_name = strlen(field_name);
     size_t len_value = strlen(field_value);
     char *_field_name = malloc(len_name + 1);
@@ -217,33 +241,212 @@ void http_remove_header_field(http_hdr *hdr, const char *field_name, int mode) {
     }
 }
 
+unsigned long http_get_header_size(const http_hdr *hdr) {
+    unsigned long size = 2;
+    for (int i = 0; i < hdr->field_num; i++) {
+        size += strlen(hdr->fields[i][0]) + strlen(hdr->fields[i][1]) + 4;
+    }
+    return size;
+}
+
 int http_send_response(sock *client, http_res *res) {
-    char buf[CLIENT_MAX_HEADER_SIZE];
+    char buf0[CLIENT_MAX_HEADER_SIZE], *buf = buf0;
+    // headers of proxied servers may be larger than the buffer
+    unsigned long size = http_get_header_size(&res->hdr) + 64;
+    if (size > sizeof(buf0) && (buf = malloc(size)) == NULL) {
+        return -1;
+    }
     long off = sprintf(buf, "HTTP/%s %03i %s\r\n", res->version, res->status->code, res->status->msg);
     for (int i = 0; i < res->hdr.field_num; i++) {
         off += sprintf(buf + off, "%s: %s\r\n", res->hdr.fields[i][0], res->hdr.fields[i][1]);
     }
     off += sprintf(buf + off, "\r\n");
-    if (sock_send(client, buf, off, 0) < 0) {
+    long ret = sock_send(client, buf, off, 0);
+    if (buf != buf0) free(buf);
+    if (ret < 0) {
         return -1;
     }
     return 0;
 }
 
 int http_send_request(sock *server, http_req *req) {
-    char buf[CLIENT_MAX_HEADER_SIZE];
+    char buf0[CLIENT_MAX_HEADER_SIZE], *buf = buf0;
+    unsigned long size = http_get_header_size(&req->hdr) + strlen(req->uri) + 32;
+    if (size > sizeof(buf0) && (buf = malloc(size)) == NULL) {
+        return -1;
+    }
     long off = sprintf(buf, "%s %s HTTP/%s\r\n", req->method, req->uri, req->version);
     for (int i = 0; i < req->hdr.field_num; i++) {
         off += sprintf(buf + off, "%s: %s\r\n", req->hdr.fields[i][0], req->hdr.fields[i][1]);
     }
     off += sprintf(buf + off, "\r\n");
     long ret = sock_send(server, buf, off, 0);
+    if (buf != buf0) free(buf);
     if (ret <= 0) {
         return -1;
     }
     return 0;
 }
 
+int http_transfer_chunked(const char *transfer_encoding) {
+    // chunked has to be the final (and only once applied) coding of the list (RFC 9112, section 6.1)
+    int chunked = 0;
+    const char *ptr = transfer_encoding;
+    while (ptr[0] != 0) {
+        while (ptr[0] == ' ' || ptr[0] == '\t' || ptr[0] == ',') ptr++;
+        if (ptr[0] == 0) break;
+        unsigned long len = strcspn(ptr, " \t;,");
+        if (chunked) return 0;
+        chunked = len == 7 && strncasecmp(ptr, "chunked", 7) == 0;
+        ptr += strcspn(ptr, ",");
+    }
+    return chunked;
+}
+
+int http_init_body(http_body *body, http_req *req, unsigned long max_len) {
+    body->chunked = 0;
+    body->done = 0;
+    body->state = HTTP_CHUNK_SIZE;
+    body->size_digits = 0;
+    body->len = 0;
+    body->total = 0;
+    body->max = max_len;
+
+    char *transfer_encoding = http_get_header_field(&req->hdr, "Transfer-Encoding");
+    char *content_length = http_get_header_field(&req->hdr, "Content-Length");
+    if (transfer_encoding != NULL) {
+        if (!http_transfer_chunked(transfer_encoding)) {
+            return 1;
+        }
+        body->chunked = 1;
+        // must not be passed on next to Transfer-Encoding (request smuggling)
+        http_remove_header_field(&req->hdr, "Content-Length", HTTP_REMOVE_ALL);
+    } else if (content_length != NULL) {
+        char *end_ptr;
+        body->len = strtoul(content_length, &end_ptr, 10);
+        if (end_ptr == content_length || end_ptr[0] != 0) {
+            return 1;
+        } else if (max_len != 0 && body->len > max_len) {
+            return 2;
+        }
+        body->done = body->len == 0;
+    } else {
+        body->done = 1;
+    }
+    return 0;
+}
+
+long http_chunk_decode(http_body *body, char *buf, long len) {
+    long out_len = 0;
+    for (long i = 0; i < len && !body->done; i++) {
+        char ch = buf[i];
+        switch (body->state) {
+            case HTTP_CHUNK_SIZE:
+                if (ch == '\r' && body->size_digits > 0) {
+                    body->state = HTTP_CHUNK_SIZE_LF;
+                    break;
+                } else if ((ch == ';' || ch == ' ' || ch == '\t') && body->size_digits > 0) {
+                    body->state = HTTP_CHUNK_EXT;
+                    break;
+                } else if (body->size_digits >= 15) {
+                    return -1;
+                }
+                if (ch >= '0' && ch <= '9') {
+                    body->len = (body->len << 4) | (ch - '0');
+                } else if ((ch >= 'A' && ch <= 'F') || (ch >= 'a' && ch <= 'f')) {
+                    body->len = (body->len << 4) | ((ch & 0x5F) - 'A' + 10);
+                } else {
+                    return -1;
+                }
+                body->size_digits++;
+                break;
+            case HTTP_CHUNK_EXT:
+                // chunk extensions are ignored
+                if (ch == '\r') body->state = HTTP_CHUNK_SIZE_LF;
+                break;
+            case HTTP_CHUNK_SIZE_LF:
+                if (ch != '\n') return -1;
+                if (body->max != 0 && body->total + out_len + body->len > body->max) return -2;
+                body->size_digits = 0;
+                body->state = body->len == 0 ? HTTP_CHUNK_TRAILER : HTTP_CHUNK_DATA;
+                break;
+            case HTTP_CHUNK_DATA: {
+                unsigned long n = len - i;
+                if (n > body->len) n = body->len;
+                memmove(buf + out_len, buf + i, n);
+                out_len += (long) n;
+                i += (long) n - 1;
+                body->len -= n;
+                if (body->len == 0) body->state = HTTP_CHUNK_DATA_CR;
+                break;
+            }
+            case HTTP_CHUNK_DATA_CR:
+                if (ch != '\r') return -1;
+                body->state = HTTP_CHUNK_DATA_LF;
+                break;
+            case HTTP_CHUNK_DATA_LF:
+                if (ch != '\n') return -1;
+                body->state = HTTP_CHUNK_SIZE;
+                break;
+            case HTTP_CHUNK_TRAILER:
+                // trailer fields are ignored
+                body->state = ch == '\r' ? HTTP_CHUNK_TRAILER_LF : HTTP_CHUNK_TRAILER_LINE;
+                break;
+            case HTTP_CHUNK_TRAILER_LINE:
+                if (ch == '\n') body->state = HTTP_CHUNK_TRAILER;
+                break;
+            case HTTP_CHUNK_TRAILER_LF:
+                if (ch != '\n') return -1;
+                body->done = 1;
+                break;
+        }
+    }
+    return out_len;
+}
+
+long http_read_body(sock *client, http_body *body, char *buf, unsigned long len) {
+    long ret;
+    do {
+        if (body->done) return 0;
+        unsigned long max_len = len;
+        if (!body->chunked && body->len < max_len) max_len = body->len;
+        if (client->buf != NULL && client->buf_off < client->buf_len) {
+            ret = (long) (client->buf_len - client->buf_off);
+            if (ret > max_len) ret = (long) max_len;
+            memcpy(buf, client->buf + client->buf_off, ret);
+            client->buf_off += ret;
+        } else {
+            ret = sock_recv(client, buf, max_len, 0);
+            if (ret <= 0) return -1;
+        }
+        if (body->chunked) {
+            ret = http_chunk_decode(body, buf, ret);
+            if (ret == -1) {
+                return -2;
+            } else if (ret < 0) {
+                return -3;
+            }
+        } else {
+            body->len -= ret;
+            body->done = body->len == 0;
+        }
+    } while (ret == 0);
+    body->total += ret;
+    if (body->max != 0 && body->total > body->max) return -3;
+    return ret;
+}
+
+long http_buffer_body(sock *client, http_body *body, spool *s) {
+    char buf[CHUNK_SIZE];
+    long ret;
+    while ((ret = http_read_body(client, body, buf, sizeof(buf))) > 0) {
+        if (spool_write(s, buf, ret) != ret) {
+            return -4;
+        }
+    }
+    return ret;
+}
+
 http_status *http_get_status(unsigned short status_code) {
     for (int i = 0; i < sizeof(http_statuses) / sizeof(http_status); i++) {
         if (http_statuses[i].code == status_code) {
@@ -284,6 +487,14 @@ char *http_format_date(time_t time, char *buf, size_t size) {
     return buf;
 }
 
+time_t http_parse_date(const char *str) {
+    struct tm timeinfo;
+    memset(&timeinfo, 0, sizeof(timeinfo));
+    const char *end = strptime(str, "%a, %d %b %Y %H:%M:%S GMT", &timeinfo);
+    if (end == NULL || end[0] != 0) return -1;
+    return timegm(&timeinfo);
+}
+
 char *http_get_date(char *buf, size_t size) {
     time_t rawtime;
     time(&rawtime);
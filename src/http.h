@@ -16,7 +16,22 @@
 #define HTTP_REMOVE_ALL 1
 #define HTTP_REMOVE_LAST 2
 
+#define HTTP_CHUNK_SIZE 0
+#define HTTP_CHUNK_EXT 1
+#define HTTP_CHUNK_SIZE_LF 2
+#define HTTP_CHUNK_DATA 3
+#define HTTP_CHUNK_DATA_CR 4
+#define HTTP_CHUNK_DATA_LF 5
+#define HTTP_CHUNK_TRAILER 6
+#define HTTP_CHUNK_TRAILER_LINE 7
+#define HTTP_CHUNK_TRAILER_LF 8
+
+#define HTTP_MAX_HEADER_FIELDS 256
+// fields the server adds to a response itself (Date, Server, Connection, ...)
+#define HTTP_RESERVED_HEADER_FIELDS 16
+
 #include "sock.h"
+#include "spool.h"
 #include "utils.h"
 
 
@@ -32,8 +47,8 @@ typedef struct {
 } http_error_msg;
 
 typedef struct {
-    char field_num;
-    char *fields[64][2];
+    unsigned short field_num;
+    char *fields[HTTP_MAX_HEADER_FIELDS][2];
 } http_hdr;
 
 typedef struct {
@@ -49,6 +64,16 @@ typedef struct {
     http_hdr hdr;
 } http_res;
 
+typedef struct {
+    unsigned char chunked:1;
+    unsigned char done:1;
+    unsigned char state;
+    unsigned char size_digits;
+    unsigned long len;      // remaining bytes of content or current chunk
+    unsigned long total;    // decoded bytes so far
+    unsigned long max;      // 0 = unlimited
+} http_body;
+
 http_status http_statuses[] = {
         {100, "Informational", "Continue"},
         {101, "Informational", "Switching Protocols"},
@@ -184,6 +209,8 @@ void http_free_req(http_req *req);
 
 void http_free_res(http_res *res);
 
+long http_receive_header(sock *s, char *buf, unsigned long size);
+
 int http_receive_request(sock *client, http_req *req);
 
 int http_parse_header_field(http_hdr *hdr, const char *buf, const char *end_ptr) ;
@@ -194,10 +221,22 @@ void http_add_header_field(http_hdr *hdr, const char *field_name, const char *fi
 
 void http_remove_header_field(http_hdr *hdr, const char *field_name, int mode);
 
+unsigned long http_get_header_size(const http_hdr *hdr);
+
 int http_send_response(sock *client, http_res *res);
 
 int http_send_request(sock *server, http_req *req);
 
+int http_transfer_chunked(const char *transfer_encoding);
+
+int http_init_body(http_body *body, http_req *req, unsigned long max_len);
+
+long http_chunk_decode(http_body *body, char *buf, long len);
+
+long http_read_body(sock *client, http_body *body, char *buf, unsigned long len);
+
+long http_buffer_body(sock *client, http_body *body, spool *s);
+
 http_status *http_get_status(unsigned short status_code);
 
 http_error_msg *http_get_error_msg(unsigned short status_code);
@@ -206,6 +245,8 @@ const char *http_get_status_color(http_status *status);
 
 char *http_format_date(time_t time, char *buf, size_t size);
 
+time_t http_parse_date(const char *str);
+
 char *http_get_date(char *buf, size_t size);
 
 #endif //NECRONDA_SERVER_HTTP_H
@@ -0,0 +1,73 @@
+/**
+ * Necronda Web Server
+ * Shared metrics counters
+ * src/metrics.c
+ * Lorenz Stechauner, 2021-01-24
+ */
+
+#include "metrics.h"
+
+
+int metrics_init() {
+    int shm_id = shmget(SHM_KEY_METRICS, sizeof(server_metrics), IPC_CREAT | IPC_EXCL | 0600);
+    if (shm_id < 0) {
+        fprintf(stderr, ERR_STR "Unable to create shared memory: %s" CLR_STR "\n", strerror(errno));
+        return -1;
+    }
+
+    void *shm_rw = shmat(shm_id, NULL, 0);
+    if (shm_rw == (void *) -1) {
+        fprintf(stderr, ERR_STR "Unable to attach shared memory (rw): %s" CLR_STR "\n", strerror(errno));
+        return -2;
+    }
+    metrics = shm_rw;
+    memset(metrics, 0, sizeof(server_metrics));
+    return 0;
+}
+
+int metrics_unload() {
+    int shm_id = shmget(SHM_KEY_METRICS, 0, 0);
+    if (shm_id < 0) {
+        fprintf(stderr, ERR_STR "Unable to get shared memory id: %s" CLR_STR "\n", strerror(errno));
+        shmdt(metrics);
+        return -1;
+    } else if (shmctl(shm_id, IPC_RMID, NULL) < 0) {
+        fprintf(stderr, ERR_STR "Unable to configure shared memory: %s" CLR_STR "\n", strerror(errno));
+        shmdt(metrics);
+        return -1;
+    }
+    shmdt(metrics);
+    metrics = NULL;
+    return 0;
+}
+
+void metrics_print() {
+    if (metrics == NULL) return;
+    fprintf(stderr, "Request bodies buffered: %lu (%lu bytes), spooled to file: %lu (%lu bytes)\n",
+            metrics->req_body_buffered, metrics->req_body_buffered_bytes,
+            metrics->req_body_spooled, metrics->req_body_spooled_bytes);
+    unsigned long fcgi_total = metrics->fastcgi_connects + metrics->fastcgi_reuses;
+    fprintf(stderr, "FastCGI connections: %lu new, %lu reused (%.1f%% reuse)\n",
+            metrics->fastcgi_connects, metrics->fastcgi_reuses,
+            fcgi_total != 0 ? 100.0 * (double) metrics->fastcgi_reuses / (double) fcgi_total : 0.0);
+    fprintf(stderr, "FastCGI cache: %lu hits, %lu misses, %lu stored\n",
+            metrics->fastcgi_cache_hits, metrics->fastcgi_cache_misses, metrics->fastcgi_cache_stores);
+    fprintf(stderr, "Response bodies buffered: %lu (%lu bytes), spooled to file: %lu (%lu bytes)\n",
+            metrics->resp_body_buffered, metrics->resp_body_buffered_bytes,
+            metrics->resp_body_spooled, metrics->resp_body_spooled_bytes);
+    unsigned long proxy_total = metrics->proxy_connects + metrics->proxy_reuses;
+    fprintf(stderr, "Proxy connections: %lu new, %lu reused (%.1f%% reuse)\n",
+            metrics->proxy_connects, metrics->proxy_reuses,
+            proxy_total != 0 ? 100.0 * (double) metrics->proxy_reuses / (double) proxy_total : 0.0);
+    fprintf(stderr, "Proxy TLS handshakes: %lu (%lu resumed)\n",
+            metrics->proxy_tls_handshakes, metrics->proxy_tls_resumed);
+    fprintf(stderr, "Proxy cache: %lu hits, %lu stale, %lu revalidated, %lu misses, %lu stored\n",
+            metrics->proxy_cache_hits, metrics->proxy_cache_stale, metrics->proxy_cache_revalidated,
+            metrics->proxy_cache_misses, metrics->proxy_cache_stores);
+    fprintf(stderr, "Collapsed cache misses: %lu served after waiting, %lu timed out\n",
+            metrics->cache_collapsed, metrics->cache_collapse_timeouts);
+    fprintf(stderr, "Upgraded proxy connections: %lu (%lu handed off to the tunnel-relay, %lu open there)\n",
+            metrics->proxy_upgrades, metrics->tunnels_handed_off, metrics->tunnels_active);
+    fprintf(stderr, "GeoIP cache: %lu hits, %lu misses\n",
+            metrics->geoip_cache_hits, metrics->geoip_cache_misses);
+}
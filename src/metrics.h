@@ -0,0 +1,60 @@
+/**
+ * Necronda Web Server
+ * Shared metrics counters (header file)
+ * src/metrics.h
+ * Lorenz Stechauner, 2021-01-24
+ */
+
+#ifndef NECRONDA_SERVER_METRICS_H
+#define NECRONDA_SERVER_METRICS_H
+
+#include <stdio.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#define metrics_add(field, n) do { if (metrics != NULL) __atomic_fetch_add(&metrics->field, (n), __ATOMIC_RELAXED); } while (0)
+#define metrics_inc(field) metrics_add(field, 1)
+
+
+typedef struct {
+    unsigned long req_body_buffered;
+    unsigned long req_body_buffered_bytes;
+    unsigned long req_body_spooled;
+    unsigned long req_body_spooled_bytes;
+    unsigned long fastcgi_connects;
+    unsigned long fastcgi_reuses;
+    unsigned long fastcgi_cache_hits;
+    unsigned long fastcgi_cache_misses;
+    unsigned long fastcgi_cache_stores;
+    unsigned long resp_body_buffered;
+    unsigned long resp_body_buffered_bytes;
+    unsigned long resp_body_spooled;
+    unsigned long resp_body_spooled_bytes;
+    unsigned long proxy_connects;
+    unsigned long proxy_reuses;
+    unsigned long proxy_tls_handshakes;
+    unsigned long proxy_tls_resumed;
+    unsigned long proxy_cache_hits;
+    unsigned long proxy_cache_stale;
+    unsigned long proxy_cache_revalidated;
+    unsigned long proxy_cache_misses;
+    unsigned long proxy_cache_stores;
+    unsigned long cache_collapsed;
+    unsigned long cache_collapse_timeouts;
+    unsigned long proxy_upgrades;
+    unsigned long tunnels_handed_off;
+    unsigned long tunnels_active;
+    unsigned long geoip_cache_hits;
+    unsigned long geoip_cache_misses;
+} server_metrics;
+
+server_metrics *metrics;
+
+
+int metrics_init();
+
+int metrics_unload();
+
+void metrics_print();
+
+#endif //NECRONDA_SERVER_METRICS_H
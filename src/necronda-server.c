@@ -5,22 +5,33 @@
  * Lorenz Stechauner, 2020-12-03
  */
 
-#define _POSIX_C_SOURCE 199309L
+#define _GNU_SOURCE
 
 #include "necronda-server.h"
 
 #include "config.c"
+#include "metrics.c"
 #include "utils.c"
+#include "compress.c"
+#include "upstream.c"
+#include "dns.c"
+#include "geoip.c"
 #include "uri.c"
 #include "cache.c"
 #include "sock.c"
+#include "spool.c"
+#include "ringbuf.c"
 #include "http.c"
+#include "resp_cache.c"
 #include "rev_proxy.c"
+#include "health.c"
+#include "tunnel.c"
 #include "client.c"
 #include "fastcgi.c"
 
 
 int active = 1;
+int print_metrics = 0;
 const char *config_file;
 
 
@@ -31,6 +42,10 @@ void openssl_init() {
     OpenSSL_add_all_algorithms();
 }
 
+void request_metrics() {
+    print_metrics = 1;
+}
+
 void destroy() {
     fprintf(stderr, "\n" ERR_STR "Terminating forcefully!" CLR_STR "\n");
     int status = 0;
@@ -59,6 +74,12 @@ void destroy() {
     }
     cache_unload();
     config_unload();
+    metrics_unload();
+    fastcgi_state_unload();
+    upstream_unload();
+    resp_cache_unload();
+    dns_unload();
+    geoip_unload();
     exit(2);
 }
 
@@ -126,8 +147,16 @@ void terminate() {
     } else {
         fprintf(stderr, "Goodbye\n");
     }
+    metrics_print();
+    upstream_print();
     cache_unload();
     config_unload();
+    metrics_unload();
+    fastcgi_state_unload();
+    upstream_unload();
+    resp_cache_unload();
+    dns_unload();
+    geoip_unload();
     exit(0);
 }
 
@@ -267,6 +296,10 @@ int main(int argc, const char *argv[]) {
     client.buf_off = 0;
     client.ctx = SSL_CTX_new(TLS_server_method());
     SSL_CTX_set_options(client.ctx, SSL_OP_SINGLE_DH_USE);
+#ifdef SSL_OP_ENABLE_KTLS
+    // lets the kernel encrypt spliced proxy responses, if the tls module is available
+    SSL_CTX_set_options(client.ctx, SSL_OP_ENABLE_KTLS);
+#endif
     SSL_CTX_set_verify(client.ctx, SSL_VERIFY_NONE, NULL);
     SSL_CTX_set_min_proto_version(client.ctx, TLS1_VERSION);
     SSL_CTX_set_mode(client.ctx, SSL_MODE_ENABLE_PARTIAL_WRITE);
@@ -277,6 +310,7 @@ int main(int argc, const char *argv[]) {
     rev_proxy.buf_len = 0;
     rev_proxy.buf_off = 0;
     rev_proxy.ctx = SSL_CTX_new(TLS_client_method());
+    upstream_tls_init(rev_proxy.ctx);
 
     if (SSL_CTX_use_certificate_chain_file(client.ctx, cert_file) != 1) {
         fprintf(stderr, ERR_STR "Unable to load certificate chain file: %s: %s" CLR_STR "\n",
@@ -307,9 +341,81 @@ int main(int argc, const char *argv[]) {
         }
     }
 
+    signal(SIGUSR1, request_metrics);
+    ret = metrics_init();
+    if (ret != 0) {
+        config_unload();
+        return 1;
+    }
+
+    ret = fastcgi_state_init();
+    if (ret != 0) {
+        config_unload();
+        metrics_unload();
+        return 1;
+    }
+
+    ret = upstream_init();
+    if (ret != 0) {
+        config_unload();
+        metrics_unload();
+        fastcgi_state_unload();
+        return 1;
+    }
+
+    ret = resp_cache_init();
+    if (ret != 0) {
+        config_unload();
+        metrics_unload();
+        fastcgi_state_unload();
+        upstream_unload();
+        if (ret < -2) resp_cache_unload();
+        return 1;
+    }
+
+    ret = geoip_init();
+    if (ret != 0) {
+        config_unload();
+        metrics_unload();
+        fastcgi_state_unload();
+        upstream_unload();
+        resp_cache_unload();
+        return 1;
+    }
+
     ret = cache_init();
     if (ret < 0) {
         config_unload();
+        metrics_unload();
+        fastcgi_state_unload();
+        upstream_unload();
+        resp_cache_unload();
+        geoip_unload();
+        return 1;
+    } else if (ret != 0) {
+        return 0;
+    }
+
+    ret = dns_init();
+    if (ret < 0) {
+        // stops the cache-updater and releases the shared memory
+        terminate();
+        return 1;
+    } else if (ret != 0) {
+        return 0;
+    }
+
+    ret = health_init();
+    if (ret < 0) {
+        terminate();
+        return 1;
+    } else if (ret != 0) {
+        return 0;
+    }
+
+    ret = tunnel_init();
+    if (ret < 0) {
+        terminate();
         return 1;
     } else if (ret != 0) {
         return 0;
@@ -322,7 +428,14 @@ int main(int argc, const char *argv[]) {
         timeout.tv_usec = 0;
         read_socket_fds = socket_fds;
         ready_sockets_num = select(max_socket_fd + 1, &read_socket_fds, NULL, NULL, &timeout);
-        if (ready_sockets_num < 0) {
+        if (print_metrics) {
+            print_metrics = 0;
+            metrics_print();
+            upstream_print();
+        }
+        if (ready_sockets_num < 0 && errno == EINTR) {
+            continue;
+        } else if (ready_sockets_num < 0) {
             fprintf(stderr, ERR_STR "Unable to select sockets: %s" CLR_STR "\n", strerror(errno));
             terminate();
             return 1;
@@ -341,6 +454,7 @@ int main(int argc, const char *argv[]) {
                     // child
                     signal(SIGINT, SIG_IGN);
                     signal(SIGTERM, SIG_IGN);
+                    signal(SIGUSR1, SIG_IGN);
 
                     client.socket = client_fd;
                     client.enc = i == 1;
@@ -37,14 +37,26 @@
 #define REQ_PER_CONNECTION 100
 #define CLIENT_TIMEOUT 3600
 #define SERVER_TIMEOUT 4
+#define TUNNEL_TIMEOUT 300
+#define TUNNEL_PING_INTERVAL 30
 
 #define CHUNK_SIZE 8192
 #define CLIENT_MAX_HEADER_SIZE 8192
+#define SERVER_MAX_HEADER_SIZE 65536
+#define CLIENT_MAX_BODY_SIZE 104857600
+#define CLIENT_BODY_BUFFER_SIZE 65536
+#define FASTCGI_RESPONSE_BUFFER_SIZE 1048576
 #define FILE_CACHE_SIZE 1024
 #define GEOIP_MAX_SIZE 8192
 
 #define SHM_KEY_CACHE 255641
 #define SHM_KEY_CONFIG 255642
+#define SHM_KEY_METRICS 255643
+#define SHM_KEY_FASTCGI 255644
+#define SHM_KEY_UPSTREAM 255645
+#define SHM_KEY_RESP_CACHE 255646
+#define SHM_KEY_DNS 255647
+#define SHM_KEY_GEOIP 255648
 
 #define ERR_STR "\x1B[1;31m"
 #define CLR_STR "\x1B[0m"
@@ -64,6 +76,10 @@
 #define SERVER_STR "Necronda/" NECRONDA_VERSION
 #define NECRONDA_ZLIB_LEVEL 9
 
+#ifndef PLAIN_HTTP_PROXY
+// only for benchmarks (tools/proxy-benchmark.sh), proxy hosts are always redirected to https otherwise
+#define PLAIN_HTTP_PROXY 0
+#endif
 #ifndef DEFAULT_HOST
 #define DEFAULT_HOST "www.necronda.net"
 #endif
@@ -0,0 +1,606 @@
+/**
+ * Necronda Web Server
+ * Shared response cache
+ * src/resp_cache.c
+ * Lorenz Stechauner, 2021-02-07
+ */
+
+#include "resp_cache.h"
+
+
+void resp_cache_lock() {
+    shm_mutex_lock(&resp_cache->lock);
+}
+
+void resp_cache_unlock() {
+    shm_mutex_unlock(&resp_cache->lock);
+}
+
+void resp_cache_filename(char *buf, const unsigned char *key, unsigned long gen) {
+    char *ptr = buf + sprintf(buf, RESP_CACHE_DIR "/");
+    for (int i = 0; i < SHA_DIGEST_LENGTH; i++) {
+        ptr += sprintf(ptr, "%02x", key[i]);
+    }
+    sprintf(ptr, "-%lu", gen);
+}
+
+int resp_cache_init() {
+    int shm_id = shmget(SHM_KEY_RESP_CACHE, sizeof(resp_cache_table), IPC_CREAT | IPC_EXCL | 0600);
+    if (shm_id < 0) {
+        fprintf(stderr, ERR_STR "Unable to create shared memory: %s" CLR_STR "\n", strerror(errno));
+        return -1;
+    }
+
+    void *shm_rw = shmat(shm_id, NULL, 0);
+    if (shm_rw == (void *) -1) {
+        fprintf(stderr, ERR_STR "Unable to attach shared memory (rw): %s" CLR_STR "\n", strerror(errno));
+        return -2;
+    }
+    resp_cache = shm_rw;
+    memset(resp_cache, 0, sizeof(resp_cache_table));
+    if ((errno = shm_mutex_init(&resp_cache->lock)) != 0) {
+        fprintf(stderr, ERR_STR "Unable to initialize lock: %s" CLR_STR "\n", strerror(errno));
+        return -3;
+    }
+
+    if (mkdir("/var/necronda-server/", 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, ERR_STR "Unable to create directory '/var/necronda-server/': %s" CLR_STR "\n", strerror(errno));
+        return -3;
+    }
+    if (mkdir(RESP_CACHE_DIR, 0700) < 0 && errno != EEXIST) {
+        fprintf(stderr, ERR_STR "Unable to create directory '" RESP_CACHE_DIR "': %s" CLR_STR "\n", strerror(errno));
+        return -3;
+    }
+
+    // the index starts empty, so files of a previous run are unreachable
+    char buf[512];
+    DIR *dir = opendir(RESP_CACHE_DIR);
+    if (dir != NULL) {
+        struct dirent *ent;
+        while ((ent = readdir(dir)) != NULL) {
+            if (ent->d_name[0] == '.' && (ent->d_name[1] == 0 || strcmp(ent->d_name, "..") == 0)) continue;
+            snprintf(buf, sizeof(buf), RESP_CACHE_DIR "/%s", ent->d_name);
+            unlink(buf);
+        }
+        closedir(dir);
+    }
+    return 0;
+}
+
+int resp_cache_unload() {
+    int shm_id = shmget(SHM_KEY_RESP_CACHE, 0, 0);
+    if (shm_id < 0) {
+        fprintf(stderr, ERR_STR "Unable to get shared memory id: %s" CLR_STR "\n", strerror(errno));
+        shmdt(resp_cache);
+        return -1;
+    } else if (shmctl(shm_id, IPC_RMID, NULL) < 0) {
+        fprintf(stderr, ERR_STR "Unable to configure shared memory: %s" CLR_STR "\n", strerror(errno));
+        shmdt(resp_cache);
+        return -1;
+    }
+    shmdt(resp_cache);
+    resp_cache = NULL;
+    return 0;
+}
+
+const char *resp_cache_req_value(const http_req *req, const char *name, unsigned long *len) {
+    if (strncasecmp(name, "cookie:", 7) != 0) {
+        const char *value = http_get_header_field(&req->hdr, name);
+        if (value != NULL) *len = strlen(value);
+        return value;
+    }
+
+    name += 7;
+    unsigned long name_len = strlen(name);
+    const char *ptr = http_get_header_field(&req->hdr, "Cookie");
+    while (ptr != NULL && ptr[0] != 0) {
+        while (ptr[0] == ' ' || ptr[0] == ';') ptr++;
+        unsigned long cookie_len = strcspn(ptr, ";");
+        if (cookie_len > name_len && ptr[name_len] == '=' && strncmp(ptr, name, name_len) == 0) {
+            *len = cookie_len - name_len - 1;
+            return ptr + name_len + 1;
+        }
+        ptr += cookie_len;
+    }
+    return NULL;
+}
+
+void resp_cache_key(unsigned char *key, const http_req *req, const char *host, const char *vary) {
+    SHA_CTX ctx;
+    char name[256];
+    const char *method = strcmp(req->method, "HEAD") == 0 ? "GET" : req->method;
+
+    SHA1_Init(&ctx);
+    SHA1_Update(&ctx, method, strlen(method) + 1);
+    SHA1_Update(&ctx, host, strlen(host) + 1);
+    SHA1_Update(&ctx, req->uri, strlen(req->uri) + 1);
+
+    const char *ptr = vary;
+    while (ptr != NULL && ptr[0] != 0) {
+        unsigned long len = strcspn(ptr, " \t,");
+        if (len > 0 && len < sizeof(name)) {
+            sprintf(name, "%.*s", (int) len, ptr);
+            SHA1_Update(&ctx, name, len + 1);
+            unsigned long value_len;
+            const char *value = resp_cache_req_value(req, name, &value_len);
+            if (value != NULL) {
+                SHA1_Update(&ctx, "=", 1);
+                SHA1_Update(&ctx, value, value_len);
+            }
+            SHA1_Update(&ctx, "", 1);
+        }
+        ptr += len;
+        while (ptr[0] == ' ' || ptr[0] == '\t' || ptr[0] == ',') ptr++;
+    }
+    SHA1_Final(key, &ctx);
+}
+
+long resp_cache_ttl(const http_res *res, long default_ttl) {
+    const char *ptr;
+    unsigned short code = res->status->code;
+    if (code != 200 && code != 301 && code != 404) {
+        return 0;
+    } else if (http_get_header_field(&res->hdr, "Set-Cookie") != NULL) {
+        return 0;
+    }
+
+    ptr = http_get_header_field(&res->hdr, "X-Accel-Expires");
+    if (ptr != NULL) {
+        if (ptr[0] == '@') {
+            return strtol(ptr + 1, NULL, 10) - time(NULL);
+        }
+        return strtol(ptr, NULL, 10);
+    }
+
+    ptr = http_get_header_field(&res->hdr, "Cache-Control");
+    if (ptr != NULL) {
+        if (strstr(ptr, "no-store") != NULL || strstr(ptr, "no-cache") != NULL || strstr(ptr, "private") != NULL) {
+            return 0;
+        }
+        const char *age = strstr(ptr, "s-maxage=");
+        if (age != NULL) return strtol(age + 9, NULL, 10);
+        age = strstr(ptr, "max-age=");
+        if (age != NULL) return strtol(age + 8, NULL, 10);
+    }
+
+    return default_ttl;
+}
+
+const char *resp_cache_directive(const char *value, const char *name, long *arg) {
+    unsigned long name_len = strlen(name);
+    const char *ptr = value;
+    while (ptr != NULL && ptr[0] != 0) {
+        while (ptr[0] == ' ' || ptr[0] == '\t' || ptr[0] == ',') ptr++;
+        unsigned long len = strcspn(ptr, " \t,=");
+        if (len == name_len && strncasecmp(ptr, name, len) == 0) {
+            if (arg != NULL) *arg = ptr[len] == '=' ? strtol(ptr + len + 1 + (ptr[len + 1] == '"'), NULL, 10) : -1;
+            return ptr;
+        }
+        ptr += strcspn(ptr, ",");
+    }
+    return NULL;
+}
+
+int resp_cache_parse_policy(const http_res *res, resp_cache_policy *policy) {
+    const char *cache_control = http_get_header_field(&res->hdr, "Cache-Control");
+    const char *vary = http_get_header_field(&res->hdr, "Vary");
+    const char *ptr;
+    long val;
+
+    memset(policy, 0, sizeof(resp_cache_policy));
+    switch (res->status->code) {
+        case 200: case 203: case 204: case 300: case 301: case 308: case 404: case 405: case 410: case 414: case 501:
+            break;
+        default:
+            return -1;
+    }
+    if (http_get_header_field(&res->hdr, "Set-Cookie") != NULL || (vary != NULL && strchr(vary, '*') != NULL)) {
+        return -1;
+    } else if (resp_cache_directive(cache_control, "no-store", NULL) != NULL ||
+               resp_cache_directive(cache_control, "private", NULL) != NULL ||
+               resp_cache_directive(cache_control, "no-cache", NULL) != NULL) {
+        return -1;
+    }
+
+    time_t now = time(NULL);
+    ptr = http_get_header_field(&res->hdr, "Date");
+    time_t date = ptr != NULL ? http_parse_date(ptr) : -1;
+    if (date < 0 || date > now) date = now;
+    ptr = http_get_header_field(&res->hdr, "Age");
+    policy->age = ptr != NULL ? strtol(ptr, NULL, 10) : 0;
+    if (policy->age < now - date) policy->age = now - date;
+    if (policy->age < 0) policy->age = 0;
+
+    if (resp_cache_directive(cache_control, "s-maxage", &val) != NULL ||
+        resp_cache_directive(cache_control, "max-age", &val) != NULL) {
+        policy->ttl = val > 0 ? val : 0;
+    } else if ((ptr = http_get_header_field(&res->hdr, "Expires")) != NULL) {
+        // an invalid date means already expired
+        time_t expires = http_parse_date(ptr);
+        policy->ttl = expires > date ? expires - date : 0;
+    } else if ((ptr = http_get_header_field(&res->hdr, "Last-Modified")) != NULL) {
+        // heuristic freshness, a tenth of the time since the last modification
+        time_t last_modified = http_parse_date(ptr);
+        policy->ttl = last_modified >= 0 && last_modified < date ? (date - last_modified) / 10 : 0;
+        if (policy->ttl > RESP_CACHE_MAX_HEURISTIC) policy->ttl = RESP_CACHE_MAX_HEURISTIC;
+    }
+
+    if (resp_cache_directive(cache_control, "must-revalidate", NULL) != NULL ||
+        resp_cache_directive(cache_control, "proxy-revalidate", NULL) != NULL ||
+        resp_cache_directive(cache_control, "s-maxage", NULL) != NULL) {
+        policy->must_revalidate = 1;
+    } else {
+        if (resp_cache_directive(cache_control, "stale-while-revalidate", &val) != NULL && val > 0) {
+            policy->stale_revalidate = (unsigned int) val;
+        }
+        if (resp_cache_directive(cache_control, "stale-if-error", &val) != NULL && val > 0) {
+            policy->stale_error = (unsigned int) val;
+        }
+    }
+    return 0;
+}
+
+resp_cache_entry *resp_cache_slot(const unsigned char *key, time_t now) {
+    resp_cache_entry *victim = NULL;
+    int victim_rank = 0;
+    for (int i = 0; i < RESP_CACHE_SIZE; i++) {
+        resp_cache_entry *entry = &resp_cache->entries[i];
+        if (entry->state != RESP_CACHE_FREE && memcmp(entry->key, key, SHA_DIGEST_LENGTH) == 0) {
+            return entry;
+        }
+        // prefer free slots, then expired entries, then the least recently used one
+        unsigned int stale = entry->stale_revalidate > entry->stale_error ? entry->stale_revalidate : entry->stale_error;
+        int rank = entry->state == RESP_CACHE_FREE ? 0 : entry->expires + stale <= now ? 1 : 2;
+        if (victim == NULL || rank < victim_rank || (rank == victim_rank && entry->last_used < victim->last_used)) {
+            victim = entry;
+            victim_rank = rank;
+        }
+    }
+    return victim;
+}
+
+int resp_cache_find(const unsigned char *key, resp_cache_entry *entry) {
+    int found = 0;
+    if (resp_cache == NULL) return 1;
+
+    resp_cache_lock();
+    for (int i = 0; i < RESP_CACHE_SIZE; i++) {
+        resp_cache_entry *e = &resp_cache->entries[i];
+        if (e->state != RESP_CACHE_FREE && memcmp(e->key, key, SHA_DIGEST_LENGTH) == 0) {
+            e->last_used = time(NULL);
+            memcpy(entry, e, sizeof(resp_cache_entry));
+            found = 1;
+            break;
+        }
+    }
+    resp_cache_unlock();
+    return !found;
+}
+
+int resp_cache_open(const resp_cache_entry *entry, http_res *res, FILE **file, long *content_length) {
+    char filename[256];
+
+    // the file may have been replaced in the meantime, in which case it was unlinked
+    resp_cache_filename(filename, entry->key, entry->gen);
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL) return 1;
+
+    char *buf = malloc(entry->hdr_len);
+    if (fread(buf, 1, entry->hdr_len, f) != entry->hdr_len) {
+        free(buf);
+        fclose(f);
+        return 1;
+    }
+
+    char *ptr = buf;
+    while (ptr < buf + entry->hdr_len) {
+        char *pos = memchr(ptr, '\r', buf + entry->hdr_len - ptr);
+        if (pos == NULL) break;
+        if (http_parse_header_field(&res->hdr, ptr, pos) != 0) break;
+        ptr = pos + 2;
+    }
+    free(buf);
+
+    res->status = http_get_status(entry->status);
+    *file = f;
+    *content_length = (long) entry->body_len;
+    return 0;
+}
+
+int resp_cache_lookup(const unsigned char *key, http_res *res, FILE **file, long *content_length) {
+    resp_cache_entry entry;
+    if (resp_cache_find(key, &entry) != 0 || entry.state != RESP_CACHE_VALID || entry.expires <= time(NULL)) {
+        return 1;
+    }
+    return resp_cache_open(&entry, res, file, content_length);
+}
+
+int resp_cache_claim(const unsigned char *key) {
+    int ret = -1;
+    if (resp_cache == NULL) return -1;
+
+    time_t now = time(NULL);
+    resp_cache_lock();
+    for (int i = 0; i < RESP_CACHE_SIZE; i++) {
+        resp_cache_entry *e = &resp_cache->entries[i];
+        if (e->state == RESP_CACHE_VALID && memcmp(e->key, key, SHA_DIGEST_LENGTH) == 0) {
+            // only one process revalidates an entry, a crashed one is replaced after the timeout
+            if (e->revalidating_until <= now) {
+                e->revalidating_until = now + RESP_CACHE_REVALIDATE_TIMEOUT;
+                ret = 0;
+            }
+            break;
+        }
+    }
+    resp_cache_unlock();
+    return ret;
+}
+
+void resp_cache_unclaim(const unsigned char *key) {
+    if (resp_cache == NULL) return;
+    resp_cache_lock();
+    for (int i = 0; i < RESP_CACHE_SIZE; i++) {
+        resp_cache_entry *e = &resp_cache->entries[i];
+        if (e->state == RESP_CACHE_VALID && memcmp(e->key, key, SHA_DIGEST_LENGTH) == 0) {
+            e->revalidating_until = 0;
+            break;
+        }
+    }
+    resp_cache_unlock();
+}
+
+int resp_cache_refresh(const unsigned char *key, const resp_cache_policy *policy) {
+    int ret = -1;
+    if (resp_cache == NULL) return -1;
+
+    time_t now = time(NULL);
+    resp_cache_lock();
+    for (int i = 0; i < RESP_CACHE_SIZE; i++) {
+        resp_cache_entry *e = &resp_cache->entries[i];
+        if (e->state == RESP_CACHE_VALID && memcmp(e->key, key, SHA_DIGEST_LENGTH) == 0) {
+            e->date = now - policy->age;
+            e->expires = e->date + policy->ttl;
+            e->stale_revalidate = policy->stale_revalidate;
+            e->stale_error = policy->stale_error;
+            e->must_revalidate = policy->must_revalidate;
+            e->revalidating_until = 0;
+            ret = 0;
+            break;
+        }
+    }
+    resp_cache_unlock();
+    return ret;
+}
+
+resp_cache_inflight *resp_cache_inflight_find(const unsigned char *key, time_t now) {
+    for (int i = 0; i < RESP_CACHE_INFLIGHT; i++) {
+        resp_cache_inflight *f = &resp_cache->inflight[i];
+        if (f->pid == 0) continue;
+        if (f->until <= now || (!f->pass && kill(f->pid, 0) != 0 && errno == ESRCH)) {
+            // the process fetching the response crashed or hangs
+            f->pid = 0;
+        } else if (memcmp(f->key, key, SHA_DIGEST_LENGTH) == 0) {
+            return f;
+        }
+    }
+    return NULL;
+}
+
+int resp_cache_inflight_begin(const unsigned char *key) {
+    int ret = 0;
+    if (resp_cache == NULL) return 0;
+
+    time_t now = time(NULL);
+    resp_cache_lock();
+    resp_cache_inflight *found = resp_cache_inflight_find(key, now);
+    if (found != NULL) {
+        ret = !found->pass;
+    } else {
+        for (int i = 0; i < RESP_CACHE_INFLIGHT; i++) {
+            resp_cache_inflight *f = &resp_cache->inflight[i];
+            if (f->pid == 0) {
+                memcpy(f->key, key, SHA_DIGEST_LENGTH);
+                f->pid = getpid();
+                f->until = now + RESP_CACHE_INFLIGHT_TIMEOUT;
+                f->pass = 0;
+                break;
+            }
+        }
+        // a full table only disables coalescing
+    }
+    resp_cache_unlock();
+    return ret;
+}
+
+void resp_cache_inflight_end(const unsigned char *key) {
+    if (resp_cache == NULL) return;
+    resp_cache_lock();
+    for (int i = 0; i < RESP_CACHE_INFLIGHT; i++) {
+        resp_cache_inflight *f = &resp_cache->inflight[i];
+        if (f->pid == getpid() && !f->pass && memcmp(f->key, key, SHA_DIGEST_LENGTH) == 0) {
+            f->pid = 0;
+            break;
+        }
+    }
+    resp_cache_unlock();
+}
+
+void resp_cache_inflight_pass(const unsigned char *key) {
+    if (resp_cache == NULL) return;
+    resp_cache_lock();
+    for (int i = 0; i < RESP_CACHE_INFLIGHT; i++) {
+        resp_cache_inflight *f = &resp_cache->inflight[i];
+        if (f->pid == getpid() && !f->pass && memcmp(f->key, key, SHA_DIGEST_LENGTH) == 0) {
+            // waiting requests are released, following ones go to the backend without waiting
+            f->pass = 1;
+            f->until = time(NULL) + RESP_CACHE_PASS_TIMEOUT;
+            break;
+        }
+    }
+    resp_cache_unlock();
+}
+
+int resp_cache_inflight_wait(const unsigned char *key, long timeout) {
+    struct timespec begin, now;
+    long delay = 1000;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    while (1) {
+        resp_cache_lock();
+        resp_cache_inflight *f = resp_cache_inflight_find(key, time(NULL));
+        int pass = f != NULL && f->pass;
+        resp_cache_unlock();
+        if (f == NULL || pass) return 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long waited = (now.tv_sec - begin.tv_sec) * 1000 + (now.tv_nsec - begin.tv_nsec) / 1000000;
+        if (waited >= timeout) return -1;
+        // poll quickly at first, responses of popular resources are usually fast
+        usleep(delay);
+        if (delay < 50000) delay *= 2;
+    }
+}
+
+int resp_cache_store_vary(const unsigned char *key, const char *vary, time_t expires) {
+    char filename[256];
+    if (resp_cache == NULL || strlen(vary) >= sizeof(resp_cache->entries[0].vary)) return -1;
+
+    time_t now = time(NULL);
+    resp_cache_lock();
+    resp_cache_entry *e = resp_cache_slot(key, now);
+    if (e->state == RESP_CACHE_VALID) {
+        resp_cache_filename(filename, e->key, e->gen);
+        unlink(filename);
+    }
+    memset(e, 0, sizeof(resp_cache_entry));
+    memcpy(e->key, key, SHA_DIGEST_LENGTH);
+    strcpy(e->vary, vary);
+    if (e->expires < expires) e->expires = expires;
+    e->last_used = now;
+    e->state = RESP_CACHE_VARY;
+    resp_cache_unlock();
+    return 0;
+}
+
+int resp_cache_store_init(resp_cache_writer *w, const unsigned char *key, const http_res *res, long ttl) {
+    // Content-Encoding is kept, the body is stored as the backend sent it
+    const char *skip[] = {"Date", "Server", "Connection", "Keep-Alive", "Transfer-Encoding", "Content-Length",
+                          "X-Accel-Expires", "Age"};
+
+    w->file = NULL;
+    if (resp_cache == NULL || ttl <= 0) return -1;
+
+    memcpy(w->key, key, SHA_DIGEST_LENGTH);
+    w->status = res->status->code;
+    w->date = time(NULL);
+    w->expires = w->date + ttl;
+    memset(&w->policy, 0, sizeof(w->policy));
+    const char *etag = http_get_header_field(&res->hdr, "ETag");
+    snprintf(w->etag, sizeof(w->etag), "%s", etag != NULL && strlen(etag) < sizeof(w->etag) ? etag : "");
+    const char *last_modified = http_get_header_field(&res->hdr, "Last-Modified");
+    w->last_modified = last_modified != NULL ? http_parse_date(last_modified) : -1;
+    w->hdr_len = 0;
+    w->body_len = 0;
+    sprintf(w->filename, RESP_CACHE_DIR "/.tmp-%i", getpid());
+    w->file = fopen(w->filename, "wb");
+    if (w->file == NULL) {
+        print(ERR_STR "Unable to open cache file: %s" CLR_STR, strerror(errno));
+        return -1;
+    }
+
+    for (int i = 0; i < res->hdr.field_num; i++) {
+        const char *name = res->hdr.fields[i][0];
+        int keep = 1;
+        for (int j = 0; j < sizeof(skip) / sizeof(skip[0]); j++) {
+            if (strcasecmp(name, skip[j]) == 0) {
+                keep = 0;
+                break;
+            }
+        }
+        if (!keep) continue;
+        int ret = fprintf(w->file, "%s: %s\r\n", name, res->hdr.fields[i][1]);
+        if (ret < 0) {
+            resp_cache_store_abort(w);
+            return -1;
+        }
+        w->hdr_len += ret;
+    }
+    if (w->hdr_len > RESP_CACHE_MAX_HEADER) {
+        resp_cache_store_abort(w);
+        return -1;
+    }
+    return 0;
+}
+
+int resp_cache_store_policy(resp_cache_writer *w, const resp_cache_policy *policy) {
+    if (w == NULL || w->file == NULL) return -1;
+    w->policy = *policy;
+    w->date = time(NULL) - policy->age;
+    w->expires = w->date + policy->ttl;
+    return 0;
+}
+
+int resp_cache_store_write(resp_cache_writer *w, const char *buf, unsigned long len) {
+    if (w == NULL || w->file == NULL) return -1;
+    if (fwrite(buf, 1, len, w->file) != len) {
+        print(ERR_STR "Unable to write cache file: %s" CLR_STR, strerror(errno));
+        resp_cache_store_abort(w);
+        return -1;
+    }
+    w->body_len += len;
+    return 0;
+}
+
+int resp_cache_store_commit(resp_cache_writer *w) {
+    char filename[256];
+    resp_cache_entry *e;
+
+    if (w == NULL || w->file == NULL) return -1;
+    if (fclose(w->file) != 0) {
+        w->file = NULL;
+        unlink(w->filename);
+        return -1;
+    }
+    w->file = NULL;
+
+    time_t now = time(NULL);
+    resp_cache_lock();
+    e = resp_cache_slot(w->key, now);
+
+    unsigned long gen = ++resp_cache->gen;
+    resp_cache_filename(filename, w->key, gen);
+    if (rename(w->filename, filename) != 0) {
+        resp_cache_unlock();
+        print(ERR_STR "Unable to rename cache file: %s" CLR_STR, strerror(errno));
+        unlink(w->filename);
+        return -1;
+    }
+    if (e->state == RESP_CACHE_VALID) {
+        resp_cache_filename(filename, e->key, e->gen);
+        unlink(filename);
+    }
+
+    memset(e, 0, sizeof(resp_cache_entry));
+    memcpy(e->key, w->key, SHA_DIGEST_LENGTH);
+    e->status = w->status;
+    e->gen = gen;
+    e->date = w->date;
+    e->expires = w->expires;
+    e->stale_revalidate = w->policy.stale_revalidate;
+    e->stale_error = w->policy.stale_error;
+    e->must_revalidate = w->policy.must_revalidate;
+    e->last_modified = w->last_modified;
+    strcpy(e->etag, w->etag);
+    e->last_used = now;
+    e->hdr_len = w->hdr_len;
+    e->body_len = w->body_len;
+    e->state = RESP_CACHE_VALID;
+    resp_cache_unlock();
+    return 0;
+}
+
+void resp_cache_store_abort(resp_cache_writer *w) {
+    if (w == NULL || w->file == NULL) return;
+    fclose(w->file);
+    w->file = NULL;
+    unlink(w->filename);
+}
@@ -0,0 +1,134 @@
+/**
+ * Necronda Web Server
+ * Shared response cache (header file)
+ * src/resp_cache.h
+ * Lorenz Stechauner, 2021-02-07
+ */
+
+#ifndef NECRONDA_SERVER_RESP_CACHE_H
+#define NECRONDA_SERVER_RESP_CACHE_H
+
+#define RESP_CACHE_SIZE 1024
+#define RESP_CACHE_DIR "/var/necronda-server/responses"
+#define RESP_CACHE_MAX_HEADER 8192
+#define RESP_CACHE_MAX_HEURISTIC 86400
+#define RESP_CACHE_REVALIDATE_TIMEOUT 30
+#define RESP_CACHE_INFLIGHT 64
+#define RESP_CACHE_INFLIGHT_TIMEOUT 30
+#define RESP_CACHE_WAIT_TIMEOUT 5000
+#define RESP_CACHE_PASS_TIMEOUT 10
+
+#define RESP_CACHE_FREE 0
+#define RESP_CACHE_VALID 1
+#define RESP_CACHE_VARY 2
+
+#include "http.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <openssl/sha.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+
+typedef struct {
+    long ttl;
+    long age;
+    unsigned int stale_revalidate;
+    unsigned int stale_error;
+    unsigned char must_revalidate:1;
+} resp_cache_policy;
+
+typedef struct {
+    unsigned char key[SHA_DIGEST_LENGTH];
+    unsigned char state;
+    unsigned char must_revalidate:1;
+    unsigned short status;
+    unsigned long gen;
+    time_t date;                // generation of the response, for the Age header
+    time_t expires;
+    unsigned int stale_revalidate;
+    unsigned int stale_error;
+    time_t revalidating_until;
+    time_t last_used;
+    time_t last_modified;
+    char etag[72];
+    char vary[128];             // request header names of variants (RESP_CACHE_VARY)
+    unsigned long hdr_len;
+    unsigned long body_len;
+} resp_cache_entry;
+
+typedef struct {
+    unsigned char key[SHA_DIGEST_LENGTH];
+    pid_t pid;
+    time_t until;
+    unsigned char pass:1;       // the last response was not cacheable, requests are not collapsed
+} resp_cache_inflight;
+
+typedef struct {
+    pthread_mutex_t lock;
+    unsigned long gen;
+    resp_cache_entry entries[RESP_CACHE_SIZE];
+    resp_cache_inflight inflight[RESP_CACHE_INFLIGHT];
+} resp_cache_table;
+
+typedef struct {
+    FILE *file;
+    char filename[256];
+    unsigned char key[SHA_DIGEST_LENGTH];
+    unsigned short status;
+    time_t date;
+    time_t expires;
+    resp_cache_policy policy;
+    time_t last_modified;
+    char etag[72];
+    unsigned long hdr_len;
+    unsigned long body_len;
+} resp_cache_writer;
+
+resp_cache_table *resp_cache;
+
+
+int resp_cache_init();
+
+int resp_cache_unload();
+
+void resp_cache_key(unsigned char *key, const http_req *req, const char *host, const char *vary);
+
+long resp_cache_ttl(const http_res *res, long default_ttl);
+
+int resp_cache_parse_policy(const http_res *res, resp_cache_policy *policy);
+
+int resp_cache_find(const unsigned char *key, resp_cache_entry *entry);
+
+int resp_cache_open(const resp_cache_entry *entry, http_res *res, FILE **file, long *content_length);
+
+int resp_cache_lookup(const unsigned char *key, http_res *res, FILE **file, long *content_length);
+
+int resp_cache_claim(const unsigned char *key);
+
+void resp_cache_unclaim(const unsigned char *key);
+
+int resp_cache_refresh(const unsigned char *key, const resp_cache_policy *policy);
+
+int resp_cache_inflight_begin(const unsigned char *key);
+
+void resp_cache_inflight_end(const unsigned char *key);
+
+void resp_cache_inflight_pass(const unsigned char *key);
+
+int resp_cache_inflight_wait(const unsigned char *key, long timeout);
+
+int resp_cache_store_vary(const unsigned char *key, const char *vary, time_t expires);
+
+int resp_cache_store_init(resp_cache_writer *w, const unsigned char *key, const http_res *res, long ttl);
+
+int resp_cache_store_policy(resp_cache_writer *w, const resp_cache_policy *policy);
+
+int resp_cache_store_write(resp_cache_writer *w, const char *buf, unsigned long len);
+
+int resp_cache_store_commit(resp_cache_writer *w);
+
+void resp_cache_store_abort(resp_cache_writer *w);
+
+#endif //NECRONDA_SERVER_RESP_CACHE_H
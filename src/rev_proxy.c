@@ -8,76 +8,194 @@
 #include "rev_proxy.h"
 
 sock rev_proxy;
-char *rev_proxy_host = NULL;
+int rev_proxy_backend = -1;
 struct timeval server_timeout = {.tv_sec = SERVER_TIMEOUT, .tv_usec = 0};
 
 
-int rev_proxy_init(http_req *req, http_res *res, host_config *conf, sock *client, http_status *custom_status,
-                   char * err_msg) {
+time_t rev_proxy_pool_time() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+int rev_proxy_pool_get(int backend, int enc, sock *s) {
+    time_t now = rev_proxy_pool_time();
+    for (int i = 0; i < REV_PROXY_MAX_IDLE; i++) {
+        rev_proxy_pool_conn *pc = &rev_proxy_pool[i];
+        if (pc->sock.socket == 0 || pc->backend != backend || pc->sock.enc != enc) continue;
+        if (now - pc->idle_since < REV_PROXY_IDLE_TIMEOUT && sock_check(&pc->sock) == 0) {
+            *s = pc->sock;
+            pc->sock.socket = 0;
+            pc->sock.ssl = NULL;
+            return 0;
+        }
+        print(BLUE_STR "Closing idle proxy connection" CLR_STR);
+        sock_close(&pc->sock);
+    }
+    return -1;
+}
+
+void rev_proxy_pool_put(int backend, sock *s) {
+    rev_proxy_pool_conn *slot = NULL;
+    for (int i = 0; i < REV_PROXY_MAX_IDLE; i++) {
+        rev_proxy_pool_conn *pc = &rev_proxy_pool[i];
+        if (pc->sock.socket == 0) {
+            slot = pc;
+            break;
+        } else if (slot == NULL || pc->idle_since < slot->idle_since) {
+            slot = pc;
+        }
+    }
+    if (slot->sock.socket != 0) {
+        // evict the connection idle for the longest time
+        print(BLUE_STR "Closing idle proxy connection" CLR_STR);
+        sock_close(&slot->sock);
+    }
+    slot->sock = *s;
+    slot->backend = backend;
+    slot->idle_since = rev_proxy_pool_time();
+    s->socket = 0;
+    s->ssl = NULL;
+    s->enc = 0;
+}
+
+int rev_proxy_pool_idle() {
+    int num = 0;
+    for (int i = 0; i < REV_PROXY_MAX_IDLE; i++) {
+        if (rev_proxy_pool[i].sock.socket != 0) num++;
+    }
+    return num;
+}
+
+void rev_proxy_pool_close() {
+    for (int i = 0; i < REV_PROXY_MAX_IDLE; i++) {
+        if (rev_proxy_pool[i].sock.socket != 0) {
+            print(BLUE_STR "Closing proxy connection" CLR_STR);
+            sock_close(&rev_proxy_pool[i].sock);
+        }
+    }
+}
+
+void rev_proxy_release(int reuse) {
+    if (rev_proxy.buf != NULL) {
+        // data received after the response cannot belong to another request
+        if (rev_proxy.buf_off < rev_proxy.buf_len) reuse = 0;
+        free(rev_proxy.buf);
+        rev_proxy.buf = NULL;
+        rev_proxy.buf_len = 0;
+        rev_proxy.buf_off = 0;
+    }
+    if (rev_proxy.socket != 0) {
+        if (reuse && rev_proxy_backend >= 0) {
+            rev_proxy_pool_put(rev_proxy_backend, &rev_proxy);
+        } else {
+            print(BLUE_STR "Closing proxy connection" CLR_STR);
+            sock_close(&rev_proxy);
+        }
+    }
+    if (rev_proxy_backend >= 0) {
+        upstream_finish(rev_proxy_backend);
+        rev_proxy_backend = -1;
+    }
+}
+
+int rev_proxy_init(http_req *req, http_res *res, host_config *conf, sock *client, http_body *body,
+                   http_status *custom_status, char * err_msg) {
     char buffer[CHUNK_SIZE];
-    long ret;
+    long ret, len;
     int tries = 0;
     int retry = 0;
+    int reused = 0;
+    int has_body = !body->done;
+    unsigned long tried = 0, start;
+    const upstream_group *group = &conf->rev_proxy.backends;
+    const char *key = upstream_hash_key(group, req->uri, client_addr_str);
+    int upgrade = rev_proxy_upgrade(req) && !has_body;
+    upstream_server *srv;
 
-    if (rev_proxy.socket != 0 && strcmp(rev_proxy_host, conf->name) == 0 && sock_check(&rev_proxy) == 0) {
-        goto rev_proxy;
+    if (!upgrade) {
+        http_remove_header_field(&req->hdr, "Upgrade", HTTP_REMOVE_ALL);
     }
 
     retry:
-    if (rev_proxy.socket != 0) {
-        print(BLUE_STR "Closing proxy connection" CLR_STR);
-        sock_close(&rev_proxy);
-    }
+    rev_proxy_release(0);
     retry = 0;
+    reused = 0;
     tries++;
 
-    rev_proxy.socket = socket(AF_INET6, SOCK_STREAM, 0);
-    if (rev_proxy.socket  < 0) {
-        print(ERR_STR "Unable to create socket: %s" CLR_STR, strerror(errno));
-        res->status = http_get_status(500);
+    rev_proxy_backend = upstream_select(group, (int) (conf - config), tried, key);
+    if (rev_proxy_backend < 0) {
+        // all servers are known to be down, do not wait for them
+        res->status = http_get_status(503);
+        print(ERR_STR "Unable to connect to server: No server available" CLR_STR);
+        sprintf(err_msg, "Unable to connect to server: No server available.");
         return -1;
     }
+    upstream_start(rev_proxy_backend);
+    srv = &upstream_servers[rev_proxy_backend];
+    print("Reverse proxy for " BLD_STR "%s" CLR_STR, srv->name);
 
-    server_timeout.tv_sec = SERVER_TIMEOUT;
-    server_timeout.tv_usec = 0;
-    if (setsockopt(client->socket, SOL_SOCKET, SO_RCVTIMEO, &server_timeout, sizeof(server_timeout)) < 0)
-        goto rev_proxy_timeout_err;
-    if (setsockopt(client->socket, SOL_SOCKET, SO_SNDTIMEO, &server_timeout, sizeof(server_timeout)) < 0) {
-        rev_proxy_timeout_err:
-        res->status = http_get_status(502);
-        print(ERR_STR "Unable to set timeout for socket: %s" CLR_STR, strerror(errno));
-        sprintf(err_msg, "Unable to set timeout for socket: %s", strerror(errno));
-        goto proxy_err;
+    if (rev_proxy_pool_get(rev_proxy_backend, conf->rev_proxy.enc, &rev_proxy) == 0) {
+        metrics_inc(proxy_reuses);
+        reused = 1;
+        goto rev_proxy;
     }
 
-    struct hostent *host_ent = gethostbyname(conf->rev_proxy.hostname);
-    if (host_ent == NULL) {
+    struct in6_addr addrs[DNS_MAX_ADDR];
+    int addr_num = dns_resolve(srv->host, addrs, DNS_MAX_ADDR);
+    if (addr_num <= 0) {
         res->status = http_get_status(502);
         print(ERR_STR "Unable to connect to server: Name or service not known" CLR_STR);
         sprintf(err_msg, "Unable to connect to server: Name or service not known.");
-        goto proxy_err;
+        goto backend_err;
     }
 
-    struct sockaddr_in6 address = {.sin6_family = AF_INET6, .sin6_port = htons(conf->rev_proxy.port)};
-    if (host_ent->h_addrtype == AF_INET6) {
-        memcpy(&address.sin6_addr, host_ent->h_addr_list[0], host_ent->h_length);
-    } else if (host_ent->h_addrtype == AF_INET) {
-        unsigned char addr[16] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF, 0, 0, 0, 0};
-        memcpy(addr + 12, host_ent->h_addr_list[0], host_ent->h_length);
-        memcpy(&address.sin6_addr, addr, 16);
-    }
+    struct sockaddr_in6 address = {.sin6_family = AF_INET6, .sin6_port = htons(srv->port)};
+    for (int i = 0; i < addr_num; i++) {
+        // fall back to the next address of the server if connecting fails
+        if (rev_proxy.socket != 0) {
+            close(rev_proxy.socket);
+            rev_proxy.socket = 0;
+        }
+        address.sin6_addr = addrs[i];
+
+        rev_proxy.socket = socket(AF_INET6, SOCK_STREAM, 0);
+        if (rev_proxy.socket < 0) {
+            rev_proxy.socket = 0;
+            print(ERR_STR "Unable to create socket: %s" CLR_STR, strerror(errno));
+            res->status = http_get_status(500);
+            return -1;
+        }
 
-    if (connect(rev_proxy.socket, (struct sockaddr *) &address, sizeof(address)) < 0) {
+        server_timeout.tv_sec = SERVER_TIMEOUT;
+        server_timeout.tv_usec = 0;
+        if (setsockopt(rev_proxy.socket, SOL_SOCKET, SO_RCVTIMEO, &server_timeout, sizeof(server_timeout)) < 0)
+            goto rev_proxy_timeout_err;
+        if (setsockopt(rev_proxy.socket, SOL_SOCKET, SO_SNDTIMEO, &server_timeout, sizeof(server_timeout)) < 0) {
+            rev_proxy_timeout_err:
+            res->status = http_get_status(502);
+            print(ERR_STR "Unable to set timeout for socket: %s" CLR_STR, strerror(errno));
+            sprintf(err_msg, "Unable to set timeout for socket: %s", strerror(errno));
+            goto proxy_err;
+        }
+
+        if (connect(rev_proxy.socket, (struct sockaddr *) &address, sizeof(address)) == 0) {
+            break;
+        }
         res->status = http_get_status(502);
-        print(ERR_STR "Unable to connect to server: %s" CLR_STR, strerror(errno));
+        inet_ntop(address.sin6_family, (void *) &address.sin6_addr, buffer, sizeof(buffer));
+        print(ERR_STR "Unable to connect to server [%s]:%i: %s" CLR_STR, buffer, srv->port, strerror(errno));
         sprintf(err_msg, "Unable to connect to server: %s.", strerror(errno));
-        goto proxy_err;
+        if (i == addr_num - 1) {
+            goto backend_err;
+        }
     }
 
     if (conf->rev_proxy.enc) {
         rev_proxy.ssl = SSL_new(rev_proxy.ctx);
         SSL_set_fd(rev_proxy.ssl, rev_proxy.socket);
         SSL_set_connect_state(rev_proxy.ssl);
+        upstream_tls_prepare(rev_proxy_backend, rev_proxy.ssl);
 
         ret = SSL_do_handshake(rev_proxy.ssl);
         rev_proxy._last_ret = ret;
@@ -88,38 +206,73 @@ int rev_proxy_init(http_req *req, http_res *res, host_config *conf, sock *client
             res->status = http_get_status(502);
             print(ERR_STR "Unable to perform handshake: %s" CLR_STR, sock_strerror(&rev_proxy));
             sprintf(err_msg, "Unable to perform handshake: %s.", sock_strerror(&rev_proxy));
-            goto proxy_err;
+            goto backend_err;
         }
+        metrics_inc(proxy_tls_handshakes);
+        if (SSL_session_reused(rev_proxy.ssl)) metrics_inc(proxy_tls_resumed);
     }
 
-    rev_proxy_host = conf->name;
+    metrics_inc(proxy_connects);
     inet_ntop(address.sin6_family, (void *) &address.sin6_addr, buffer, sizeof(buffer));
-    print(BLUE_STR "Established new connection with " BLD_STR "[%s]:%i" CLR_STR, buffer, conf->rev_proxy.port);
+    print(BLUE_STR "Established new connection with " BLD_STR "[%s]:%i" CLR_STR, buffer, srv->port);
 
     rev_proxy:
     http_remove_header_field(&req->hdr, "Connection", HTTP_REMOVE_ALL);
-    http_add_header_field(&req->hdr, "Connection", "keep-alive");
+    http_add_header_field(&req->hdr, "Connection", upgrade ? "upgrade" : "keep-alive");
     http_remove_header_field(&req->hdr, "X-Forwarded-For", HTTP_REMOVE_ALL);
     http_add_header_field(&req->hdr, "X-Forwarded-For", client_addr_str);
 
+    start = upstream_time_us();
     ret = http_send_request(&rev_proxy, req);
     if (ret < 0) {
         res->status = http_get_status(502);
         print(ERR_STR "Unable to send request to server (1): %s" CLR_STR, sock_strerror(&rev_proxy));
         sprintf(err_msg, "Unable to send request to server: %s.", sock_strerror(&rev_proxy));
+        if (!reused) goto backend_err;
         retry = tries < 4;
         goto proxy_err;
     }
 
-    char *content_length = http_get_header_field(&req->hdr, "Content-Length");
-    if (content_length != NULL) {
-        unsigned long content_len = strtoul(content_length, NULL, 10);
-        if (client->buf_len - client->buf_off > 0) {
-            unsigned long len = client->buf_len - client->buf_off;
+    if (body->chunked) {
+        // decoded chunks are re-encoded with their size line prepended, one send per chunk
+        do {
+            ret = http_read_body(client, body, buffer + 16, sizeof(buffer) - 18);
+            if (ret == -1) {
+                res->status = http_get_status(400);
+                print(ERR_STR "Unable to receive request from client: %s" CLR_STR, sock_strerror(client));
+                sprintf(err_msg, "Unable to receive request from client: %s.", sock_strerror(client));
+                return -1;
+            } else if (ret == -2) {
+                res->status = http_get_status(400);
+                print(ERR_STR "Unable to decode chunked request body" CLR_STR);
+                sprintf(err_msg, "Unable to decode chunked request body.");
+                return -1;
+            } else if (ret == -3) {
+                res->status = http_get_status(413);
+                print(ERR_STR "Request body exceeds maximum size of %li bytes" CLR_STR, body->max);
+                return -1;
+            }
+            char chunk_hdr[20];
+            int hdr_len = sprintf(chunk_hdr, "%lX\r\n", ret);
+            char *chunk = buffer + 16 - hdr_len;
+            memcpy(chunk, chunk_hdr, hdr_len);
+            memcpy(buffer + 16 + ret, "\r\n", 2);
+            len = hdr_len + ret + 2;
+            if (sock_send(&rev_proxy, chunk, len, body->done ? 0 : MSG_MORE) != len) {
+                res->status = http_get_status(502);
+                print(ERR_STR "Unable to send request to server (2): %s" CLR_STR, sock_strerror(&rev_proxy));
+                sprintf(err_msg, "Unable to send request to server: %s.", sock_strerror(&rev_proxy));
+                return -1;
+            }
+        } while (ret > 0);
+    } else if (!body->done) {
+        unsigned long content_len = body->len;
+        if (client->buf != NULL && client->buf_len - client->buf_off > 0) {
+            len = (long) (client->buf_len - client->buf_off);
             if (len > content_len) {
-                len = content_len;
+                len = (long) content_len;
             }
-            ret = sock_send(&rev_proxy, client->buf, len, 0);
+            ret = sock_send(&rev_proxy, client->buf + client->buf_off, len, 0);
             if (ret <= 0) {
                 res->status = http_get_status(502);
                 print(ERR_STR "Unable to send request to server (2): %s" CLR_STR, sock_strerror(&rev_proxy));
@@ -148,63 +301,65 @@ int rev_proxy_init(http_req *req, http_res *res, host_config *conf, sock *client
                 return -1;
             }
         }
+        client->buf_off = client->buf_len;
+        body->done = 1;
     }
 
-    ret = sock_recv(&rev_proxy, buffer, sizeof(buffer), MSG_PEEK);
-    if (ret <= 0) {
+    char *buf = malloc(proxy_max_header_size);
+    if (buf == NULL) {
+        res->status = http_get_status(500);
+        print(ERR_STR "Unable to allocate memory: %s" CLR_STR, strerror(errno));
+        return -1;
+    }
+    long header_len = http_receive_header(&rev_proxy, buf, proxy_max_header_size);
+    if (header_len == -1) {
+        free(buf);
         res->status = http_get_status(502);
         print(ERR_STR "Unable to receive response from server: %s" CLR_STR, sock_strerror(&rev_proxy));
         sprintf(err_msg, "Unable to receive response from server: %s.", sock_strerror(&rev_proxy));
+        // the server may have closed the idle connection in the meantime
+        retry = reused && !has_body && tries < 4;
+        if (!reused) upstream_fail(rev_proxy_backend);
         goto proxy_err;
     }
+    upstream_latency(rev_proxy_backend, upstream_time_us() - start);
 
-    char *buf = buffer;
-    unsigned short header_len = (unsigned short) (strstr(buffer, "\r\n\r\n") - buffer + 4);
-
-    if (header_len <= 0) {
+    if (header_len == -2) {
         res->status = http_get_status(502);
         print(ERR_STR "Unable to parse header: End of header not found" CLR_STR);
         sprintf(err_msg, "Unable to parser header: End of header not found.");
-        goto proxy_err;
-    }
-
-    for (int i = 0; i < header_len; i++) {
-        if ((buf[i] >= 0x00 && buf[i] <= 0x1F && buf[i] != '\r' && buf[i] != '\n') || buf[i] == 0x7F) {
-            res->status = http_get_status(502);
-            print(ERR_STR "Unable to parse header: Header contains illegal characters" CLR_STR);
-            sprintf(err_msg, "Unable to parse header: Header contains illegal characters.");
-            goto proxy_err;
-        }
+        goto proxy_hdr_err;
+    } else if (header_len == -3) {
+        res->status = http_get_status(502);
+        print(ERR_STR "Unable to parse header: Header contains illegal characters" CLR_STR);
+        sprintf(err_msg, "Unable to parse header: Header contains illegal characters.");
+        goto proxy_hdr_err;
     }
 
+    int http11 = strncmp(buf, "HTTP/1.1", 8) == 0;
     char *ptr = buf;
-    while (header_len != (ptr - buf)) {
-        char *pos0 = strstr(ptr, "\r\n");
-        if (pos0 == NULL) {
-            res->status = http_get_status(502);
-            print(ERR_STR "Unable to parse header: Invalid header format" CLR_STR);
-            sprintf(err_msg, "Unable to parse header: Invalid header format.");
-            goto proxy_err;
-        }
+    while (header_len > (ptr - buf + 2)) {
+        char *pos0 = memmem(ptr, header_len - (ptr - buf), "\r\n", 2);
         if (ptr == buf) {
-            if (strncmp(ptr, "HTTP/", 5) != 0) {
+            if (pos0 - ptr < 12 || strncmp(ptr, "HTTP/", 5) != 0) {
                 res->status = http_get_status(502);
                 print(ERR_STR "Unable to parse header: Invalid header format" CLR_STR);
                 sprintf(err_msg, "Unable to parse header: Invalid header format.");
-                goto proxy_err;
+                goto proxy_hdr_err;
             }
             int status_code = (int) strtol(ptr + 9, NULL, 10);
             res->status = http_get_status(status_code);
             if (res->status == NULL && status_code >= 100 && status_code <= 999) {
                 custom_status->code = status_code;
                 strcpy(custom_status->type, "");
-                strncpy(custom_status->msg, ptr + 13, strchr(ptr, '\r') - ptr - 13);
+                snprintf(custom_status->msg, sizeof(custom_status->msg), "%.*s",
+                         pos0 - ptr > 13 ? (int) (pos0 - ptr - 13) : 0, ptr + 13);
                 res->status = custom_status;
             } else if (res->status == NULL) {
                 res->status = http_get_status(502);
                 print(ERR_STR "Unable to parse header: Invalid or unknown status code" CLR_STR);
                 sprintf(err_msg, "Unable to parse header: Invalid or unknown status code.");
-                goto proxy_err;
+                goto proxy_hdr_err;
             }
         } else {
             ret = http_parse_header_field(&res->hdr, ptr, pos0);
@@ -212,63 +367,380 @@ int rev_proxy_init(http_req *req, http_res *res, host_config *conf, sock *client
                 res->status = http_get_status(502);
                 print(ERR_STR "Unable to parse header" CLR_STR);
                 sprintf(err_msg, "Unable to parse header.");
-                goto proxy_err;
+                goto proxy_hdr_err;
             }
         }
-        if (pos0[2] == '\r' && pos0[3] == '\n') {
-            break;
-        }
         ptr = pos0 + 2;
     }
-    sock_recv(&rev_proxy, buffer, header_len, 0);
+    free(buf);
+
+    if (res->status->code == 101 && !upgrade) {
+        res->status = http_get_status(502);
+        print(ERR_STR "Unable to parse header: Unexpected protocol switch" CLR_STR);
+        sprintf(err_msg, "Unable to parse header: Unexpected protocol switch.");
+        goto proxy_err;
+    }
+
+    // HTTP/1.1 connections are persistent unless stated otherwise, others only on request;
+    // a body delimited by closing the connection prevents reuse
+    char *connection = http_get_header_field(&res->hdr, "Connection");
+    if (connection == NULL && http11) {
+        http_add_header_field(&res->hdr, "Connection", "keep-alive");
+    }
+    if (http_get_header_field(&res->hdr, "Content-Length") == NULL &&
+        http_get_header_field(&res->hdr, "Transfer-Encoding") == NULL &&
+        res->status->code >= 200 && res->status->code != 204 && res->status->code != 304 &&
+        strcmp(req->method, "HEAD") != 0) {
+        http_remove_header_field(&res->hdr, "Connection", HTTP_REMOVE_ALL);
+        http_add_header_field(&res->hdr, "Connection", "close");
+    }
 
+    upstream_success(rev_proxy_backend);
     return 0;
 
+    proxy_hdr_err:
+    free(buf);
+    goto proxy_err;
+
+    backend_err:
+    // try the remaining servers of the group, the request has not been sent yet
+    upstream_fail(rev_proxy_backend);
+    tried |= 1UL << rev_proxy_backend;
+    for (int i = 0; i < group->num; i++) {
+        if (!(tried & (1UL << group->servers[i]))) retry = 1;
+    }
     proxy_err:
     if (retry) goto retry;
     return -1;
 }
 
-int rev_proxy_send(sock *client, int chunked, unsigned long len_to_send) {
+int rev_proxy_upgrade(const http_req *req) {
+    // Upgrade is only valid if it is listed in Connection as well
+    const char *upgrade = http_get_header_field(&req->hdr, "Upgrade");
+    const char *connection = http_get_header_field(&req->hdr, "Connection");
+    return upgrade != NULL && connection != NULL && strcasestr(connection, "upgrade") != NULL &&
+           strncmp(req->version, "1.1", 3) == 0;
+}
+
+long rev_proxy_relay(sock *client, void *buf, unsigned long len) {
+    // without a client the response is only read, e.g. to update the cache
+    if (client == NULL) return (long) len;
+    return sock_send(client, buf, len, 0);
+}
+
+int rev_proxy_idle() {
+    if (rev_proxy.buf != NULL && rev_proxy.buf_off < rev_proxy.buf_len) return 0;
+    return sock_check(&rev_proxy) == 0;
+}
+
+int rev_proxy_send_chunk(sock *client, char *buf, unsigned long len) {
+    // buf has REV_PROXY_CHUNK_HEADROOM bytes in front and 2 bytes behind reserved for the chunk framing
+    char chunk_header[REV_PROXY_CHUNK_HEADROOM];
+    int header_len = sprintf(chunk_header, "%lX\r\n", len);
+    buf -= header_len;
+    memcpy(buf, chunk_header, header_len);
+    memcpy(buf + header_len + len, "\r\n", 2);
+    len += header_len + 2;
+    if (rev_proxy_relay(client, buf, len) != len) {
+        print(ERR_STR "Unable to send: %s" CLR_STR, sock_strerror(client));
+        return -1;
+    }
+    return 0;
+}
+
+int rev_proxy_send_chunked(sock *client, resp_cache_writer *cache) {
+    char out[REV_PROXY_CHUNK_HEADROOM + REV_PROXY_CHUNK_SIZE + 2];
+    char *data = out + REV_PROXY_CHUNK_HEADROOM;
+    unsigned long len = 0;
     long ret;
+    http_body body = {.chunked = 1, .done = 0, .state = HTTP_CHUNK_SIZE, .size_digits = 0, .len = 0, .total = 0,
+                      .max = 0};
+
+    // the chunks of the server are decoded and sent again as chunks of up to REV_PROXY_CHUNK_SIZE bytes
+    while (!body.done) {
+        ret = http_read_body(&rev_proxy, &body, data + len, REV_PROXY_CHUNK_SIZE - len);
+        if (ret == -1) {
+            print(ERR_STR "Unable to receive: %s" CLR_STR, sock_strerror(&rev_proxy));
+            return -1;
+        } else if (ret < 0) {
+            print(ERR_STR "Unable to decode chunked response body" CLR_STR);
+            return -1;
+        }
+        if (ret > 0) resp_cache_store_write(cache, data + len, ret);
+        len += ret;
+        // data is not held back while the server is idle
+        if (len == REV_PROXY_CHUNK_SIZE || (len > 0 && (body.done || rev_proxy_idle()))) {
+            if (rev_proxy_send_chunk(client, data, len) != 0) return -1;
+            len = 0;
+        }
+    }
+
+    // trailer fields are not forwarded
+    if (rev_proxy_relay(client, "0\r\n\r\n", 5) != 5) {
+        print(ERR_STR "Unable to send: %s" CLR_STR, sock_strerror(client));
+        return -1;
+    }
+    return 0;
+}
+
+int rev_proxy_send(sock *client, int chunked, unsigned long len_to_send, resp_cache_writer *cache) {
     char buffer[CHUNK_SIZE];
-    long len, snd_len;
-    // TODO handle websockets
-    do {
-        if (chunked) {
-            ret = sock_recv(&rev_proxy, buffer, 16, MSG_PEEK);
-            if (ret <= 0) {
-                print("Unable to receive: %s", sock_strerror(&rev_proxy));
-                break;
-            }
+    unsigned long snd_len = 0;
+    long ret;
 
-            len_to_send = strtol(buffer, NULL, 16);
-            char *pos = strstr(buffer, "\r\n");
-            len = pos - buffer + 2;
-            ret = sock_send(client, buffer, len, 0);
+    // the connection may only be reused if the whole response has been relayed
+    if (chunked) {
+        return rev_proxy_send_chunked(client, cache);
+    }
 
-            sock_recv(&rev_proxy, buffer, len, 0);
-            if (ret <= 0) break;
+    // the beginning of the body may have been received together with the header
+    if (rev_proxy.buf != NULL && rev_proxy.buf_off < rev_proxy.buf_len && len_to_send > 0) {
+        ret = (long) (rev_proxy.buf_len - rev_proxy.buf_off);
+        if (ret > len_to_send) ret = (long) len_to_send;
+        if (rev_proxy_relay(client, rev_proxy.buf + rev_proxy.buf_off, ret) != ret) {
+            print(ERR_STR "Unable to send: %s" CLR_STR, sock_strerror(client));
+            return -1;
         }
-        snd_len = 0;
-        while (snd_len < len_to_send) {
-            len = sock_recv(&rev_proxy, buffer, CHUNK_SIZE < (len_to_send - snd_len) ? CHUNK_SIZE : len_to_send - snd_len, 0);
-            ret = sock_send(client, buffer, len, 0);
-            if (ret <= 0) {
-                print(ERR_STR "Unable to send: %s" CLR_STR, sock_strerror(client));
-                break;
+        resp_cache_store_write(cache, rev_proxy.buf + rev_proxy.buf_off, ret);
+        rev_proxy.buf_off += ret;
+        snd_len += ret;
+    }
+
+    if (snd_len < len_to_send && client != NULL && (cache == NULL || cache->file == NULL) &&
+        sock_splice_direct(client, &rev_proxy))
+    {
+        // nothing has to look at the body, let the kernel move it
+        ret = sock_splice(client, &rev_proxy, buffer, sizeof(buffer), len_to_send - snd_len);
+        if (ret == -1 || ret == -3) {
+            print(ERR_STR "Unable to send: %s" CLR_STR, sock_strerror(client));
+            return -1;
+        } else if (ret < 0) {
+            print(ERR_STR "Unable to receive: %s" CLR_STR, sock_strerror(&rev_proxy));
+            return -1;
+        }
+        return 0;
+    }
+
+    while (snd_len < len_to_send) {
+        ret = sock_recv(&rev_proxy, buffer, CHUNK_SIZE < (len_to_send - snd_len) ? CHUNK_SIZE : len_to_send - snd_len, 0);
+        if (ret <= 0) {
+            print(ERR_STR "Unable to receive: %s" CLR_STR, sock_strerror(&rev_proxy));
+            return -1;
+        }
+        if (rev_proxy_relay(client, buffer, ret) != ret) {
+            print(ERR_STR "Unable to send: %s" CLR_STR, sock_strerror(client));
+            return -1;
+        }
+        resp_cache_store_write(cache, buffer, ret);
+        snd_len += ret;
+    }
+    return 0;
+}
+
+int rev_proxy_send_compressed(sock *client, int chunked, unsigned long len_to_send, compress_ctx *comp, int flush,
+                              resp_cache_writer *cache) {
+    char in[CHUNK_SIZE];
+    char out[REV_PROXY_CHUNK_HEADROOM + REV_PROXY_CHUNK_SIZE + 2];
+    char *data = out + REV_PROXY_CHUNK_HEADROOM;
+    const char *ptr;
+    unsigned long len;
+    long ret;
+    int op, pending;
+    http_body body = {.chunked = chunked, .done = !chunked && len_to_send == 0, .state = HTTP_CHUNK_SIZE,
+                      .size_digits = 0, .len = len_to_send, .total = 0, .max = 0};
+
+    // the body of the server is sent compressed as chunks, the cache gets the uncompressed body
+    do {
+        len = 0;
+        if (!body.done) {
+            ret = http_read_body(&rev_proxy, &body, in, sizeof(in));
+            if (ret == -1) {
+                print(ERR_STR "Unable to receive: %s" CLR_STR, sock_strerror(&rev_proxy));
+                return -1;
+            } else if (ret < 0) {
+                print(ERR_STR "Unable to decode chunked response body" CLR_STR);
+                return -1;
             }
-            snd_len += ret;
+            if (ret > 0) resp_cache_store_write(cache, in, ret);
+            len = ret;
         }
-        if (ret <= 0) break;
-        if (chunked) {
-            sock_recv(&rev_proxy, buffer, 2, 0);
-            ret = sock_send(client, "\r\n", 2, 0);
-            if (ret <= 0) {
-                print(ERR_STR "Unable to send: %s" CLR_STR, sock_strerror(client));
-                break;
+
+        if (body.done) {
+            op = COMPRESS_OP_FINISH;
+        } else if (flush == COMPRESS_FLUSH_RECORD || (flush == COMPRESS_FLUSH_IDLE && rev_proxy_idle())) {
+            op = COMPRESS_OP_FLUSH;
+        } else {
+            op = COMPRESS_OP_PROCESS;
+        }
+
+        ptr = in;
+        do {
+            ret = compress_stream(comp, &ptr, &len, data, REV_PROXY_CHUNK_SIZE, op, &pending);
+            if (ret < 0) {
+                print(ERR_STR "Unable to compress response (%s)" CLR_STR, compress_encoding(comp->type));
+                return -1;
             }
+            if (ret > 0 && rev_proxy_send_chunk(client, data, ret) != 0) return -1;
+        } while (len > 0 || pending);
+    } while (op != COMPRESS_OP_FINISH);
+
+    if (rev_proxy_relay(client, "0\r\n\r\n", 5) != 5) {
+        print(ERR_STR "Unable to send: %s" CLR_STR, sock_strerror(client));
+        return -1;
+    }
+    return 0;
+}
+
+int rev_proxy_buffer(spool *s) {
+    http_body body = {.chunked = 1, .done = 0, .state = HTTP_CHUNK_SIZE, .size_digits = 0, .len = 0, .total = 0,
+                      .max = 0};
+    long ret = http_buffer_body(&rev_proxy, &body, s);
+    if (ret == -1) {
+        print(ERR_STR "Unable to receive: %s" CLR_STR, sock_strerror(&rev_proxy));
+        return -1;
+    } else if (ret == -4) {
+        print(ERR_STR "Unable to buffer response body: %s" CLR_STR, strerror(errno));
+        return -1;
+    } else if (ret < 0) {
+        print(ERR_STR "Unable to decode chunked response body" CLR_STR);
+        return -1;
+    }
+    metrics_inc(resp_body_buffered);
+    metrics_add(resp_body_buffered_bytes, spool_len(s));
+    if (s->file_len > 0) {
+        metrics_inc(resp_body_spooled);
+        metrics_add(resp_body_spooled_bytes, s->file_len);
+    }
+    return 0;
+}
+
+int rev_proxy_send_spool(sock *client, spool *s, resp_cache_writer *cache) {
+    char buffer[REV_PROXY_CHUNK_SIZE];
+    long ret;
+    while ((ret = spool_read(s, buffer, sizeof(buffer))) != 0) {
+        if (ret < 0) {
+            print(ERR_STR "Unable to read buffered response body: %s" CLR_STR, strerror(errno));
+            return -1;
         }
-    } while (chunked && len_to_send > 0);
+        resp_cache_store_write(cache, buffer, ret);
+        if (sock_send(client, buffer, ret, 0) != ret) {
+            print(ERR_STR "Unable to send: %s" CLR_STR, sock_strerror(client));
+            return -1;
+        }
+    }
     return 0;
 }
+
+int rev_proxy_cache_find(unsigned char *key, const http_req *req, const char *host, resp_cache_entry *entry) {
+    resp_cache_key(key, req, host, NULL);
+    if (resp_cache_find(key, entry) != 0) return 1;
+    if (entry->state == RESP_CACHE_VARY) {
+        resp_cache_key(key, req, host, entry->vary);
+        if (resp_cache_find(key, entry) != 0) return 1;
+    }
+    return entry->state == RESP_CACHE_VALID ? 0 : 1;
+}
+
+int rev_proxy_cache_store(resp_cache_writer *w, const http_req *req, const http_res *res, const char *host) {
+    unsigned char key[SHA_DIGEST_LENGTH];
+    resp_cache_policy policy;
+
+    if (resp_cache_parse_policy(res, &policy) != 0 || policy.ttl - policy.age <= 0) {
+        return -1;
+    }
+
+    // the primary key points to the request headers that select a variant
+    resp_cache_key(key, req, host, NULL);
+    const char *vary = http_get_header_field(&res->hdr, "Vary");
+    if (vary != NULL) {
+        unsigned int stale = policy.stale_revalidate > policy.stale_error ? policy.stale_revalidate : policy.stale_error;
+        if (resp_cache_store_vary(key, vary, time(NULL) + policy.ttl - policy.age + stale) != 0) return -1;
+        resp_cache_key(key, req, host, vary);
+    }
+
+    if (resp_cache_store_init(w, key, res, policy.ttl - policy.age) != 0) return -1;
+    return resp_cache_store_policy(w, &policy);
+}
+
+int rev_proxy_cache_refresh(const resp_cache_entry *entry, const http_res *not_modified) {
+    // the freshness of the stored response is recalculated with the header fields of the 304 response
+    const char *fields[] = {"Cache-Control", "Expires", "Date", "Age", "ETag", "Last-Modified", "Vary"};
+    resp_cache_policy policy;
+    http_res res;
+    FILE *file = NULL;
+    long len;
+    int ret;
+
+    res.hdr.field_num = 0;
+    if (resp_cache_open(entry, &res, &file, &len) != 0) return -1;
+    fclose(file);
+    for (int i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        const char *value = http_get_header_field(&not_modified->hdr, fields[i]);
+        if (value == NULL) continue;
+        http_remove_header_field(&res.hdr, fields[i], HTTP_REMOVE_ALL);
+        http_add_header_field(&res.hdr, fields[i], value);
+    }
+    ret = resp_cache_parse_policy(&res, &policy);
+    if (ret == 0) ret = resp_cache_refresh(entry->key, &policy);
+    http_free_res(&res);
+    return ret;
+}
+
+int rev_proxy_revalidate(http_req *req, host_config *conf, const resp_cache_entry *entry, const char *host) {
+    resp_cache_writer cache_w = {.file = NULL};
+    http_body body = {.chunked = 0, .done = 1};
+    http_status custom_status;
+    char buf[256], err_msg[256];
+    http_res res;
+    int ret;
+
+    print(BLUE_STR "Revalidating cached response" CLR_STR);
+    strcpy(req->method, "GET");
+    http_remove_header_field(&req->hdr, "If-None-Match", HTTP_REMOVE_ALL);
+    http_remove_header_field(&req->hdr, "If-Modified-Since", HTTP_REMOVE_ALL);
+    http_remove_header_field(&req->hdr, "Range", HTTP_REMOVE_ALL);
+    if (entry->etag[0] != 0) {
+        http_add_header_field(&req->hdr, "If-None-Match", entry->etag);
+    }
+    if (entry->last_modified >= 0) {
+        http_add_header_field(&req->hdr, "If-Modified-Since", http_format_date(entry->last_modified, buf, sizeof(buf)));
+    }
+
+    sprintf(res.version, "1.1");
+    res.hdr.field_num = 0;
+    ret = rev_proxy_init(req, &res, conf, NULL, &body, &custom_status, err_msg);
+    if (ret != 0) {
+        rev_proxy_release(0);
+        resp_cache_unclaim(entry->key);
+        http_free_res(&res);
+        return -1;
+    }
+
+    const char *connection = http_get_header_field(&res.hdr, "Connection");
+    int reuse = connection != NULL && strcasecmp(connection, "keep-alive") == 0;
+    if (res.status->code == 304) {
+        ret = rev_proxy_cache_refresh(entry, &res);
+        metrics_inc(proxy_cache_revalidated);
+    } else {
+        const char *transfer_encoding = http_get_header_field(&res.hdr, "Transfer-Encoding");
+        const char *content_length = http_get_header_field(&res.hdr, "Content-Length");
+        int chunked = transfer_encoding != NULL && strcmp(transfer_encoding, "chunked") == 0;
+        rev_proxy_cache_store(&cache_w, req, &res, host);
+        if (chunked || content_length != NULL) {
+            ret = rev_proxy_send(NULL, chunked, content_length != NULL ? strtoul(content_length, NULL, 10) : 0, &cache_w);
+        } else {
+            ret = -1;
+        }
+        if (ret != 0) {
+            reuse = 0;
+        } else if (resp_cache_store_commit(&cache_w) == 0) {
+            metrics_inc(proxy_cache_stores);
+        }
+        resp_cache_store_abort(&cache_w);
+    }
+    // an unchanged or uncacheable response leaves the entry as it is
+    resp_cache_unclaim(entry->key);
+    rev_proxy_release(reuse);
+    http_free_res(&res);
+    return ret;
+}
@@ -8,4 +8,63 @@
 #ifndef NECRONDA_SERVER_REV_PROXY_H
 #define NECRONDA_SERVER_REV_PROXY_H
 
+#define REV_PROXY_MAX_IDLE 4
+#define REV_PROXY_IDLE_TIMEOUT 4
+#define REV_PROXY_CHUNK_HEADROOM 16
+// a full chunk including its size line and CRLF fills exactly one TLS record
+#define REV_PROXY_CHUNK_SIZE (16384 - 8)
+
+#include "necronda-server.h"
+#include "config.h"
+#include "sock.h"
+#include "http.h"
+#include "dns.h"
+#include "resp_cache.h"
+#include "spool.h"
+
+#include <time.h>
+
+
+typedef struct {
+    sock sock;
+    int backend;
+    time_t idle_since;
+} rev_proxy_pool_conn;
+
+rev_proxy_pool_conn rev_proxy_pool[REV_PROXY_MAX_IDLE];
+
+int rev_proxy_pool_get(int backend, int enc, sock *s);
+
+void rev_proxy_pool_put(int backend, sock *s);
+
+int rev_proxy_pool_idle();
+
+void rev_proxy_pool_close();
+
+void rev_proxy_release(int reuse);
+
+int rev_proxy_init(http_req *req, http_res *res, host_config *conf, sock *client, http_body *body,
+                   http_status *custom_status, char * err_msg);
+
+int rev_proxy_upgrade(const http_req *req);
+
+int rev_proxy_idle();
+
+int rev_proxy_send(sock *client, int chunked, unsigned long len_to_send, resp_cache_writer *cache);
+
+int rev_proxy_send_compressed(sock *client, int chunked, unsigned long len_to_send, compress_ctx *comp, int flush,
+                              resp_cache_writer *cache);
+
+int rev_proxy_buffer(spool *s);
+
+int rev_proxy_send_spool(sock *client, spool *s, resp_cache_writer *cache);
+
+int rev_proxy_cache_find(unsigned char *key, const http_req *req, const char *host, resp_cache_entry *entry);
+
+int rev_proxy_cache_store(resp_cache_writer *w, const http_req *req, const http_res *res, const char *host);
+
+int rev_proxy_cache_refresh(const resp_cache_entry *entry, const http_res *not_modified);
+
+int rev_proxy_revalidate(http_req *req, host_config *conf, const resp_cache_entry *entry, const char *host);
+
 #endif //NECRONDA_SERVER_REV_PROXY_H
@@ -0,0 +1,60 @@
+/**
+ * Necronda Web Server
+ * Ring buffer for socket reads
+ * src/ringbuf.c
+ * Lorenz Stechauner, 2021-02-14
+ */
+
+#include "ringbuf.h"
+
+
+int ringbuf_init(ringbuf *r, unsigned long size) {
+    r->buf = malloc(size);
+    if (r->buf == NULL) return -1;
+    r->size = size;
+    r->start = 0;
+    r->len = 0;
+    return 0;
+}
+
+long ringbuf_recv(ringbuf *r, int fd, int flags) {
+    if (r->len == 0) {
+        // maximize the contiguous free space
+        r->start = 0;
+    }
+    unsigned long end = (r->start + r->len) % r->size;
+    unsigned long free_len = end >= r->start ? r->size - end : r->start - end;
+    if (r->len == r->size) free_len = 0;
+    if (free_len == 0) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    long ret = recv(fd, r->buf + end, free_len, flags);
+    if (ret > 0) r->len += ret;
+    return ret;
+}
+
+unsigned long ringbuf_data(const ringbuf *r, char **ptr) {
+    *ptr = r->buf + r->start;
+    return r->start + r->len > r->size ? r->size - r->start : r->len;
+}
+
+unsigned long ringbuf_copy(const ringbuf *r, void *dst, unsigned long len) {
+    if (len > r->len) len = r->len;
+    unsigned long first = r->size - r->start < len ? r->size - r->start : len;
+    memcpy(dst, r->buf + r->start, first);
+    memcpy((char *) dst + first, r->buf, len - first);
+    return len;
+}
+
+void ringbuf_consume(ringbuf *r, unsigned long len) {
+    if (len > r->len) len = r->len;
+    r->start = (r->start + len) % r->size;
+    r->len -= len;
+}
+
+void ringbuf_free(ringbuf *r) {
+    if (r->buf != NULL) free(r->buf);
+    r->buf = NULL;
+    r->len = 0;
+}
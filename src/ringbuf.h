@@ -0,0 +1,33 @@
+/**
+ * Necronda Web Server
+ * Ring buffer for socket reads (header file)
+ * src/ringbuf.h
+ * Lorenz Stechauner, 2021-02-14
+ */
+
+#ifndef NECRONDA_SERVER_RINGBUF_H
+#define NECRONDA_SERVER_RINGBUF_H
+
+#include <sys/socket.h>
+
+
+typedef struct {
+    char *buf;
+    unsigned long size;
+    unsigned long start;
+    unsigned long len;
+} ringbuf;
+
+int ringbuf_init(ringbuf *r, unsigned long size);
+
+long ringbuf_recv(ringbuf *r, int fd, int flags);
+
+unsigned long ringbuf_data(const ringbuf *r, char **ptr);
+
+unsigned long ringbuf_copy(const ringbuf *r, void *dst, unsigned long len);
+
+void ringbuf_consume(ringbuf *r, unsigned long len);
+
+void ringbuf_free(ringbuf *r);
+
+#endif //NECRONDA_SERVER_RINGBUF_H
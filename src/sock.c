@@ -45,14 +45,20 @@ const char *sock_strerror(sock *s) {
 
 long sock_send(sock *s, void *buf, unsigned long len, int flags) {
     long ret;
-    if (s->enc) {
-        ret = SSL_write(s->ssl, buf, (int) len);
-    } else {
-        ret = send(s->socket, buf, len, flags);
-    }
-    s->_last_ret = ret;
-    s->_errno = errno;
-    s->_ssl_error = ERR_get_error();
+    unsigned long snd_len = 0;
+    // SSL_MODE_ENABLE_PARTIAL_WRITE and signals may lead to short writes
+    do {
+        if (s->enc) {
+            ret = SSL_write(s->ssl, (char *) buf + snd_len, (int) (len - snd_len));
+        } else {
+            ret = send(s->socket, (char *) buf + snd_len, len - snd_len, flags);
+        }
+        s->_last_ret = ret;
+        s->_errno = errno;
+        s->_ssl_error = ERR_get_error();
+        if (ret > 0) snd_len += ret;
+    } while (ret > 0 && snd_len < len);
+    if (snd_len > 0) return (long) snd_len;
     return ret >= 0 ? ret : -1;
 }
 
@@ -73,14 +79,68 @@ long sock_recv(sock *s, void *buf, unsigned long len, int flags) {
     return ret >= 0 ? ret : -1;
 }
 
+int sock_splice_direct(sock *dst, sock *src) {
+    // the kernel can only move data it does not have to decrypt, and may only encrypt it with kTLS
+    if (!SOCK_SPLICE || src->enc) return 0;
+    if (dst->enc && (dst->ssl == NULL || !BIO_get_ktls_send(SSL_get_wbio(dst->ssl)))) return 0;
+    return 1;
+}
+
+static void sock_pipe_close() {
+    // data may be left in the pipe after an error
+    if (sock_pipe[0] != -1) close(sock_pipe[0]);
+    if (sock_pipe[1] != -1) close(sock_pipe[1]);
+    sock_pipe[0] = -1;
+    sock_pipe[1] = -1;
+}
+
+static long sock_splice_pipe(sock *dst, sock *src, unsigned long len) {
+    long ret;
+    unsigned long send_len = 0;
+    unsigned long next_len;
+    if (sock_pipe[0] == -1) {
+        if (pipe2(sock_pipe, O_CLOEXEC) != 0) return -4;
+        fcntl(sock_pipe[0], F_SETPIPE_SZ, SOCK_PIPE_SIZE);
+    }
+    while (send_len < len) {
+        next_len = (SOCK_PIPE_SIZE < (len - send_len)) ? SOCK_PIPE_SIZE : (len - send_len);
+        ret = splice(src->socket, NULL, sock_pipe[1], NULL, next_len, SPLICE_F_MOVE | SPLICE_F_MORE);
+        src->_last_ret = ret;
+        src->_errno = errno;
+        src->_ssl_error = 0;
+        if (ret < 0 && send_len == 0 && (errno == EINVAL || errno == ENOSYS)) return -4;
+        if (ret <= 0) return -2;
+        next_len = ret;
+        while (next_len > 0) {
+            ret = splice(sock_pipe[0], NULL, dst->socket, NULL, next_len,
+                         SPLICE_F_MOVE | (send_len + next_len < len ? SPLICE_F_MORE : 0));
+            dst->_last_ret = ret;
+            dst->_errno = errno;
+            dst->_ssl_error = 0;
+            if (ret <= 0) {
+                sock_pipe_close();
+                return -1;
+            }
+            next_len -= ret;
+            send_len += ret;
+        }
+    }
+    return (long) send_len;
+}
+
 long sock_splice(sock *dst, sock *src, void *buf, unsigned long buf_len, unsigned long len) {
     long ret;
     unsigned long send_len = 0;
     unsigned long next_len;
+    if (sock_splice_direct(dst, src)) {
+        // zero-copy through a pipe, falls back to the buffer if the sockets do not support splice
+        ret = sock_splice_pipe(dst, src, len);
+        if (ret != -4) return ret;
+    }
     while (send_len < len) {
         next_len = (buf_len < (len - send_len)) ? buf_len : (len - send_len);
         ret = sock_recv(src, buf, next_len, 0);
-        if (ret < 0) return -2;
+        if (ret <= 0) return -2;
         next_len = ret;
         ret = sock_send(dst, buf, next_len, send_len + next_len < len ? MSG_MORE : 0);
         if (ret < 0) return -1;
@@ -91,6 +151,8 @@ long sock_splice(sock *dst, sock *src, void *buf, unsigned long buf_len, unsigne
 }
 
 int sock_close(sock *s) {
+    // the connection may have been passed on to another process
+    if (s->socket == 0) return 0;
     if ((int) s->enc && s->ssl != NULL) {
         SSL_shutdown(s->ssl);
         SSL_free(s->ssl);
@@ -104,6 +166,9 @@ int sock_close(sock *s) {
 }
 
 int sock_check(sock *s) {
-    char buf;
-    return recv(s->socket, &buf, 1, MSG_PEEK | MSG_DONTWAIT) == 1;
+    // an idle connection must neither have pending data nor be closed by the peer
+    if (s->enc && s->ssl != NULL && SSL_pending(s->ssl) > 0) return 1;
+    struct pollfd fds = {.fd = s->socket, .events = POLLIN | POLLRDHUP};
+    int ret = poll(&fds, 1, 0);
+    return ret != 0;
 }
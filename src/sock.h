@@ -8,12 +8,21 @@
 #ifndef NECRONDA_SERVER_SOCK_H
 #define NECRONDA_SERVER_SOCK_H
 
+#define SOCK_PIPE_SIZE 65536
+
+#ifndef SOCK_SPLICE
+// -D SOCK_SPLICE=0 always copies through a buffer, to compare both in benchmarks
+#define SOCK_SPLICE 1
+#endif
+
 #include <openssl/err.h>
 #include <openssl/pem.h>
 #include <openssl/ssl.h>
 #include <openssl/conf.h>
 #include <openssl/engine.h>
 #include <openssl/dh.h>
+#include <poll.h>
+#include <fcntl.h>
 
 typedef struct {
     unsigned int enc:1;
@@ -28,12 +37,16 @@ typedef struct {
     unsigned long _ssl_error;
 } sock;
 
+int sock_pipe[2] = {-1, -1};
+
 const char *sock_strerror(sock *s);
 
 long sock_send(sock *s, void *buf, unsigned long len, int flags);
 
 long sock_recv(sock *s, void *buf, unsigned long len, int flags);
 
+int sock_splice_direct(sock *dst, sock *src);
+
 long sock_splice(sock *dst, sock *src, void *buf, unsigned long buf_len, unsigned long len);
 
 int sock_close(sock *s);
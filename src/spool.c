@@ -0,0 +1,93 @@
+/**
+ * Necronda Web Server
+ * Memory buffer with temporary file overflow
+ * src/spool.c
+ * Lorenz Stechauner, 2021-01-24
+ */
+
+#include "spool.h"
+
+
+int spool_open_file() {
+    int fd = open(SPOOL_DIR, O_TMPFILE | O_RDWR | O_EXCL, 0600);
+    if (fd < 0 && (errno == EOPNOTSUPP || errno == EISDIR || errno == EINVAL)) {
+        // file system without O_TMPFILE support
+        char filename[256];
+        sprintf(filename, "%s/necronda-spool-XXXXXX", SPOOL_DIR);
+        fd = mkstemp(filename);
+        if (fd >= 0) unlink(filename);
+    }
+    return fd;
+}
+
+int spool_init(spool *s, unsigned long max_mem) {
+    s->buf = NULL;
+    s->buf_len = 0;
+    s->buf_size = 0;
+    s->max_mem = max_mem;
+    s->fd = -1;
+    s->file_len = 0;
+    s->off = 0;
+    return 0;
+}
+
+long spool_write(spool *s, const void *buf, unsigned long len) {
+    unsigned long mem_len = 0;
+    if (s->fd < 0 && s->buf_len < s->max_mem) {
+        mem_len = s->max_mem - s->buf_len;
+        if (mem_len > len) mem_len = len;
+        if (s->buf_len + mem_len > s->buf_size) {
+            unsigned long size = s->buf_size == 0 ? CHUNK_SIZE : s->buf_size;
+            while (size < s->buf_len + mem_len) size *= 2;
+            if (size > s->max_mem) size = s->max_mem;
+            char *new_buf = realloc(s->buf, size);
+            if (new_buf == NULL) return -1;
+            s->buf = new_buf;
+            s->buf_size = size;
+        }
+        memcpy(s->buf + s->buf_len, buf, mem_len);
+        s->buf_len += mem_len;
+    }
+
+    if (mem_len < len) {
+        if (s->fd < 0) {
+            s->fd = spool_open_file();
+            if (s->fd < 0) return -2;
+        }
+        unsigned long file_len = 0;
+        while (file_len < len - mem_len) {
+            long ret = pwrite(s->fd, (char *) buf + mem_len + file_len, len - mem_len - file_len,
+                              (off_t) (s->file_len + file_len));
+            if (ret < 0) return -2;
+            file_len += ret;
+        }
+        s->file_len += file_len;
+    }
+    return (long) len;
+}
+
+long spool_read(spool *s, void *buf, unsigned long len) {
+    if (s->off < s->buf_len) {
+        unsigned long mem_len = s->buf_len - s->off;
+        if (mem_len > len) mem_len = len;
+        memcpy(buf, s->buf + s->off, mem_len);
+        s->off += mem_len;
+        return (long) mem_len;
+    } else if (s->off < s->buf_len + s->file_len) {
+        long ret = pread(s->fd, buf, len, (off_t) (s->off - s->buf_len));
+        if (ret < 0) return -1;
+        s->off += ret;
+        return ret;
+    }
+    return 0;
+}
+
+unsigned long spool_len(const spool *s) {
+    return s->buf_len + s->file_len;
+}
+
+void spool_free(spool *s) {
+    if (s->buf != NULL) free(s->buf);
+    if (s->fd >= 0) close(s->fd);
+    spool_init(s, s->max_mem);
+}
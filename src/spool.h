@@ -0,0 +1,39 @@
+/**
+ * Necronda Web Server
+ * Memory buffer with temporary file overflow (header file)
+ * src/spool.h
+ * Lorenz Stechauner, 2021-01-24
+ */
+
+#ifndef NECRONDA_SERVER_SPOOL_H
+#define NECRONDA_SERVER_SPOOL_H
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifndef SPOOL_DIR
+#define SPOOL_DIR "/var/tmp"
+#endif
+
+
+typedef struct {
+    char *buf;
+    unsigned long buf_len;
+    unsigned long buf_size;
+    unsigned long max_mem;
+    int fd;
+    unsigned long file_len;
+    unsigned long off;
+} spool;
+
+int spool_init(spool *s, unsigned long max_mem);
+
+long spool_write(spool *s, const void *buf, unsigned long len);
+
+long spool_read(spool *s, void *buf, unsigned long len);
+
+unsigned long spool_len(const spool *s);
+
+void spool_free(spool *s);
+
+#endif //NECRONDA_SERVER_SPOOL_H
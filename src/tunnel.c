@@ -0,0 +1,444 @@
+/**
+ * Necronda Web Server
+ * Tunnels of upgraded connections
+ * src/tunnel.c
+ * Lorenz Stechauner, 2021-03-14
+ */
+
+#include "tunnel.h"
+
+
+time_t tunnel_time() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+int tunnel_ws_track(tunnel_ws *ws, const unsigned char *buf, unsigned long len) {
+    while (len > 0) {
+        if (ws->left > 0) {
+            unsigned long n = ws->left < len ? ws->left : len;
+            ws->left -= n;
+            buf += n;
+            len -= n;
+            continue;
+        }
+        ws->hdr[ws->hdr_len++] = *buf++;
+        len--;
+        if (ws->hdr_len < 2) continue;
+        unsigned char payload_len = ws->hdr[1] & 0x7F;
+        int need = 2 + (payload_len == 126 ? 2 : payload_len == 127 ? 8 : 0) + ((ws->hdr[1] & 0x80) ? 4 : 0);
+        if (ws->hdr_len < need) continue;
+        if (payload_len == 126) {
+            ws->left = ((unsigned long long) ws->hdr[2] << 8) | ws->hdr[3];
+        } else if (payload_len == 127) {
+            ws->left = 0;
+            for (int i = 2; i < 10; i++) ws->left = (ws->left << 8) | ws->hdr[i];
+        } else {
+            ws->left = payload_len;
+        }
+        ws->hdr_len = 0;
+    }
+    // pings may only be inserted between two frames
+    return ws->left == 0 && ws->hdr_len == 0;
+}
+
+int tunnel_kernel(sock *s) {
+    // a socket may only be passed on if the kernel handles TLS in both directions
+    if (!s->enc) return 1;
+    return s->ssl != NULL && SSL_pending(s->ssl) == 0 &&
+           BIO_get_ktls_send(SSL_get_wbio(s->ssl)) && BIO_get_ktls_recv(SSL_get_rbio(s->ssl));
+}
+
+int tunnel_handoff(sock *client, sock *server, int websocket) {
+    if (tunnel_socket[0] == -1 || !tunnel_kernel(client) || !tunnel_kernel(server)) return -1;
+
+    char flag = (char) websocket;
+    int fds[2] = {client->socket, server->socket};
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } ctrl;
+    struct iovec iov = {.iov_base = &flag, .iov_len = 1};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctrl.buf, .msg_controllen = sizeof(ctrl.buf)};
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    if (sendmsg(tunnel_socket[0], &msg, MSG_DONTWAIT | MSG_NOSIGNAL) != 1) {
+        print(ERR_STR "Unable to pass tunnel on: %s" CLR_STR, strerror(errno));
+        return -1;
+    }
+
+    // the connections belong to the tunnel process now and must not be shut down here
+    sock *socks[2] = {client, server};
+    for (int i = 0; i < 2; i++) {
+        if (socks[i]->enc && socks[i]->ssl != NULL) SSL_free(socks[i]->ssl);
+        close(socks[i]->socket);
+        socks[i]->socket = 0;
+        socks[i]->ssl = NULL;
+        socks[i]->enc = 0;
+    }
+    return 0;
+}
+
+int tunnel_relay(sock *client, sock *server, int websocket) {
+    sock *socks[2] = {client, server};
+    char buf[TUNNEL_BUF_SIZE];
+    tunnel_ws ws = {.left = 0, .hdr_len = 0};
+    time_t last_active = tunnel_time(), last_ping = 0, now;
+    long ret;
+
+    while (1) {
+        struct pollfd fds[2] = {
+                {.fd = client->socket, .events = POLLIN},
+                {.fd = server->socket, .events = POLLIN},
+        };
+        int pending = (client->enc && SSL_pending(client->ssl) > 0) || (server->enc && SSL_pending(server->ssl) > 0);
+        ret = poll(fds, 2, pending ? 0 : 1000);
+        if (ret < 0 && errno == EINTR) {
+            // the server is shutting down
+            return 0;
+        } else if (ret < 0) {
+            print(ERR_STR "Unable to poll tunnel: %s" CLR_STR, strerror(errno));
+            return -1;
+        }
+
+        now = tunnel_time();
+        for (int i = 0; i < 2; i++) {
+            if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR)) &&
+                !(socks[i]->enc && SSL_pending(socks[i]->ssl) > 0)) {
+                continue;
+            }
+            ret = sock_recv(socks[i], buf, sizeof(buf), 0);
+            if (ret <= 0) return 0;
+            last_active = now;
+            if (i == 1 && websocket) tunnel_ws_track(&ws, (unsigned char *) buf, ret);
+            if (sock_send(socks[1 - i], buf, ret, 0) != ret) {
+                print(ERR_STR "Unable to send: %s" CLR_STR, sock_strerror(socks[1 - i]));
+                return -1;
+            }
+        }
+
+        if (now - last_active >= tunnel_timeout) {
+            print("Tunnel idle for %li seconds", now - last_active);
+            return 0;
+        }
+        if (websocket && websocket_ping != 0 && now - last_active >= websocket_ping &&
+            now - last_ping >= websocket_ping && ws.left == 0 && ws.hdr_len == 0) {
+            // the pong of the client counts as activity, the server ignores it
+            if (sock_send(client, "\x89\x00", 2, 0) != 2) return -1;
+            last_ping = now;
+        }
+    }
+}
+
+unsigned long tunnel_event_data(int i, int s) {
+    return ((unsigned long) tunnels[i].gen << 32) | ((unsigned long) i << 1) | s;
+}
+
+void tunnel_close(int i) {
+    tunnel *t = &tunnels[i];
+    char buf[TUNNEL_BUF_SIZE];
+    for (int s = 0; s < 2; s++) {
+        // unread data would make the kernel reset the connection and discard what the peer did not read yet
+        for (int n = 0; n < 16 && recv(t->fd[s], buf, sizeof(buf), MSG_DONTWAIT) > 0; n++);
+        shutdown(t->fd[s], SHUT_RDWR);
+        close(t->fd[s]);
+        t->fd[s] = -1;
+        free(t->pending[s]);
+        t->pending[s] = NULL;
+    }
+    t->gen++;
+    metrics_add(tunnels_active, -1);
+}
+
+void tunnel_update(int i) {
+    tunnel *t = &tunnels[i];
+    for (int s = 0; s < 2; s++) {
+        if (t->hup & (1 << s)) continue;
+        // a side is only read from if the other one is able to take the data
+        struct epoll_event ev = {.events = 0, .data.u64 = tunnel_event_data(i, s)};
+        if (t->pending[1 - s] == NULL && !(t->eof & (1 << s)) && !(t->hup & (1 << (1 - s))))
+            ev.events |= EPOLLIN | EPOLLRDHUP;
+        if (t->pending[s] != NULL) ev.events |= EPOLLOUT;
+        epoll_ctl(tunnel_epoll, EPOLL_CTL_MOD, t->fd[s], &ev);
+    }
+}
+
+int tunnel_done(tunnel *t) {
+    // a side is finished once everything it sent has been passed on,
+    // the tunnel once both are or a hung up one is
+    int finished = 0;
+    for (int s = 0; s < 2; s++) {
+        if (!(t->eof & (1 << s)) || (t->pending[1 - s] != NULL && !(t->hup & (1 << (1 - s))))) continue;
+        if (t->hup & (1 << s)) return 1;
+        finished++;
+    }
+    return finished == 2;
+}
+
+int tunnel_write(tunnel *t, int s, const char *buf, unsigned long len) {
+    long ret = send(t->fd[s], buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+    if (ret < 0) ret = 0;
+    if (ret < len) {
+        t->pending[s] = malloc(len - ret);
+        if (t->pending[s] == NULL) return -1;
+        memcpy(t->pending[s], buf + ret, len - ret);
+        t->pending_len[s] = len - ret;
+        t->pending_off[s] = 0;
+    }
+    return 0;
+}
+
+int tunnel_flush(tunnel *t, int s) {
+    long ret = send(t->fd[s], t->pending[s] + t->pending_off[s], t->pending_len[s] - t->pending_off[s],
+                    MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+    if (ret < 0) return 0;
+    t->pending_off[s] += ret;
+    if (t->pending_off[s] == t->pending_len[s]) {
+        free(t->pending[s]);
+        t->pending[s] = NULL;
+        // the end of data follows the data
+        if (t->eof & (1 << (1 - s))) shutdown(t->fd[s], SHUT_WR);
+    }
+    return 0;
+}
+
+int tunnel_append(tunnel *t, int s, const char *buf, unsigned long len) {
+    if (t->pending[s] == NULL) return tunnel_write(t, s, buf, len);
+    char *ptr = realloc(t->pending[s], t->pending_len[s] + len);
+    if (ptr == NULL) return -1;
+    memcpy(ptr + t->pending_len[s], buf, len);
+    t->pending[s] = ptr;
+    t->pending_len[s] += len;
+    return 0;
+}
+
+int tunnel_drain(tunnel *t, int s) {
+    // data still buffered on a hung up side is passed on before the tunnel is closed
+    char buf[TUNNEL_BUF_SIZE];
+    long ret;
+    while (!(t->eof & (1 << s)) && !(t->hup & (1 << (1 - s))) &&
+           (ret = recv(t->fd[s], buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+        if (tunnel_append(t, 1 - s, buf, ret) != 0) return -1;
+    }
+    epoll_ctl(tunnel_epoll, EPOLL_CTL_DEL, t->fd[s], NULL);
+    t->eof |= 1 << s;
+    t->hup |= 1 << s;
+    free(t->pending[s]);
+    t->pending[s] = NULL;
+    return 0;
+}
+
+int tunnel_read(tunnel *t, int s, time_t now) {
+    char buf[TUNNEL_BUF_SIZE];
+    long ret = recv(t->fd[s], buf, sizeof(buf), MSG_DONTWAIT);
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+    if (ret < 0) return -1;
+    if (ret == 0) {
+        // half-close: the other side may still send, this one gets the end after the pending data
+        t->eof |= 1 << s;
+        if (t->pending[1 - s] == NULL) shutdown(t->fd[1 - s], SHUT_WR);
+        return 0;
+    }
+    t->last_active = now;
+    if (s == 1 && t->websocket) tunnel_ws_track(&t->ws, (unsigned char *) buf, ret);
+    return tunnel_write(t, 1 - s, buf, ret);
+}
+
+int tunnel_accept(time_t now) {
+    char flag;
+    int fds[2];
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } ctrl;
+    struct iovec iov = {.iov_base = &flag, .iov_len = 1};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctrl.buf, .msg_controllen = sizeof(ctrl.buf)};
+    if (recvmsg(tunnel_socket[1], &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC) <= 0) return -1;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) return 0;
+    if (cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        for (int j = 0; j < (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int); j++) close(((int *) CMSG_DATA(cmsg))[j]);
+        return 0;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+    int i = 0;
+    while (i < tunnel_size && tunnels[i].fd[0] != -1) i++;
+    if (i == tunnel_size) {
+        int size = tunnel_size == 0 ? TUNNEL_INITIAL_NUM : tunnel_size * 2;
+        tunnel *ptr = realloc(tunnels, size * sizeof(tunnel));
+        if (ptr == NULL) {
+            fprintf(stderr, ERR_STR "Unable to allocate tunnel: %s" CLR_STR "\n", strerror(errno));
+            close(fds[0]);
+            close(fds[1]);
+            return 0;
+        }
+        for (int j = tunnel_size; j < size; j++) {
+            ptr[j].fd[0] = -1;
+            ptr[j].fd[1] = -1;
+            ptr[j].gen = 0;
+        }
+        tunnels = ptr;
+        tunnel_size = size;
+    }
+
+    tunnel *t = &tunnels[i];
+    unsigned int gen = t->gen;
+    memset(t, 0, sizeof(tunnel));
+    t->gen = gen;
+    t->fd[0] = fds[0];
+    t->fd[1] = fds[1];
+    t->websocket = flag != 0;
+    t->last_active = now;
+    metrics_inc(tunnels_active);
+    for (int s = 0; s < 2; s++) {
+        fcntl(t->fd[s], F_SETFL, fcntl(t->fd[s], F_GETFL) | O_NONBLOCK);
+        struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP, .data.u64 = tunnel_event_data(i, s)};
+        if (epoll_ctl(tunnel_epoll, EPOLL_CTL_ADD, t->fd[s], &ev) != 0) {
+            fprintf(stderr, ERR_STR "Unable to add tunnel: %s" CLR_STR "\n", strerror(errno));
+            tunnel_close(i);
+            break;
+        }
+    }
+    return 0;
+}
+
+void tunnel_check(time_t now) {
+    for (int i = 0; i < tunnel_size; i++) {
+        tunnel *t = &tunnels[i];
+        if (t->fd[0] == -1) continue;
+        if (now - t->last_active >= tunnel_timeout) {
+            tunnel_close(i);
+        } else if (t->websocket && websocket_ping != 0 && t->pending[0] == NULL && t->eof == 0 &&
+                   now - t->last_active >= websocket_ping && now - t->last_ping >= websocket_ping &&
+                   t->ws.left == 0 && t->ws.hdr_len == 0) {
+            t->last_ping = now;
+            if (tunnel_write(t, 0, "\x89\x00", 2) != 0) {
+                tunnel_close(i);
+            } else {
+                tunnel_update(i);
+            }
+        }
+    }
+}
+
+void tunnel_process_term() {
+    tunnel_continue = 0;
+}
+
+int tunnel_process() {
+    struct epoll_event events[64];
+    struct rlimit limit;
+    time_t last_check = 0, now;
+
+    signal(SIGINT, tunnel_process_term);
+    signal(SIGTERM, tunnel_process_term);
+    signal(SIGUSR1, SIG_IGN);
+    close(tunnel_socket[0]);
+    tunnel_socket[0] = -1;
+
+    // every tunnel takes two file descriptors
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    tunnel_epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (tunnel_epoll < 0) {
+        fprintf(stderr, ERR_STR "Unable to create epoll instance: %s" CLR_STR "\n", strerror(errno));
+        return -1;
+    }
+    struct epoll_event ev = {.events = EPOLLIN, .data.u64 = TUNNEL_CONTROL};
+    epoll_ctl(tunnel_epoll, EPOLL_CTL_ADD, tunnel_socket[1], &ev);
+
+    while (tunnel_continue) {
+        int num = epoll_wait(tunnel_epoll, events, sizeof(events) / sizeof(events[0]), 1000);
+        if (num < 0 && errno == EINTR) {
+            continue;
+        } else if (num < 0) {
+            fprintf(stderr, ERR_STR "Unable to wait for tunnels: %s" CLR_STR "\n", strerror(errno));
+            break;
+        }
+        now = tunnel_time();
+        for (int j = 0; j < num; j++) {
+            if (events[j].data.u64 == TUNNEL_CONTROL) {
+                while (tunnel_accept(now) == 0);
+                continue;
+            }
+            int i = (int) ((events[j].data.u64 & 0xFFFFFFFF) >> 1), s = (int) (events[j].data.u64 & 1);
+            tunnel *t = &tunnels[i];
+            // the slot may have been closed (and reused) by an earlier event of this batch
+            if (t->fd[0] == -1 || t->gen != (unsigned int) (events[j].data.u64 >> 32) || (t->hup & (1 << s))) continue;
+            int ret = 0;
+            if (events[j].events & (EPOLLHUP | EPOLLERR)) {
+                ret = tunnel_drain(t, s);
+            } else {
+                if (events[j].events & EPOLLOUT && t->pending[s] != NULL) ret = tunnel_flush(t, s);
+                if (ret == 0 && events[j].events & (EPOLLIN | EPOLLRDHUP) && t->pending[1 - s] == NULL &&
+                    !(t->eof & (1 << s)) && !(t->hup & (1 << (1 - s)))) {
+                    ret = tunnel_read(t, s, now);
+                }
+            }
+            if (ret != 0 || tunnel_done(t)) {
+                tunnel_close(i);
+                continue;
+            }
+            tunnel_update(i);
+        }
+        if (now != last_check) {
+            last_check = now;
+            tunnel_check(now);
+        }
+    }
+
+    for (int i = 0; i < tunnel_size; i++) {
+        if (tunnels[i].fd[0] != -1) tunnel_close(i);
+    }
+    free(tunnels);
+    close(tunnel_epoll);
+    return 0;
+}
+
+int tunnel_init() {
+    if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, tunnel_socket) != 0) {
+        fprintf(stderr, ERR_STR "Unable to create tunnel socket: %s" CLR_STR "\n", strerror(errno));
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // child
+        if (tunnel_process() == 0) {
+            return 1;
+        } else {
+            return -4;
+        }
+    } else if (pid > 0) {
+        // parent
+        fprintf(stderr, "Started child process with PID %i as tunnel-relay\n", pid);
+        // connection processes fall back to relaying themselves once the tunnel-relay is gone
+        close(tunnel_socket[1]);
+        tunnel_socket[1] = -1;
+        for (int i = 0; i < MAX_CHILDREN; i++) {
+            if (children[i] == 0) {
+                children[i] = pid;
+                break;
+            }
+        }
+    } else {
+        fprintf(stderr, ERR_STR "Unable to create child process: %s" CLR_STR "\n", strerror(errno));
+        close(tunnel_socket[0]);
+        close(tunnel_socket[1]);
+        tunnel_socket[0] = -1;
+        tunnel_socket[1] = -1;
+        return -3;
+    }
+
+    return 0;
+}
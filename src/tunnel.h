@@ -0,0 +1,65 @@
+/**
+ * Necronda Web Server
+ * Tunnels of upgraded connections (header file)
+ * src/tunnel.h
+ * Lorenz Stechauner, 2021-03-14
+ */
+
+#ifndef NECRONDA_SERVER_TUNNEL_H
+#define NECRONDA_SERVER_TUNNEL_H
+
+#define TUNNEL_BUF_SIZE 16384
+#define TUNNEL_INITIAL_NUM 256
+#define TUNNEL_CONTROL (~0UL)
+
+#include "necronda-server.h"
+#include "config.h"
+#include "sock.h"
+
+#include <time.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+
+typedef struct {
+    // frame boundaries in the direction server -> client
+    unsigned long long left;
+    unsigned char hdr[14];
+    unsigned char hdr_len;
+} tunnel_ws;
+
+typedef struct {
+    // [0] client, [1] server
+    int fd[2];
+    char *pending[2];
+    unsigned long pending_len[2];
+    unsigned long pending_off[2];
+    // generation of the slot, events of a closed or reused slot are ignored
+    unsigned int gen;
+    // sides that sent their end of data, the other side gets the remaining data and then the end
+    unsigned char eof:2;
+    // sides that were hung up, nothing can be sent to them anymore
+    unsigned char hup:2;
+    unsigned char websocket:1;
+    tunnel_ws ws;
+    time_t last_active;
+    time_t last_ping;
+} tunnel;
+
+tunnel *tunnels = NULL;
+int tunnel_size = 0;
+int tunnel_epoll = -1;
+int tunnel_socket[2] = {-1, -1};
+int tunnel_continue = 1;
+
+
+int tunnel_init();
+
+int tunnel_ws_track(tunnel_ws *ws, const unsigned char *buf, unsigned long len);
+
+int tunnel_handoff(sock *client, sock *server, int websocket);
+
+int tunnel_relay(sock *client, sock *server, int websocket);
+
+#endif //NECRONDA_SERVER_TUNNEL_H
@@ -0,0 +1,435 @@
+/**
+ * Necronda Web Server
+ * Upstream server groups and load balancing
+ * src/upstream.c
+ * Lorenz Stechauner, 2021-01-31
+ */
+
+#include "upstream.h"
+
+
+time_t upstream_time() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+unsigned long upstream_time_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+int upstream_init() {
+    int shm_id = shmget(SHM_KEY_UPSTREAM, sizeof(upstream_table), IPC_CREAT | IPC_EXCL | 0600);
+    if (shm_id < 0) {
+        fprintf(stderr, ERR_STR "Unable to create shared memory: %s" CLR_STR "\n", strerror(errno));
+        return -1;
+    }
+
+    void *shm_rw = shmat(shm_id, NULL, 0);
+    if (shm_rw == (void *) -1) {
+        fprintf(stderr, ERR_STR "Unable to attach shared memory (rw): %s" CLR_STR "\n", strerror(errno));
+        return -2;
+    }
+    upstreams = shm_rw;
+    memset(upstreams, 0, sizeof(upstream_table));
+    if ((errno = shm_mutex_init(&upstreams->session_lock)) != 0) {
+        fprintf(stderr, ERR_STR "Unable to initialize lock: %s" CLR_STR "\n", strerror(errno));
+        return -2;
+    }
+    return 0;
+}
+
+int upstream_unload() {
+    int shm_id = shmget(SHM_KEY_UPSTREAM, 0, 0);
+    if (shm_id < 0) {
+        fprintf(stderr, ERR_STR "Unable to get shared memory id: %s" CLR_STR "\n", strerror(errno));
+        shmdt(upstreams);
+        return -1;
+    } else if (shmctl(shm_id, IPC_RMID, NULL) < 0) {
+        fprintf(stderr, ERR_STR "Unable to configure shared memory: %s" CLR_STR "\n", strerror(errno));
+        shmdt(upstreams);
+        return -1;
+    }
+    shmdt(upstreams);
+    upstreams = NULL;
+    return 0;
+}
+
+int upstream_add_server(const char *name, int resolve) {
+    upstream_server *srv = NULL;
+    for (int i = 0; i < upstream_server_num; i++) {
+        if (strcmp(upstream_servers[i].name, name) == 0) {
+            srv = &upstream_servers[i];
+            if (!resolve || srv->addr_len != 0) return i;
+            break;
+        }
+    }
+    if (srv == NULL) {
+        if (upstream_server_num >= UPSTREAM_MAX_SERVERS || strlen(name) >= sizeof(upstream_servers[0].name)) {
+            fprintf(stderr, ERR_STR "Unable to add upstream server %s" CLR_STR "\n", name);
+            return -1;
+        }
+        srv = &upstream_servers[upstream_server_num];
+        memset(srv, 0, sizeof(upstream_server));
+        strcpy(srv->name, name);
+    }
+
+    if (strncmp(name, "unix:", 5) == 0) {
+        struct sockaddr_un *addr = (struct sockaddr_un *) &srv->addr;
+        if (strlen(name + 5) >= sizeof(addr->sun_path)) {
+            fprintf(stderr, ERR_STR "Unix socket path too long: %s" CLR_STR "\n", name + 5);
+            return -1;
+        }
+        addr->sun_family = AF_UNIX;
+        strcpy(addr->sun_path, name + 5);
+        srv->addr_len = sizeof(struct sockaddr_un);
+    } else {
+        const char *port = strrchr(name, ':');
+        if (port == NULL || port == name || port[1] == 0) {
+            fprintf(stderr, ERR_STR "Invalid upstream address: %s" CLR_STR "\n", name);
+            return -1;
+        }
+        if (name[0] == '[' && port[-1] == ']') {
+            sprintf(srv->host, "%.*s", (int) (port - name - 2), name + 1);
+        } else {
+            sprintf(srv->host, "%.*s", (int) (port - name), name);
+        }
+        srv->port = (unsigned short) strtoul(port + 1, NULL, 10);
+
+        if (resolve) {
+            struct addrinfo hints, *res;
+            memset(&hints, 0, sizeof(hints));
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            int ret = getaddrinfo(srv->host, port + 1, &hints, &res);
+            if (ret != 0) {
+                fprintf(stderr, ERR_STR "Unable to resolve upstream address %s: %s" CLR_STR "\n", name,
+                        gai_strerror(ret));
+                return -1;
+            }
+            memcpy(&srv->addr, res->ai_addr, res->ai_addrlen);
+            srv->addr_len = res->ai_addrlen;
+            freeaddrinfo(res);
+        }
+    }
+    if (srv == &upstream_servers[upstream_server_num]) {
+        return upstream_server_num++;
+    }
+    return (int) (srv - upstream_servers);
+}
+
+int upstream_add_to_group(upstream_group *group, int server, unsigned short weight) {
+    if (server < 0 || group->num >= UPSTREAM_MAX_GROUP || weight == 0) {
+        return -1;
+    }
+    group->servers[group->num] = server;
+    group->weights[group->num] = weight;
+    group->num++;
+    return 0;
+}
+
+int upstream_parse_policy(const char *str) {
+    if (strcmp(str, "round_robin") == 0) {
+        return UPSTREAM_POLICY_ROUND_ROBIN;
+    } else if (strcmp(str, "least_conn") == 0) {
+        return UPSTREAM_POLICY_LEAST_CONN;
+    } else if (strcmp(str, "weighted") == 0) {
+        return UPSTREAM_POLICY_WEIGHTED;
+    } else if (strcmp(str, "peak_ewma") == 0) {
+        return UPSTREAM_POLICY_PEAK_EWMA;
+    } else if (strcmp(str, "hash_uri") == 0) {
+        return UPSTREAM_POLICY_HASH_URI;
+    } else if (strcmp(str, "hash_ip") == 0) {
+        return UPSTREAM_POLICY_HASH_IP;
+    }
+    return -1;
+}
+
+int upstream_available(int server, time_t now, unsigned long exclude) {
+    if (exclude & (1UL << server)) return 0;
+    if (upstreams == NULL) return 1;
+    upstream_state *state = &upstreams->servers[server];
+    return !state->down && (state->circuit == UPSTREAM_CIRCUIT_CLOSED || state->open_until <= now);
+}
+
+int upstream_claim(int server, time_t now) {
+    if (upstreams == NULL) return 1;
+    upstream_state *state = &upstreams->servers[server];
+    if (state->circuit == UPSTREAM_CIRCUIT_CLOSED) return 1;
+    // the timeout of an open circuit has passed, exactly one request may test the server
+    time_t until = state->open_until;
+    if (until > now || !__atomic_compare_exchange_n(&state->open_until, &until, now + UPSTREAM_FAIL_TIMEOUT, 0,
+                                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    state->circuit = UPSTREAM_CIRCUIT_HALF_OPEN;
+    print(BLUE_STR "Testing recovery of upstream server %s" CLR_STR, upstream_servers[server].name);
+    return 1;
+}
+
+const char *upstream_hash_key(const upstream_group *group, const char *uri, const char *addr) {
+    if (group->policy == UPSTREAM_POLICY_HASH_URI) {
+        return uri;
+    } else if (group->policy == UPSTREAM_POLICY_HASH_IP) {
+        return addr;
+    }
+    return NULL;
+}
+
+unsigned long upstream_hash(const char *str, unsigned long seed) {
+    // FNV-1a followed by the splitmix64 finalizer
+    unsigned long h = 0xcbf29ce484222325UL ^ seed;
+    for (; *str != 0; str++) {
+        h ^= (unsigned char) *str;
+        h *= 0x100000001b3UL;
+    }
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9UL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebUL;
+    h ^= h >> 31;
+    return h;
+}
+
+double upstream_ewma(const upstream_state *state, unsigned long now) {
+    unsigned long ewma = __atomic_load_n(&state->ewma, __ATOMIC_RELAXED);
+    unsigned long stamp = __atomic_load_n(&state->ewma_stamp, __ATOMIC_RELAXED);
+    if (ewma == 0) return 0;
+    return (double) ewma * exp(-(double) (now - stamp) / UPSTREAM_EWMA_DECAY);
+}
+
+int upstream_select(const upstream_group *group, int group_id, unsigned long exclude, const char *key) {
+    if (group->num == 0) return -1;
+    time_t now = upstream_time();
+    unsigned long rr = upstreams != NULL ? __atomic_fetch_add(&upstreams->rr[group_id], 1, __ATOMIC_RELAXED) : 0;
+    int best = -1;
+
+    if ((group->policy == UPSTREAM_POLICY_HASH_URI || group->policy == UPSTREAM_POLICY_HASH_IP) && key != NULL) {
+        // weighted rendezvous hashing, only keys of an unavailable server move elsewhere
+        double best_score = 0;
+        for (int i = 0; i < group->num; i++) {
+            if (!upstream_available(group->servers[i], now, exclude)) continue;
+            unsigned long h = upstream_hash(key, upstream_hash(upstream_servers[group->servers[i]].name, 0));
+            double u = ((double) (h >> 11) + 0.5) / 9007199254740992.0;
+            double score = -group->weights[i] / log(u);
+            if (best < 0 || score > best_score) {
+                best = i;
+                best_score = score;
+            }
+        }
+    } else if (group->policy == UPSTREAM_POLICY_PEAK_EWMA && upstreams != NULL) {
+        // lowest decayed peak latency times outstanding requests relative to weight
+        unsigned long now_us = upstream_time_us();
+        double best_cost = 0;
+        for (int i = 0; i < group->num; i++) {
+            int pos = (int) ((rr + i) % group->num);
+            if (!upstream_available(group->servers[pos], now, exclude)) continue;
+            upstream_state *state = &upstreams->servers[group->servers[pos]];
+            double cost = upstream_ewma(state, now_us) * (state->active + 1) / group->weights[pos];
+            if (best < 0 || cost < best_cost) {
+                best = pos;
+                best_cost = cost;
+            }
+        }
+    } else if (group->policy == UPSTREAM_POLICY_LEAST_CONN && upstreams != NULL) {
+        // fewest outstanding requests relative to weight, ties are broken round-robin
+        for (int i = 0; i < group->num; i++) {
+            int pos = (int) ((rr + i) % group->num);
+            if (!upstream_available(group->servers[pos], now, exclude)) continue;
+            if (best < 0 || (unsigned long) upstreams->servers[group->servers[pos]].active * group->weights[best] <
+                            (unsigned long) upstreams->servers[group->servers[best]].active * group->weights[pos]) {
+                best = pos;
+            }
+        }
+    } else {
+        int start = (int) (rr % group->num);
+        if (group->policy == UPSTREAM_POLICY_WEIGHTED) {
+            unsigned long total = 0;
+            for (int i = 0; i < group->num; i++) total += group->weights[i];
+            unsigned long w = rr % total;
+            for (start = 0; w >= group->weights[start]; start++) w -= group->weights[start];
+        }
+        for (int i = 0; i < group->num; i++) {
+            int pos = (start + i) % group->num;
+            if (upstream_available(group->servers[pos], now, exclude)) {
+                best = pos;
+                break;
+            }
+        }
+    }
+
+    if (best < 0) {
+        // every server is down or its circuit is open, fail fast
+        return -1;
+    } else if (!upstream_claim(group->servers[best], now)) {
+        // another process is already testing this server
+        return upstream_select(group, group_id, exclude | (1UL << group->servers[best]), key);
+    }
+    return group->servers[best];
+}
+
+void upstream_start(int server) {
+    if (upstreams == NULL) return;
+    __atomic_fetch_add(&upstreams->servers[server].active, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&upstreams->servers[server].requests, 1, __ATOMIC_RELAXED);
+}
+
+void upstream_finish(int server) {
+    if (upstreams == NULL) return;
+    __atomic_fetch_sub(&upstreams->servers[server].active, 1, __ATOMIC_RELAXED);
+}
+
+void upstream_open(int server) {
+    upstream_state *state = &upstreams->servers[server];
+    state->fails = 0;
+    state->open_until = upstream_time() + UPSTREAM_FAIL_TIMEOUT;
+    state->circuit = UPSTREAM_CIRCUIT_OPEN;
+    __atomic_fetch_add(&state->opens, 1, __ATOMIC_RELAXED);
+}
+
+void upstream_success(int server) {
+    if (upstreams == NULL) return;
+    upstream_state *state = &upstreams->servers[server];
+    state->fails = 0;
+    if (state->circuit != UPSTREAM_CIRCUIT_CLOSED) {
+        state->circuit = UPSTREAM_CIRCUIT_CLOSED;
+        print(BLUE_STR "Upstream server %s recovered, closing circuit" CLR_STR, upstream_servers[server].name);
+    }
+}
+
+void upstream_fail(int server) {
+    if (upstreams == NULL) return;
+    upstream_state *state = &upstreams->servers[server];
+    __atomic_fetch_add(&state->failures, 1, __ATOMIC_RELAXED);
+    if (state->circuit == UPSTREAM_CIRCUIT_HALF_OPEN) {
+        upstream_open(server);
+        print(ERR_STR "Upstream server %s did not recover, opening circuit for %i s" CLR_STR,
+              upstream_servers[server].name, UPSTREAM_FAIL_TIMEOUT);
+    } else if (state->circuit == UPSTREAM_CIRCUIT_CLOSED &&
+               __atomic_add_fetch(&state->fails, 1, __ATOMIC_RELAXED) >= UPSTREAM_MAX_FAILS) {
+        upstream_open(server);
+        print(ERR_STR "Upstream server %s failed %i times, opening circuit for %i s" CLR_STR,
+              upstream_servers[server].name, UPSTREAM_MAX_FAILS, UPSTREAM_FAIL_TIMEOUT);
+    }
+}
+
+void upstream_latency(int server, unsigned long usec) {
+    if (upstreams == NULL) return;
+    // concurrent updates may overwrite each other, a lost sample is irrelevant for the average
+    upstream_state *state = &upstreams->servers[server];
+    unsigned long now = upstream_time_us();
+    double ewma = (double) state->ewma;
+    if (usec > ewma) {
+        ewma = (double) usec;
+    } else {
+        double w = exp(-(double) (now - state->ewma_stamp) / UPSTREAM_EWMA_DECAY);
+        ewma = ewma * w + (double) usec * (1 - w);
+    }
+    __atomic_store_n(&state->ewma, ewma < 1 ? 1 : (unsigned long) ewma, __ATOMIC_RELAXED);
+    __atomic_store_n(&state->ewma_stamp, now, __ATOMIC_RELAXED);
+}
+
+void upstream_session_lock() {
+    shm_mutex_lock(&upstreams->session_lock);
+}
+
+void upstream_session_unlock() {
+    shm_mutex_unlock(&upstreams->session_lock);
+}
+
+int upstream_tls_new_session(SSL *ssl, SSL_SESSION *session) {
+    // called for every new session or TLS 1.3 ticket, the oldest stored one is replaced
+    upstream_server *srv = SSL_get_app_data(ssl);
+    if (srv == NULL || upstreams == NULL || !SSL_SESSION_is_resumable(session)) return 0;
+    upstream_state *state = &upstreams->servers[srv - upstream_servers];
+
+    unsigned char buf[UPSTREAM_SESSION_SIZE], *ptr = buf;
+    int len = i2d_SSL_SESSION(session, NULL);
+    if (len <= 0 || len > sizeof(buf) || i2d_SSL_SESSION(session, &ptr) != len) return 0;
+
+    upstream_session_lock();
+    upstream_session *slot = &state->sessions[0];
+    for (int i = 0; i < UPSTREAM_SESSIONS; i++) {
+        upstream_session *s = &state->sessions[i];
+        if (s->len == 0) {
+            slot = s;
+            break;
+        } else if (s->seq < slot->seq) {
+            slot = s;
+        }
+    }
+    memcpy(slot->data, buf, len);
+    slot->len = (unsigned short) len;
+    slot->expires = SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session);
+    slot->reusable = SSL_SESSION_get_protocol_version(session) < TLS1_3_VERSION;
+    slot->seq = ++state->session_seq;
+    upstream_session_unlock();
+    return 0;
+}
+
+void upstream_tls_init(SSL_CTX *ctx) {
+    // sessions are kept in shared memory instead of the context of a single process
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, upstream_tls_new_session);
+}
+
+void upstream_tls_prepare(int server, SSL *ssl) {
+    upstream_server *srv = &upstream_servers[server];
+    struct in6_addr addr6;
+    struct in_addr addr4;
+    SSL_set_app_data(ssl, srv);
+
+    // SNI must not contain IP addresses
+    if (inet_pton(AF_INET, srv->host, &addr4) != 1 && inet_pton(AF_INET6, srv->host, &addr6) != 1) {
+        SSL_set_tlsext_host_name(ssl, srv->host);
+    }
+
+    if (upstreams == NULL) return;
+    upstream_state *state = &upstreams->servers[server];
+    unsigned char buf[UPSTREAM_SESSION_SIZE];
+    const unsigned char *ptr = buf;
+    long len = 0;
+    time_t now = time(NULL);
+    upstream_session *newest = NULL;
+    upstream_session_lock();
+    for (int i = 0; i < UPSTREAM_SESSIONS; i++) {
+        upstream_session *s = &state->sessions[i];
+        if (s->len == 0) {
+            continue;
+        } else if (now >= s->expires) {
+            s->len = 0;
+        } else if (newest == NULL || s->seq > newest->seq) {
+            newest = s;
+        }
+    }
+    if (newest != NULL) {
+        len = newest->len;
+        memcpy(buf, newest->data, len);
+        // a ticket is taken out, so no other process offers it to the server again
+        if (!newest->reusable) newest->len = 0;
+    }
+    upstream_session_unlock();
+    if (len == 0) return;
+
+    SSL_SESSION *session = d2i_SSL_SESSION(NULL, &ptr, len);
+    if (session != NULL) {
+        SSL_set_session(ssl, session);
+        SSL_SESSION_free(session);
+    }
+}
+
+void upstream_print() {
+    if (upstreams == NULL) return;
+    time_t now = upstream_time();
+    for (int i = 0; i < upstream_server_num; i++) {
+        upstream_state *state = &upstreams->servers[i];
+        const char *status = state->down ? "down" :
+                             state->circuit == UPSTREAM_CIRCUIT_HALF_OPEN ? "half-open" :
+                             state->circuit == UPSTREAM_CIRCUIT_OPEN && state->open_until > now ? "open" : "up";
+        fprintf(stderr, "Upstream %s: %s, %u active, %lu requests, %lu failures, %lu circuit opens, %.1f ms latency\n",
+                upstream_servers[i].name, status, state->active, state->requests, state->failures, state->opens,
+                upstream_ewma(state, upstream_time_us()) / 1000);
+    }
+}
@@ -0,0 +1,132 @@
+/**
+ * Necronda Web Server
+ * Upstream server groups and load balancing (header file)
+ * src/upstream.h
+ * Lorenz Stechauner, 2021-01-31
+ */
+
+#ifndef NECRONDA_SERVER_UPSTREAM_H
+#define NECRONDA_SERVER_UPSTREAM_H
+
+#define UPSTREAM_MAX_SERVERS 32
+#define UPSTREAM_MAX_GROUP 8
+#define UPSTREAM_MAX_FAILS 3
+#define UPSTREAM_FAIL_TIMEOUT 10
+
+#define UPSTREAM_CIRCUIT_CLOSED 0
+#define UPSTREAM_CIRCUIT_OPEN 1
+#define UPSTREAM_CIRCUIT_HALF_OPEN 2
+
+#define UPSTREAM_CHECK_INTERVAL 5
+#define UPSTREAM_CHECK_TIMEOUT 2
+#define UPSTREAM_CHECK_RISE 2
+#define UPSTREAM_CHECK_FALL 2
+
+#define UPSTREAM_POLICY_ROUND_ROBIN 0
+#define UPSTREAM_POLICY_LEAST_CONN 1
+#define UPSTREAM_POLICY_WEIGHTED 2
+#define UPSTREAM_POLICY_PEAK_EWMA 3
+#define UPSTREAM_POLICY_HASH_URI 4
+#define UPSTREAM_POLICY_HASH_IP 5
+
+#define UPSTREAM_EWMA_DECAY 10000000
+#define UPSTREAM_SESSION_SIZE 4096
+#define UPSTREAM_SESSIONS 4
+
+#include "utils.h"
+
+#include <stdio.h>
+#include <math.h>
+#include <netdb.h>
+#include <sys/un.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+
+
+typedef struct {
+    char name[256];
+    char host[256];
+    unsigned short port;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    char check_path[256];
+    char check_host[256];
+    unsigned short check_interval;
+    unsigned char check_enc:1;
+} upstream_server;
+
+typedef struct {
+    unsigned char num;
+    unsigned char policy;
+    unsigned short servers[UPSTREAM_MAX_GROUP];
+    unsigned short weights[UPSTREAM_MAX_GROUP];
+} upstream_group;
+
+typedef struct {
+    // TLS session (DER), shared by all processes
+    unsigned long seq;
+    time_t expires;
+    unsigned short len;
+    unsigned char reusable:1;   // TLS 1.3 tickets are used only once (RFC 8446, C.4)
+    unsigned char data[UPSTREAM_SESSION_SIZE];
+} upstream_session;
+
+typedef struct {
+    unsigned int active;
+    unsigned int fails;
+    int circuit;
+    time_t open_until;
+    unsigned char down;         // set by the health checker
+    unsigned long requests;
+    unsigned long failures;
+    unsigned long opens;
+    unsigned long ewma;         // peak-sensitive latency average in microseconds
+    unsigned long ewma_stamp;
+    unsigned long session_seq;
+    upstream_session sessions[UPSTREAM_SESSIONS];
+} upstream_state;
+
+typedef struct {
+    pthread_mutex_t session_lock;
+    upstream_state servers[UPSTREAM_MAX_SERVERS];
+    unsigned long rr[MAX_HOST_CONFIG];
+} upstream_table;
+
+upstream_server upstream_servers[UPSTREAM_MAX_SERVERS];
+int upstream_server_num = 0;
+upstream_table *upstreams;
+
+
+int upstream_init();
+
+int upstream_unload();
+
+int upstream_add_server(const char *name, int resolve);
+
+int upstream_add_to_group(upstream_group *group, int server, unsigned short weight);
+
+int upstream_parse_policy(const char *str);
+
+const char *upstream_hash_key(const upstream_group *group, const char *uri, const char *addr);
+
+int upstream_select(const upstream_group *group, int group_id, unsigned long exclude, const char *key);
+
+void upstream_start(int server);
+
+void upstream_finish(int server);
+
+void upstream_success(int server);
+
+void upstream_fail(int server);
+
+void upstream_latency(int server, unsigned long usec);
+
+void upstream_tls_init(SSL_CTX *ctx);
+
+void upstream_tls_prepare(int server, SSL *ssl);
+
+void upstream_print();
+
+#endif //NECRONDA_SERVER_UPSTREAM_H
@@ -172,6 +172,15 @@ int uri_init(http_uri *uri, const char *webroot, const char *uri_str, int dir_mo
     return 0;
 }
 
+int uri_is_internal(const http_uri *uri, const char *prefix) {
+    // "/protected" covers the file "/protected" and everything below "/protected/" in the webroot
+    unsigned long len = strlen(prefix);
+    if (len == 0 || uri->filename == NULL) return 0;
+    const char *filename = uri->filename + strlen(uri->webroot);
+    if (strncmp(filename, prefix, len) != 0) return 0;
+    return prefix[len - 1] == '/' || filename[len] == 0 || filename[len] == '/';
+}
+
 void uri_free(http_uri *uri) {
     if (uri->webroot != NULL) free(uri->webroot);
     if (uri->req_path != NULL) free(uri->req_path);
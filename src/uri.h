@@ -42,6 +42,8 @@ int uri_init(http_uri *uri, const char *webroot, const char *uri_str, int dir_mo
 
 int uri_init_cache(http_uri *uri);
 
+int uri_is_internal(const http_uri *uri, const char *prefix);
+
 void uri_free(http_uri *uri);
 
 #endif //NECRONDA_SERVER_URI_H
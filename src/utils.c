@@ -99,6 +99,30 @@ int url_decode(const char *str, char *dec, ssize_t *size) {
     return 0;
 }
 
+int shm_mutex_init(pthread_mutex_t *mutex) {
+    // shared between the processes and robust, a process dying while holding it does not block the others
+    pthread_mutexattr_t attr;
+    int ret = pthread_mutexattr_init(&attr);
+    if (ret != 0) return ret;
+    ret = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    if (ret == 0) ret = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    if (ret == 0) ret = pthread_mutex_init(mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    return ret;
+}
+
+void shm_mutex_lock(pthread_mutex_t *mutex) {
+    if (pthread_mutex_lock(mutex) == EOWNERDEAD) {
+        // the tables behind these locks only hold cached data, at worst one entry is stale
+        print(ERR_STR "Recovered lock of a terminated process" CLR_STR);
+        pthread_mutex_consistent(mutex);
+    }
+}
+
+void shm_mutex_unlock(pthread_mutex_t *mutex) {
+    pthread_mutex_unlock(mutex);
+}
+
 MMDB_entry_data_list_s *mmdb_json(MMDB_entry_data_list_s *list, char *str, long *str_off, long str_len) {
     switch (list->entry_data.type) {
         case MMDB_DATA_TYPE_MAP:
@@ -8,6 +8,8 @@
 #ifndef NECRONDA_SERVER_UTILS_H
 #define NECRONDA_SERVER_UTILS_H
 
+#include <pthread.h>
+
 char *log_prefix;
 
 #define out_1(fmt) fprintf(stdout, "%s" fmt "\n", log_prefix)
@@ -28,4 +30,10 @@ int url_encode(const char *str, char *enc, ssize_t *size);
 
 int url_decode(const char *str, char *dec, ssize_t *size);
 
+int shm_mutex_init(pthread_mutex_t *mutex);
+
+void shm_mutex_lock(pthread_mutex_t *mutex);
+
+void shm_mutex_unlock(pthread_mutex_t *mutex);
+
 #endif //NECRONDA_SERVER_UTILS_H
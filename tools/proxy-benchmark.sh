@@ -0,0 +1,100 @@
+#!/bin/bash
+#
+# Necronda Web Server
+# Reverse proxy throughput benchmark (splice vs. buffered copy)
+# tools/proxy-benchmark.sh
+# Lorenz Stechauner, 2021-06-12
+#
+# Usage: sudo tools/proxy-benchmark.sh [size in MiB, default 256] [runs, default 5]
+# Needs root (ports 80/443, /var/necronda-server) and no other running server.
+# BACKEND=host:port uses an existing backend instead of a local python3 http.server serving /file,
+# CFLAGS and LIBS are passed to gcc (e.g. CFLAGS='-D MAGIC_FILE="/usr/share/file/magic.mgc"').
+
+set -e
+cd "$(dirname "$0")/.."
+
+SIZE=${1:-256}
+RUNS=${2:-5}
+LIBS=${LIBS:--lssl -lcrypto -lmagic -lz -lbrotlienc -lmaxminddb -lm -lpthread}
+TMP=$(mktemp -d /tmp/necronda-benchmark.XXXXXX)
+SERVER_PID=
+BACKEND_PID=
+
+cleanup() {
+    [ -n "$SERVER_PID" ] && kill "$SERVER_PID" 2>/dev/null && wait "$SERVER_PID" 2>/dev/null
+    [ -n "$BACKEND_PID" ] && kill "$BACKEND_PID" 2>/dev/null
+    rm -rf "$TMP"
+}
+trap cleanup EXIT
+
+echo "Compiling..."
+# PLAIN_HTTP_PROXY lets the proxy host answer plain HTTP, so both sides are plain TCP and splice() is possible
+compile() {
+    if ! gcc src/necronda-server.c -o "$TMP/$1" -std=c11 $LIBS -D PLAIN_HTTP_PROXY=1 "${@:2}" $CFLAGS 2> "$TMP/gcc.log"; then
+        cat "$TMP/gcc.log" >&2
+        exit 1
+    fi
+}
+compile splice
+compile buffered -D SOCK_SPLICE=0
+
+if [ -z "$BACKEND" ]; then
+    mkdir -p "$TMP/www"
+    head -c "${SIZE}M" /dev/zero > "$TMP/www/file"
+    python3 -m http.server 8081 --bind 127.0.0.1 --directory "$TMP/www" > /dev/null 2>&1 &
+    BACKEND_PID=$!
+    BACKEND=127.0.0.1:8081
+    sleep 0.5
+    if ! kill -0 "$BACKEND_PID" 2>/dev/null; then
+        echo "Unable to start backend on $BACKEND" >&2
+        exit 1
+    fi
+fi
+
+openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj "/CN=bench.local" \
+    -keyout "$TMP/key.pem" -out "$TMP/cert.pem" > /dev/null 2>&1
+mkdir -p /var/necronda-server
+cat > "$TMP/bench.conf" << CONF
+certificate $TMP/cert.pem
+private_key $TMP/key.pem
+
+[bench.local]
+hostname ${BACKEND%:*}
+port ${BACKEND##*:}
+http
+CONF
+
+run() {
+    local url=$1; shift
+    local speeds=()
+    curl -s -o /dev/null "$@" -H "Host: bench.local" "$url"
+    for _ in $(seq "$RUNS"); do
+        speeds+=("$(curl -s -o /dev/null -w "%{speed_download}" "$@" -H "Host: bench.local" "$url")")
+    done
+    printf '%s\n' "${speeds[@]}" | sort -n | awk '{ s[NR] = $1; t += $1 }
+        END { printf "mean %8.1f MB/s, median %8.1f MB/s\n", t / NR / 1e6, s[int((NR + 1) / 2)] / 1e6 }'
+}
+
+echo "Proxying ${SIZE} MiB from $BACKEND, $RUNS runs each"
+for bin in splice buffered; do
+    "$TMP/$bin" -c "$TMP/bench.conf" > "$TMP/$bin.log" 2>&1 &
+    SERVER_PID=$!
+    sleep 1
+    if ! kill -0 "$SERVER_PID" 2>/dev/null; then
+        cat "$TMP/$bin.log" >&2
+        exit 1
+    fi
+    printf '%-9s http:  ' "$bin"
+    run http://127.0.0.1/file
+    printf '%-9s https: ' "$bin"
+    run https://bench.local/file -k --resolve bench.local:443:127.0.0.1
+    kill "$SERVER_PID"
+    wait "$SERVER_PID" 2> /dev/null || true
+    SERVER_PID=
+done
+
+if [ -d /sys/module/tls ]; then
+    echo "kTLS is available, https responses may be spliced as well"
+else
+    echo "kTLS is not available (tls kernel module not loaded), https responses are always copied"
+fi